@@ -0,0 +1,271 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "acct.h"
+
+#include <sys/stat.h>
+#include <limits.h>
+
+struct acct_netns *acct_netns_head = NULL;
+
+static unsigned long long now_usec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+int acct_timer(struct timespec *left) {
+  static struct timespec next = {0};
+  struct timespec now;
+  int due = 0;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (now.tv_sec > next.tv_sec ||
+      (now.tv_sec == next.tv_sec && now.tv_nsec >= next.tv_nsec)) {
+    next = now;
+    next.tv_sec += ACCT_INTERVAL;
+    due = 1;
+  }
+  left->tv_sec = next.tv_sec - now.tv_sec;
+  left->tv_nsec = next.tv_nsec - now.tv_nsec;
+  if (left->tv_nsec < 0) {
+    --left->tv_sec;
+    left->tv_nsec += 1000000000;
+  }
+  return due;
+}
+
+int acct_parse_stat(const char *buf, unsigned long long *ticks, unsigned long long *rss_pages) {
+  unsigned long long utime, stime;
+
+  // comm could have spaces and parentheses, the fields start after the last ')'
+  const char *p = strrchr(buf, ')');
+  if (!p)
+    return -1;
+  // state(3) ... utime(14) stime(15) ... rss(24)
+  if (sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu"
+                    " %*d %*d %*d %*d %*d %*d %*u %*u %llu",
+             &utime, &stime, rss_pages) != 3)
+    return -1;
+  *ticks = utime + stime;
+  return 0;
+}
+
+int acct_parse_io(const char *buf, unsigned long long *read_bytes, unsigned long long *write_bytes) {
+  // read_bytes is preceded by rchar, wchar, syscr, syscw
+  const char *r = strstr(buf, "\nread_bytes:");
+  const char *w = strstr(buf, "\nwrite_bytes:");
+  if (!r || !w ||
+      sscanf(r, "\nread_bytes: %llu", read_bytes) != 1 ||
+      sscanf(w, "\nwrite_bytes: %llu", write_bytes) != 1)
+    return -1;
+  return 0;
+}
+
+int acct_parse_netdev(FILE *f, struct runns_if_stats **ifs, size_t *sz) {
+  char line[512];
+  size_t n = 0;
+
+  // Two lines of the header
+  for (int i = 0; i < 2; i++) {
+    if (!fgets(line, sizeof(line), f))
+      return -1;
+  }
+  while (fgets(line, sizeof(line), f)) {
+    struct runns_if_stats s = {0};
+    if (sscanf(line, " %15[^:]: %llu %llu %llu %llu %*u %*u %*u %*u %llu %llu %llu %llu",
+               s.name, &s.rx_bytes, &s.rx_packets, &s.rx_errs, &s.rx_drop,
+               &s.tx_bytes, &s.tx_packets, &s.tx_errs, &s.tx_drop) != 9)
+      return -1;
+    if (n >= *sz) {
+      struct runns_if_stats *v = (struct runns_if_stats *)realloc(*ifs, (n + 1) * sizeof(s));
+      if (!v)
+        return -1;
+      *ifs = v;
+    }
+    (*ifs)[n++] = s;
+  }
+  *sz = n;
+  return 0;
+}
+
+// Read a small /proc file into buf. Returns 0 on success.
+static int read_proc(const char *path, char *buf, size_t sz) {
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  ssize_t len = read(fd, buf, sz - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+  return 0;
+}
+
+static void sample_job(struct runns_child *c, unsigned long long now) {
+  static long tick_usec = 0, page_kb = 0;
+  char path[64], buf[1024];
+  unsigned long long ticks, rss;
+  struct runns_job_stats *s = &c->stats;
+
+  if (!tick_usec) {
+    tick_usec = 1000000 / sysconf(_SC_CLK_TCK);
+    page_kb = sysconf(_SC_PAGESIZE) / 1024;
+  }
+  snprintf(path, sizeof(path), "/proc/%d/stat", c->pid);
+  if (read_proc(path, buf, sizeof(buf)) || acct_parse_stat(buf, &ticks, &rss))
+    return;
+  unsigned long long cpu = ticks * tick_usec;
+  if (s->sampled_usec && now > s->sampled_usec && cpu >= s->cpu_usec)
+    s->cpu_permille = (cpu - s->cpu_usec) * 1000 / (now - s->sampled_usec);
+  s->cpu_usec = cpu;
+  s->rss_kb = rss * page_kb;
+  // The I/O counters are kept from the previous sample if io is not readable
+  snprintf(path, sizeof(path), "/proc/%d/io", c->pid);
+  if (!read_proc(path, buf, sizeof(buf)))
+    acct_parse_io(buf, &s->read_bytes, &s->write_bytes);
+  s->sampled_usec = now;
+}
+
+static struct acct_netns *acct_find(dev_t dev, ino_t ino) {
+  for (struct acct_netns *a = acct_netns_head; a; a = a->next) {
+    if (a->dev == dev && a->ino == ino)
+      return a;
+  }
+  struct acct_netns *a = (struct acct_netns *)calloc(1, sizeof(struct acct_netns));
+  if (!a)
+    return NULL;
+  a->dev = dev;
+  a->ino = ino;
+  a->next = acct_netns_head;
+  acct_netns_head = a;
+  return a;
+}
+
+// fd is /proc/net/dev opened in the namespace
+static void sample_netdev(struct acct_netns *a, int fd, unsigned long long now) {
+  FILE *f = fd != -1 ? fdopen(fd, "r") : NULL;
+  if (!f) {
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  if (!acct_parse_netdev(f, &a->ifs, &a->ifs_sz)) {
+    a->sampled_usec = now;
+    a->seen = 1;
+  }
+  fclose(f);
+}
+
+void acct_sample(struct runns_child *childs, unsigned int n) {
+  unsigned long long now = now_usec();
+  char path[64];
+  struct stat st;
+
+  for (struct acct_netns *a = acct_netns_head; a; a = a->next)
+    a->seen = 0;
+  for (unsigned int i = 0; i < n; i++)
+    sample_job(&childs[i], now);
+
+  for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext) {
+    struct acct_netns *a = acct_find(ns->dev, ns->ino);
+    if (!a)
+      continue;
+    if (!a->path)
+      a->path = strdup(ns->path);
+    sample_netdev(a, netns_open(ns, "/proc/self/net/dev", O_RDONLY), now);
+  }
+  // The namespaces of the jobs are read through the jobs, they are not kept
+  // open by the daemon.
+  for (unsigned int i = 0; i < n; i++) {
+    if (!childs[i].ns_ino)
+      continue;
+    struct acct_netns *a = acct_find(childs[i].ns_dev, childs[i].ns_ino);
+    if (!a || a->seen)
+      continue;
+    // The job could have moved to another namespace
+    snprintf(path, sizeof(path), "/proc/%d/ns/net", childs[i].pid);
+    if (stat(path, &st) || st.st_dev != a->dev || st.st_ino != a->ino)
+      continue;
+    snprintf(path, sizeof(path), "/proc/%d/net/dev", childs[i].pid);
+    sample_netdev(a, open(path, O_RDONLY | O_CLOEXEC), now);
+  }
+
+  for (struct acct_netns **pp = &acct_netns_head; *pp;) {
+    struct acct_netns *a = *pp;
+    if (a->seen) {
+      pp = &a->next;
+      continue;
+    }
+    *pp = a->next;
+    free(a->path);
+    free(a->ifs);
+    free(a);
+  }
+}
+
+void acct_netns_path(dev_t dev, ino_t ino, const char *path) {
+  struct acct_netns *a = acct_find(dev, ino);
+  if (a && !a->path)
+    a->path = strdup(path);
+}
+
+void acct_netns_name(dev_t dev, ino_t ino, char *buf, size_t sz) {
+  for (struct acct_netns *a = acct_netns_head; a; a = a->next) {
+    if (a->dev == dev && a->ino == ino && a->path) {
+      snprintf(buf, sz, "%s", a->path);
+      return;
+    }
+  }
+  snprintf(buf, sz, "net:[%lu]", (unsigned long)ino);
+}
+
+int acct_save(int fd) {
+  unsigned int n = 0;
+
+  for (struct acct_netns *a = acct_netns_head; a; a = a->next)
+    n += a->path != NULL;
+  if (write(fd, (void *)&n, sizeof(n)) != sizeof(n))
+    return -1;
+  for (struct acct_netns *a = acct_netns_head; a; a = a->next) {
+    if (!a->path)
+      continue;
+    size_t sz = strlen(a->path) + 1;
+    if (write(fd, (void *)&a->dev, sizeof(a->dev)) != sizeof(a->dev) ||
+        write(fd, (void *)&a->ino, sizeof(a->ino)) != sizeof(a->ino) ||
+        write(fd, (void *)&sz, sizeof(sz)) != sizeof(sz) ||
+        write(fd, a->path, sz) != (ssize_t)sz) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int acct_load(int fd) {
+  unsigned int n;
+  dev_t dev;
+  ino_t ino;
+  size_t sz;
+  char path[PATH_MAX];
+
+  if (read(fd, (void *)&n, sizeof(n)) != sizeof(n))
+    return -1;
+  for (unsigned int i = 0; i < n; i++) {
+    if (read(fd, (void *)&dev, sizeof(dev)) != sizeof(dev) ||
+        read(fd, (void *)&ino, sizeof(ino)) != sizeof(ino) ||
+        read(fd, (void *)&sz, sizeof(sz)) != sizeof(sz) ||
+        !sz || sz > sizeof(path) || read(fd, path, sz) != (ssize_t)sz) {
+      return -1;
+    }
+    path[sz - 1] = '\0';
+    acct_netns_path(dev, ino, path);
+  }
+  return 0;
+}
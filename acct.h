@@ -0,0 +1,57 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef ACCT_H
+#define ACCT_H
+
+#include <stdio.h>
+#include <sys/types.h>
+#include <time.h>
+
+struct runns_child;
+struct runns_if_stats;
+
+// Seconds between the samples
+#define ACCT_INTERVAL 5
+
+// Interface counters of a network namespace from the last sample
+struct acct_netns {
+  dev_t dev;
+  ino_t ino;
+  char *path;         // NULL if not known, e.g. for jobs adopted on restart
+  unsigned long long sampled_usec;
+  struct runns_if_stats *ifs;
+  size_t ifs_sz;
+  int seen;
+  struct acct_netns *next;
+};
+
+extern struct acct_netns *acct_netns_head;
+
+// Returns 1 if a sample is due, left is set to the time until the next one.
+int acct_timer(struct timespec *left);
+// Sample the jobs and the namespaces, both the ones opened by the daemon and
+// the ones the jobs run in. Namespaces without jobs and references are
+// forgotten.
+void acct_sample(struct runns_child *childs, unsigned int n);
+// Remember the path of a job namespace, /proc knows only its inode.
+void acct_netns_path(dev_t dev, ino_t ino, const char *path);
+// Path of the namespace or net:[<inode>]
+void acct_netns_name(dev_t dev, ino_t ino, char *buf, size_t sz);
+// Write the known paths to fd and read them back, used on restart.
+int acct_save(int fd);
+int acct_load(int fd);
+
+// Parsers of the /proc files. Return 0 on success.
+// /proc/<pid>/stat: user + system time in ticks and RSS in pages
+int acct_parse_stat(const char *buf, unsigned long long *ticks, unsigned long long *rss_pages);
+// /proc/<pid>/io: storage I/O
+int acct_parse_io(const char *buf, unsigned long long *read_bytes, unsigned long long *write_bytes);
+// /proc/net/dev: the array is reallocated to the number of interfaces
+int acct_parse_netdev(FILE *f, struct runns_if_stats **ifs, size_t *sz);
+
+#endif
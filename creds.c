@@ -0,0 +1,220 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "creds.h"
+
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+#include <grp.h>
+#include <pwd.h>
+#include <signal.h>
+
+static struct creds_entry *cache[CREDS_CACHE_MAX];
+static unsigned int cache_sz;
+
+static time_t now_sec() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+int creds_resolve(uid_t uid, struct creds *c) {
+  memset(c, 0, sizeof(*c));
+  c->uid = uid;
+
+  errno = 0;
+  struct passwd *pw = getpwuid(uid);
+  if (!pw) {
+    int err = errno;
+    endpwent();
+    // See getpwuid(3) for the errors meaning there is no such user
+    return err == 0 || err == ENOENT || err == ESRCH || err == EBADF || err == EPERM ? 0 : -1;
+  }
+
+  c->found = 1;
+  c->gid = pw->pw_gid;
+  if (snprintf(c->name, sizeof(c->name), "%s", pw->pw_name) >= (int)sizeof(c->name) ||
+      snprintf(c->home, sizeof(c->home), "%s", pw->pw_dir) >= (int)sizeof(c->home)) {
+    WARN("Too long name or home of uid=%lu", (unsigned long)uid);
+    endpwent();
+    return -1;
+  }
+  endpwent();
+
+  c->ngroups = CREDS_MAX_GROUPS;
+  if (getgrouplist(c->name, c->gid, c->groups, &c->ngroups) == -1)
+    c->ngroups = -1;
+  endgrent();
+  return 0;
+}
+
+int creds_apply(const struct creds *c) {
+  if (!c->found) {
+    WARN("Couldn't find a user with UID=%d", c->uid);
+    return -1;
+  }
+
+  if ((c->ngroups == -1 ? initgroups(c->name, c->gid) : setgroups(c->ngroups, c->groups)) != 0) {
+    WARN("Couldn't initialize the supplementary group list, errno=%d", errno);
+    return -1;
+  }
+
+  if (setgid(c->gid) != 0 || setuid(c->uid) != 0) {
+    WARN("Couldn't change to '%.32s' uid=%lu gid=%lu, errno=%d",
+         c->name,
+         (unsigned long)c->uid,
+         (unsigned long)c->gid,
+         errno);
+    return -1;
+  }
+
+  if (chdir(c->home)) {
+    WARN("Couldn't chdir to %s for '%.32s' uid=%lu gid=%lu, errno=%d",
+         c->home,
+         c->name,
+         (unsigned long)c->uid,
+         (unsigned long)c->gid,
+         errno);
+    return -1;
+  }
+
+  return 0;
+}
+
+enum creds_state creds_state(const struct creds_entry *e, time_t now) {
+  if (!e->valid)
+    return CREDS_MISS;
+  time_t age = now - e->resolved;
+  if (age < (e->c.found ? CREDS_TTL : CREDS_NEG_TTL))
+    return CREDS_FRESH;
+  // A user which was not there could be added since
+  if (e->c.found && age < CREDS_MAX_STALE)
+    return CREDS_STALE;
+  return CREDS_MISS;
+}
+
+static void creds_refresh(struct creds_entry *e) {
+  if (!e->result) {
+    e->result = mmap(NULL, sizeof(struct creds), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (e->result == MAP_FAILED) {
+      WARN("Can't allocate memory for the resolver of uid=%lu", (unsigned long)e->c.uid);
+      e->result = NULL;
+      return;
+    }
+  }
+
+  pid_t pid = fork();
+  if (pid == -1) {
+    WARN("Can't fork the resolver of uid=%lu", (unsigned long)e->c.uid);
+    return;
+  }
+  if (pid == 0) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigprocmask(SIG_SETMASK, &mask, NULL);
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    alarm(CREDS_RESOLVE_TIMEOUT);
+    _exit(creds_resolve(e->c.uid, e->result) ? EXIT_FAILURE : EXIT_SUCCESS);
+  }
+  e->refresh = pid;
+}
+
+static struct creds_entry *creds_entry(uid_t uid) {
+  for (unsigned int i = 0; i < cache_sz; i++) {
+    if (cache[i]->c.uid == uid)
+      return cache[i];
+  }
+
+  struct creds_entry *e = NULL;
+  if (cache_sz < CREDS_CACHE_MAX) {
+    e = (struct creds_entry *)malloc(sizeof(struct creds_entry));
+    if (!e) {
+      WARN("Can't allocate memory for credentials of uid=%lu", (unsigned long)uid);
+      return NULL;
+    }
+    cache[cache_sz++] = e;
+  }
+  else {
+    // Reuse the least recently used entry
+    for (unsigned int i = 0; i < cache_sz; i++) {
+      if (!cache[i]->refresh && (!e || cache[i]->used < e->used))
+        e = cache[i];
+    }
+    if (!e)
+      return NULL;
+    if (e->result)
+      munmap(e->result, sizeof(struct creds));
+  }
+
+  memset(e, 0, sizeof(*e));
+  e->c.uid = uid;
+  return e;
+}
+
+const struct creds *creds_get(uid_t uid) {
+  struct creds_entry *e = creds_entry(uid);
+  if (!e)
+    return NULL;
+
+  time_t now = now_sec();
+  enum creds_state state = creds_state(e, now);
+  if (state != CREDS_FRESH && !e->refresh && now >= e->retry)
+    creds_refresh(e);
+  e->used = now;
+  return state == CREDS_MISS ? NULL : &e->c;
+}
+
+int creds_reaped(pid_t pid, int status) {
+  for (unsigned int i = 0; i < cache_sz; i++) {
+    struct creds_entry *e = cache[i];
+    if (e->refresh != pid)
+      continue;
+
+    e->refresh = 0;
+    if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS &&
+        e->result->uid == e->c.uid) {
+      memcpy(&e->c, e->result, sizeof(struct creds));
+      e->valid = 1;
+      e->resolved = now_sec();
+    }
+    else {
+      WARN("Can't resolve uid=%lu, status=0x%x", (unsigned long)e->c.uid, status);
+      e->retry = now_sec() + CREDS_RETRY;
+    }
+    return 1;
+  }
+  return 0;
+}
+
+int creds_drop() {
+  int sig = 0;
+  pid_t ppid = getppid();
+
+  // The parent death signal is reset when the uid changes
+  prctl(PR_GET_PDEATHSIG, &sig);
+  if (setgroups(0, NULL) ||
+      setresgid(CREDS_NOBODY, CREDS_NOBODY, CREDS_NOBODY) ||
+      setresuid(CREDS_NOBODY, CREDS_NOBODY, CREDS_NOBODY) ||
+      prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0)) {
+    WARN("Can't drop privileges, errno=%d", errno);
+    return -1;
+  }
+  if (sig && (prctl(PR_SET_PDEATHSIG, sig) || getppid() != ppid))
+    return -1;
+  return 0;
+}
+
+void creds_flush() {
+  for (unsigned int i = 0; i < cache_sz; i++) {
+    cache[i]->valid = 0;
+    cache[i]->retry = 0;
+  }
+}
@@ -0,0 +1,76 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef CREDS_H
+#define CREDS_H
+
+#include <limits.h>
+#include <sys/types.h>
+#include <time.h>
+
+// The users are resolved by a resolver process forked from the daemon, a job
+// gets the cached result and doesn't touch NSS. An entry older than the TTL
+// is still used while it is refreshed, up to CREDS_MAX_STALE if the directory
+// is unreachable.
+#define CREDS_TTL 300
+#define CREDS_NEG_TTL 30
+#define CREDS_MAX_STALE 86400
+// Delay before the next refresh of an entry after a failed one
+#define CREDS_RETRY 10
+// The resolver is killed if NSS doesn't answer in time
+#define CREDS_RESOLVE_TIMEOUT 30
+#define CREDS_CACHE_MAX 64
+#define CREDS_MAX_GROUPS 1024
+// The helper processes of the daemon run as the overflow user
+#define CREDS_NOBODY 65534
+
+struct creds {
+  uid_t uid;
+  gid_t gid;
+  int found;          // 0 if there is no such user
+  int ngroups;        // -1 if the groups don't fit, initgroups() is used then
+  char name[LOGIN_NAME_MAX];
+  char home[PATH_MAX];
+  gid_t groups[CREDS_MAX_GROUPS];
+};
+
+struct creds_entry {
+  struct creds c;
+  int valid;
+  time_t resolved;    // CLOCK_MONOTONIC seconds
+  time_t retry;       // No refresh before
+  time_t used;
+  pid_t refresh;      // Resolver pid or 0
+  struct creds *result; // Shared with the resolver
+};
+
+enum creds_state {
+  CREDS_MISS,
+  CREDS_FRESH,
+  CREDS_STALE,
+};
+
+// Resolve the user uid into c. Returns 0 on success, the user could be not
+// found though, and -1 if NSS failed.
+int creds_resolve(uid_t uid, struct creds *c);
+// Become the user c, to be called in the job. Returns 0 on success.
+int creds_apply(const struct creds *c);
+// State of the entry at now
+enum creds_state creds_state(const struct creds_entry *e, time_t now);
+
+// Cached user uid, NULL if there is nothing to use yet. Starts a refresh of
+// the entry if it's missing or old.
+const struct creds *creds_get(uid_t uid);
+// Returns 1 if pid was a resolver, the result is taken into the cache.
+int creds_reaped(pid_t pid, int status);
+// Resolve all the users on the next use
+void creds_flush();
+// Drop root for good in a helper process, to be called when the privileged
+// setup is done, the parent death signal is kept. Returns 0 on success.
+int creds_drop();
+
+#endif
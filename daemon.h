@@ -0,0 +1,33 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2019-2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <syslog.h>
+#include <errno.h>
+
+// Emit log message
+#define ERR(format, ...) \
+    do { \
+      syslog(LOG_INFO | LOG_DAEMON, __FILE__ ":%d / errno=%d / " format "\n", __LINE__, errno, ##__VA_ARGS__); \
+      stop_daemon(0); \
+    } while (0)
+
+#define WARN(format, ...) \
+    do { \
+      syslog(LOG_INFO | LOG_DAEMON, __FILE__ ":%d / warning / " format "\n", __LINE__, ##__VA_ARGS__); \
+    } while (0)
+
+#define INFO(format, ...) \
+    do { \
+      syslog(LOG_INFO | LOG_DAEMON, __FILE__ ":%d / info / " format "\n", __LINE__, ##__VA_ARGS__); \
+    } while (0)
+
+void stop_daemon(int flag);
+
+#endif
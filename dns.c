@@ -0,0 +1,976 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "dns.h"
+#include "creds.h"
+
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <sys/prctl.h>
+#include <sys/random.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <net/if.h>
+#include <limits.h>
+#include <poll.h>
+#include <sched.h>
+#include <time.h>
+
+#define DNS_PORT 53
+#define DNS_HDR_SZ 12
+#define DNS_MSG_MAX 4096
+#define DNS_TCP_MSG_MAX 65535
+#define DNS_TYPE_SOA 6
+#define DNS_TYPE_OPT 41
+#define DNS_RCODE_NOERROR 0
+#define DNS_RCODE_SERVFAIL 2
+#define DNS_RCODE_NXDOMAIN 3
+
+// Cache limits
+#define DNS_CACHE_BUCKETS 4096
+#define DNS_CACHE_MAX 16384
+#define DNS_MAX_TTL 86400
+#define DNS_MAX_NEG_TTL 3600
+// Upstream queries
+#define DNS_MAX_PENDING 256
+#define DNS_RETRY_SEC 2
+#define DNS_MAX_TRIES 3
+// Clients retrying truncated answers over TCP, each is served by a process
+#define DNS_MAX_TCP 16
+#define DNS_TCP_IDLE_SEC 10
+// Minimal lifetime of a stub to be respawned
+#define DNS_RESPAWN_SEC 5
+#define DNS_STUBS_MAX 4096
+
+// Stub passed over restart
+struct dns_saved {
+  pid_t pid;
+  time_t started;
+  int stats_fd;
+  dev_t ns_dev;
+  ino_t ns_ino;
+  struct sockaddr_storage ups[DNS_MAX_UPSTREAMS];
+  size_t ups_sz;
+};
+
+static struct dns_saved *adopted;
+static unsigned int adopted_sz;
+
+/*
+ * Wire format helpers
+ */
+static uint16_t get16(const uint8_t *p) {
+  return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p) {
+  return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+}
+
+static void put16(uint8_t *p, uint16_t v) {
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+static void put32(uint8_t *p, uint32_t v) {
+  p[0] = v >> 24;
+  p[1] = (v >> 16) & 0xff;
+  p[2] = (v >> 8) & 0xff;
+  p[3] = v & 0xff;
+}
+
+// Skip a (possibly compressed) name, returns the offset after it or 0.
+static size_t skip_name(const uint8_t *msg, size_t len, size_t off) {
+  while (off < len) {
+    uint8_t l = msg[off];
+    if ((l & 0xc0) == 0xc0)
+      return off + 2 <= len ? off + 2 : 0;
+    if (l & 0xc0)
+      return 0;
+    off += l + 1;
+    if (!l)
+      return off <= len ? off : 0;
+  }
+  return 0;
+}
+
+// Call fn for every resource record after the question section. The walk
+// stops when fn returns non zero. Returns -1 for a malformed message.
+static int walk_rrs(uint8_t *msg, size_t len, size_t off,
+                    int (*fn)(uint8_t *msg, size_t off, int section, void *arg),
+                    void *arg) {
+  unsigned int counts[3] = {get16(msg + 6), get16(msg + 8), get16(msg + 10)};
+
+  for (int section = 0; section < 3; section++) {
+    for (unsigned int i = 0; i < counts[section]; i++) {
+      off = skip_name(msg, len, off);
+      if (!off || off + 10 > len)
+        return -1;
+      size_t rdlen = get16(msg + off + 8);
+      if (off + 10 + rdlen > len)
+        return -1;
+      if (fn && fn(msg, off, section, arg))
+        return 0;
+      off += 10 + rdlen;
+    }
+  }
+  return 0;
+}
+
+int dns_parse_question(const uint8_t *msg, size_t len,
+                       uint8_t *key, size_t *key_len, size_t *end) {
+  if (len < DNS_HDR_SZ || get16(msg + 4) != 1)
+    return -1;
+
+  // Names in the question are never compressed.
+  size_t off = DNS_HDR_SZ, k = 0;
+  while (off < len && msg[off]) {
+    uint8_t l = msg[off];
+    if (l & 0xc0 || off + l + 1 > len || k + l + 1 > 254)
+      return -1;
+    key[k++] = l;
+    for (unsigned int i = 1; i <= l; i++) {
+      uint8_t c = msg[off + i];
+      key[k++] = (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+    }
+    off += l + 1;
+  }
+  if (off + 5 > len)
+    return -1;
+  key[k++] = 0;
+  memcpy(key + k, msg + off + 1, 4); // qtype, qclass
+  k += 4;
+  off += 5;
+
+  // Responses depend on the CD bit and EDNS (size, DO bit) of the query,
+  // don't give a large or signed answer to a client that didn't ask for it.
+  uint8_t flags = msg[3] & 0x10 ? 1 : 0;
+  if (get16(msg + 10) == 1) {
+    size_t rr = skip_name(msg, len, off);
+    if (rr && rr + 10 <= len && get16(msg + rr) == DNS_TYPE_OPT) {
+      flags |= 2;
+      if (msg[rr + 6] & 0x80)
+        flags |= 4;
+    }
+  }
+  key[k++] = flags;
+
+  *key_len = k;
+  if (end)
+    *end = off;
+  return 0;
+}
+
+struct ttl_walk {
+  uint32_t ttl;
+  int found;
+  int negative;
+};
+
+static int min_ttl_rr(uint8_t *msg, size_t off, int section, void *arg) {
+  struct ttl_walk *w = (struct ttl_walk *)arg;
+  uint16_t type = get16(msg + off);
+  uint32_t ttl = get32(msg + off + 4);
+
+  if (type == DNS_TYPE_OPT)
+    return 0;
+  if (w->negative) {
+    // RFC 2308: min of the SOA TTL and SOA MINIMUM
+    if (section != 1 || type != DNS_TYPE_SOA)
+      return 0;
+    size_t rdlen = get16(msg + off + 8);
+    uint32_t minimum = get32(msg + off + 10 + rdlen - 4);
+    w->ttl = ttl < minimum ? ttl : minimum;
+    w->found = 1;
+    return 1;
+  }
+  if (section == 2)
+    return 0;
+  if (!w->found || ttl < w->ttl)
+    w->ttl = ttl;
+  w->found = 1;
+  return 0;
+}
+
+int dns_cache_ttl(const uint8_t *msg, size_t len, uint32_t *ttl, int *negative) {
+  size_t off;
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len;
+
+  if (dns_parse_question(msg, len, key, &key_len, &off))
+    return -1;
+  // Truncated responses are retried over TCP by the client
+  if (!(msg[2] & 0x80) || msg[2] & 0x02)
+    return -1;
+
+  struct ttl_walk w = {0};
+  uint8_t rcode = msg[3] & 0x0f;
+  if (rcode == DNS_RCODE_NXDOMAIN || (rcode == DNS_RCODE_NOERROR && !get16(msg + 6)))
+    w.negative = 1;
+  else if (rcode != DNS_RCODE_NOERROR)
+    return -1;
+
+  if (walk_rrs((uint8_t *)msg, len, off, min_ttl_rr, &w) || !w.found)
+    return -1;
+  uint32_t max = w.negative ? DNS_MAX_NEG_TTL : DNS_MAX_TTL;
+  *ttl = w.ttl < max ? w.ttl : max;
+  *negative = w.negative;
+  return 0;
+}
+
+static int age_rr(uint8_t *msg, size_t off, int section, void *arg) {
+  uint32_t elapsed = *(uint32_t *)arg;
+  (void)section; // Records of all the sections are aged
+  if (get16(msg + off) != DNS_TYPE_OPT) {
+    uint32_t ttl = get32(msg + off + 4);
+    put32(msg + off + 4, ttl > elapsed ? ttl - elapsed : 0);
+  }
+  return 0;
+}
+
+int dns_age_ttls(uint8_t *msg, size_t len, uint32_t elapsed) {
+  size_t off;
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len;
+
+  if (dns_parse_question(msg, len, key, &key_len, &off))
+    return -1;
+  return walk_rrs(msg, len, off, age_rr, &elapsed);
+}
+
+/*
+ * The stub process
+ */
+struct dns_entry {
+  struct dns_entry *hnext;        // Hash chain
+  struct dns_entry *prev, *next;  // LRU list, most recent first
+  uint32_t hash;
+  time_t stored;
+  time_t expire;
+  int negative;
+  size_t key_len;
+  size_t msg_len;
+  uint8_t data[];                 // Key followed by the response
+};
+
+struct dns_pending {
+  int fd;                         // Connected to the upstream, -1 if unused
+  uint16_t id;                    // Query ID of the client
+  struct sockaddr_storage client;
+  socklen_t client_len;
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len;
+  uint8_t query[DNS_MSG_MAX];
+  size_t query_len;
+  time_t sent;
+  int tries;
+  int upstream;
+};
+
+static struct dns_entry *buckets[DNS_CACHE_BUCKETS];
+static struct dns_entry *lru_head, *lru_tail;
+static struct dns_pending pending[DNS_MAX_PENDING];
+static struct sockaddr_storage upstreams[DNS_MAX_UPSTREAMS];
+static int upstreams_sz;
+static struct runns_dns_stats *stats;
+
+static time_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// FNV-1a
+static uint32_t hash_key(const uint8_t *key, size_t len) {
+  uint32_t h = 2166136261u;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ key[i]) * 16777619u;
+  return h;
+}
+
+static void lru_unlink(struct dns_entry *e) {
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    lru_head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru_tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void lru_push(struct dns_entry *e) {
+  e->next = lru_head;
+  if (lru_head)
+    lru_head->prev = e;
+  lru_head = e;
+  if (!lru_tail)
+    lru_tail = e;
+}
+
+static void cache_remove(struct dns_entry *e) {
+  struct dns_entry **pp = &buckets[e->hash % DNS_CACHE_BUCKETS];
+  for (; *pp && *pp != e; pp = &(*pp)->hnext);
+  if (*pp)
+    *pp = e->hnext;
+  lru_unlink(e);
+  free(e);
+  --stats->entries;
+}
+
+static struct dns_entry *cache_find(const uint8_t *key, size_t key_len, uint32_t hash) {
+  for (struct dns_entry *e = buckets[hash % DNS_CACHE_BUCKETS]; e; e = e->hnext) {
+    if (e->hash == hash && e->key_len == key_len && !memcmp(e->data, key, key_len))
+      return e;
+  }
+  return NULL;
+}
+
+static void cache_store(const uint8_t *key, size_t key_len, const uint8_t *msg, size_t len) {
+  uint32_t ttl;
+  int negative;
+
+  if (dns_cache_ttl(msg, len, &ttl, &negative) || !ttl)
+    return;
+
+  uint32_t hash = hash_key(key, key_len);
+  struct dns_entry *e = cache_find(key, key_len, hash);
+  if (e)
+    cache_remove(e);
+  if (stats->entries >= DNS_CACHE_MAX)
+    cache_remove(lru_tail);
+
+  e = (struct dns_entry *)malloc(sizeof(struct dns_entry) + key_len + len);
+  if (!e)
+    return;
+  e->hash = hash;
+  e->stored = now();
+  e->expire = e->stored + ttl;
+  e->negative = negative;
+  e->key_len = key_len;
+  e->msg_len = len;
+  memcpy(e->data, key, key_len);
+  memcpy(e->data + key_len, msg, len);
+  e->hnext = buckets[hash % DNS_CACHE_BUCKETS];
+  buckets[hash % DNS_CACHE_BUCKETS] = e;
+  e->prev = e->next = NULL;
+  lru_push(e);
+  ++stats->entries;
+}
+
+// Turn the query msg into a SERVFAIL response. Returns its length or 0.
+static size_t make_servfail(uint8_t *msg, size_t len) {
+  size_t end;
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len;
+
+  if (dns_parse_question(msg, len, key, &key_len, &end))
+    return 0;
+  msg[2] |= 0x80;                                // QR
+  msg[3] = (msg[3] & 0xf0) | DNS_RCODE_SERVFAIL;
+  msg[3] |= 0x80;                                // RA
+  put16(msg + 6, 0);
+  put16(msg + 8, 0);
+  put16(msg + 10, 0);
+  return end;
+}
+
+static void reply_servfail(int lfd, struct dns_pending *p) {
+  put16(p->query, p->id);
+  size_t len = make_servfail(p->query, p->query_len);
+  if (len)
+    sendto(lfd, p->query, len, 0, (struct sockaddr *)&p->client, p->client_len);
+}
+
+static void pending_free(struct dns_pending *p) {
+  close(p->fd);
+  p->fd = -1;
+}
+
+// Send the pending query to the next upstream. Returns -1 on failure.
+static int pending_send(struct dns_pending *p) {
+  if (p->fd != -1)
+    close(p->fd);
+  p->upstream = (p->upstream + 1) % upstreams_sz;
+  struct sockaddr_storage *up = &upstreams[p->upstream];
+  socklen_t up_len = up->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+
+  p->fd = socket(up->ss_family, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (p->fd == -1)
+    return -1;
+  // A fresh socket per query gives a random source port
+  uint16_t id;
+  if (getrandom(&id, sizeof(id), 0) != sizeof(id))
+    id = (uint16_t)random();
+  put16(p->query, id);
+  ++p->tries;
+  p->sent = now();
+  if (connect(p->fd, (struct sockaddr *)up, up_len) ||
+      send(p->fd, p->query, p->query_len, 0) != (ssize_t)p->query_len) {
+    return -1;
+  }
+  return 0;
+}
+
+static void handle_query(int lfd) {
+  uint8_t msg[DNS_MSG_MAX];
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len;
+  struct sockaddr_storage client;
+  socklen_t client_len = sizeof(client);
+
+  ssize_t len = recvfrom(lfd, msg, sizeof(msg), 0, (struct sockaddr *)&client, &client_len);
+  if (len < DNS_HDR_SZ || msg[2] & 0x80)
+    return;
+  ++stats->queries;
+  if (dns_parse_question(msg, len, key, &key_len, NULL))
+    return;
+
+  // Answer from the cache
+  uint32_t hash = hash_key(key, key_len);
+  struct dns_entry *e = cache_find(key, key_len, hash);
+  time_t t = now();
+  if (e && e->expire <= t) {
+    cache_remove(e);
+    e = NULL;
+  }
+  if (e) {
+    uint8_t resp[DNS_MSG_MAX];
+    memcpy(resp, e->data + e->key_len, e->msg_len);
+    memcpy(resp, msg, 2); // ID of the query
+    dns_age_ttls(resp, e->msg_len, (uint32_t)(t - e->stored));
+    sendto(lfd, resp, e->msg_len, 0, (struct sockaddr *)&client, client_len);
+    lru_unlink(e);
+    lru_push(e);
+    ++stats->hits;
+    if (e->negative)
+      ++stats->negative_hits;
+    return;
+  }
+
+  // Forward upstream
+  struct dns_pending *p = NULL;
+  for (int i = 0; i < DNS_MAX_PENDING && !p; i++) {
+    if (pending[i].fd == -1)
+      p = &pending[i];
+  }
+  ++stats->misses;
+  if (!p) {
+    ++stats->failures;
+    return; // The client will retry
+  }
+  p->id = get16(msg);
+  memcpy(&p->client, &client, client_len);
+  p->client_len = client_len;
+  memcpy(p->key, key, key_len);
+  p->key_len = key_len;
+  memcpy(p->query, msg, len);
+  p->query_len = len;
+  p->tries = 0;
+  p->upstream = -1;
+  if (pending_send(p)) {
+    ++stats->failures;
+    reply_servfail(lfd, p);
+    pending_free(p);
+  }
+}
+
+static void handle_response(int lfd, struct dns_pending *p) {
+  uint8_t msg[DNS_MSG_MAX];
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len;
+
+  ssize_t len = recv(p->fd, msg, sizeof(msg), 0);
+  // Drop spoofed or broken responses, the query is retried on timeout
+  if (len < DNS_HDR_SZ || memcmp(msg, p->query, 2) ||
+      dns_parse_question(msg, len, key, &key_len, NULL) ||
+      key_len != p->key_len || memcmp(key, p->key, key_len - 1)) {
+    return;
+  }
+  if ((msg[3] & 0x0f) == DNS_RCODE_SERVFAIL)
+    ++stats->failures;
+  else
+    cache_store(p->key, p->key_len, msg, len);
+
+  put16(msg, p->id);
+  sendto(lfd, msg, len, 0, (struct sockaddr *)&p->client, p->client_len);
+  pending_free(p);
+}
+
+static int read_full(int fd, uint8_t *buf, size_t len) {
+  while (len) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+static int write_full(int fd, const uint8_t *buf, size_t len) {
+  while (len) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0)
+      return -1;
+    buf += n;
+    len -= n;
+  }
+  return 0;
+}
+
+// Send the query in msg (after its length) to the upstreams over TCP in
+// turn, the response replaces it. Returns the response length or -1.
+static ssize_t tcp_forward(uint8_t *msg, size_t len) {
+  const struct timeval tv = {.tv_sec = DNS_RETRY_SEC};
+
+  for (int i = 0; i < upstreams_sz; i++) {
+    struct sockaddr_storage *up = &upstreams[i];
+    socklen_t up_len = up->ss_family == AF_INET6 ? sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
+    uint8_t resp[DNS_TCP_MSG_MAX + 2];
+
+    // The timeouts bound connect() as well
+    int fd = socket(up->ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd == -1)
+      continue;
+    size_t n = 0;
+    if (!setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) &&
+        !setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) &&
+        !connect(fd, (struct sockaddr *)up, up_len) &&
+        !write_full(fd, msg, len + 2) && !read_full(fd, resp, 2))
+      n = get16(resp);
+    if (n >= DNS_HDR_SZ && !read_full(fd, resp + 2, n) && !memcmp(resp + 2, msg + 2, 2)) {
+      close(fd);
+      memcpy(msg, resp, n + 2);
+      return n;
+    }
+    close(fd);
+  }
+  return -1;
+}
+
+// Serve a TCP client until it closes the connection or idles. The exit
+// status tells the stub if an upstream failed.
+static void tcp_client(int cfd) {
+  const struct timeval tv = {.tv_sec = DNS_TCP_IDLE_SEC};
+  uint8_t msg[DNS_TCP_MSG_MAX + 2];
+  int failed = 0;
+
+  setsockopt(cfd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  setsockopt(cfd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+  while (!read_full(cfd, msg, 2)) {
+    size_t len = get16(msg);
+    if (len < DNS_HDR_SZ || read_full(cfd, msg + 2, len))
+      break;
+    ssize_t n = tcp_forward(msg, len);
+    if (n == -1) {
+      failed = 1;
+      if (!(n = make_servfail(msg + 2, len)))
+        break;
+      put16(msg, n);
+    }
+    if (write_full(cfd, msg, n + 2))
+      break;
+  }
+  _exit(failed ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+static void handle_tcp(int lfd, int tfd, int *tcp_clients) {
+  int cfd = accept4(tfd, NULL, NULL, SOCK_CLOEXEC);
+  if (cfd == -1)
+    return;
+  ++stats->queries;
+  ++stats->misses;
+  if (*tcp_clients >= DNS_MAX_TCP) {
+    ++stats->failures;
+    close(cfd);
+    return;
+  }
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(lfd);
+    close(tfd);
+    for (int i = 0; i < DNS_MAX_PENDING; i++) {
+      if (pending[i].fd != -1)
+        close(pending[i].fd);
+    }
+    tcp_client(cfd);
+  }
+  if (pid > 0)
+    ++*tcp_clients;
+  else
+    ++stats->failures;
+  close(cfd);
+}
+
+static void bring_lo_up() {
+  struct ifreq ifr = {0};
+  int fd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+
+  strncpy(ifr.ifr_name, "lo", IFNAMSIZ - 1);
+  if (fd != -1 && !ioctl(fd, SIOCGIFFLAGS, &ifr) && !(ifr.ifr_flags & IFF_UP)) {
+    ifr.ifr_flags |= IFF_UP;
+    if (ioctl(fd, SIOCSIFFLAGS, &ifr))
+      WARN("Can't bring lo up, errno=%d", errno);
+  }
+  if (fd != -1)
+    close(fd);
+}
+
+static void stub_main(int nsfd) {
+  sigset_t mask;
+
+  // Don't outlive the daemon
+  signal(SIGCHLD, SIG_DFL);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGUSR2, SIG_DFL);
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  prctl(PR_SET_NAME, "runns-dns");
+
+  if (setns(nsfd, CLONE_NEWNET)) {
+    WARN("DNS stub: can't set netns, errno=%d", errno);
+    exit(EXIT_FAILURE);
+  }
+  // Nothing from the daemon is needed here
+  close_range(STDERR_FILENO + 1, ~0U, 0);
+  bring_lo_up();
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(DNS_PORT),
+    .sin_addr.s_addr = htonl(INADDR_LOOPBACK)
+  };
+  // The stub of the previous daemon image could be still exiting. Truncated
+  // answers are retried by the clients over TCP.
+  int lfd = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0), on = 1;
+  int tfd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (lfd == -1 || setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) ||
+      bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+      tfd == -1 || setsockopt(tfd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) ||
+      bind(tfd, (struct sockaddr *)&addr, sizeof(addr)) || listen(tfd, DNS_MAX_TCP)) {
+    WARN("DNS stub: can't bind 127.0.0.1:53, errno=%d", errno);
+    exit(EXIT_FAILURE);
+  }
+  if (creds_drop())
+    exit(EXIT_FAILURE);
+  for (int i = 0; i < DNS_MAX_PENDING; pending[i++].fd = -1);
+
+  int tcp_clients = 0;
+  while (1) {
+    struct pollfd fds[DNS_MAX_PENDING + 2];
+    struct dns_pending *map[DNS_MAX_PENDING + 2];
+    nfds_t n = 2;
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+      --tcp_clients;
+      if (!WIFEXITED(status) || WEXITSTATUS(status))
+        ++stats->failures;
+    }
+
+    fds[0].fd = lfd;
+    fds[0].events = POLLIN;
+    fds[1].fd = tfd;
+    fds[1].events = POLLIN;
+    for (int i = 0; i < DNS_MAX_PENDING; i++) {
+      if (pending[i].fd != -1) {
+        fds[n].fd = pending[i].fd;
+        fds[n].events = POLLIN;
+        map[n++] = &pending[i];
+      }
+    }
+    if (poll(fds, n, 1000) == -1 && errno != EINTR) {
+      WARN("DNS stub: poll failed, errno=%d", errno);
+      exit(EXIT_FAILURE);
+    }
+
+    for (nfds_t i = 2; i < n; i++) {
+      if (fds[i].revents & POLLIN)
+        handle_response(lfd, map[i]);
+    }
+    if (fds[0].revents & POLLIN)
+      handle_query(lfd);
+    if (fds[1].revents & POLLIN)
+      handle_tcp(lfd, tfd, &tcp_clients);
+
+    // Retry timed out queries on the next upstream
+    time_t t = now();
+    for (int i = 0; i < DNS_MAX_PENDING; i++) {
+      struct dns_pending *p = &pending[i];
+      if (p->fd == -1 || t - p->sent < DNS_RETRY_SEC)
+        continue;
+      if (p->tries >= DNS_MAX_TRIES * upstreams_sz || pending_send(p)) {
+        ++stats->failures;
+        reply_servfail(lfd, p);
+        pending_free(p);
+      }
+    }
+  }
+}
+
+/*
+ * Daemon side
+ */
+static struct runns_profile *dns_profile(const struct runns_netns *ns) {
+  for (size_t i = 0; i < profiles.sz; i++) {
+    if (profiles.v[i].dns_cache && profiles.v[i].netns == ns)
+      return &profiles.v[i];
+  }
+  return NULL;
+}
+
+static void dns_stop(struct runns_netns *ns) {
+  if (ns->dns->pid > 0)
+    kill(ns->dns->pid, SIGTERM);
+  if (*ns->dns->resolv)
+    unlink(ns->dns->resolv);
+  munmap(ns->dns->stats, sizeof(struct runns_dns_stats));
+  close(ns->dns->stats_fd);
+  free(ns->dns);
+  ns->dns = NULL;
+  netns_put(ns);
+}
+
+// Set up ns->dns with the statistics in fd (a new memfd if -1).
+static int dns_alloc(struct runns_netns *ns, int fd) {
+  ns->dns = (struct dns_stub *)calloc(1, sizeof(struct dns_stub));
+  if (!ns->dns) {
+    WARN("Can't allocate memory for DNS stub");
+    return -1;
+  }
+  if (fd == -1 && ((fd = memfd_create("runns-dns", MFD_CLOEXEC)) == -1 ||
+                   ftruncate(fd, sizeof(struct runns_dns_stats)))) {
+    if (fd != -1)
+      close(fd);
+    fd = -1;
+  }
+  ns->dns->stats = fd == -1 ? MAP_FAILED :
+                   mmap(NULL, sizeof(struct runns_dns_stats), PROT_READ | PROT_WRITE,
+                        MAP_SHARED, fd, 0);
+  if (ns->dns->stats == MAP_FAILED) {
+    WARN("Can't allocate memory for DNS stub statistics");
+    if (fd != -1)
+      close(fd);
+    free(ns->dns);
+    ns->dns = NULL;
+    return -1;
+  }
+  ns->dns->stats_fd = fd;
+  ++ns->refs; // The stub keeps the namespace
+  return 0;
+}
+
+static void dns_start(struct runns_netns *ns, const struct runns_profile *p) {
+  if (!ns->dns && dns_alloc(ns, -1))
+    return;
+
+  memset(ns->dns->stats, 0, sizeof(struct runns_dns_stats));
+  pid_t pid = fork();
+  if (pid == -1) {
+    WARN("Can't fork DNS stub for %s", ns->path);
+    return;
+  }
+  if (pid == 0) {
+    stats = ns->dns->stats;
+    upstreams_sz = p->dns_ups_sz;
+    memcpy(upstreams, p->dns_ups, upstreams_sz * sizeof(struct sockaddr_storage));
+    stub_main(ns->fd); // Never returns
+  }
+  ns->dns->pid = pid;
+  ns->dns->started = time(NULL);
+  ns->dns->ups_sz = p->dns_ups_sz;
+  memcpy(ns->dns->ups, p->dns_ups, p->dns_ups_sz * sizeof(struct sockaddr_storage));
+  INFO("DNS stub %d started for %s", pid, ns->path);
+}
+
+static int dns_same(const struct dns_stub *s, const struct runns_profile *p) {
+  return s->ups_sz == p->dns_ups_sz &&
+         !memcmp(s->ups, p->dns_ups, s->ups_sz * sizeof(struct sockaddr_storage));
+}
+
+// Take over the stub of the previous image running in ns for p. Returns 1 if
+// it is taken.
+static int dns_adopt(struct runns_netns *ns, const struct runns_profile *p) {
+  for (unsigned int i = 0; i < adopted_sz; i++) {
+    struct dns_saved *a = &adopted[i];
+    if (a->pid <= 0 || a->ns_dev != ns->dev || a->ns_ino != ns->ino ||
+        a->ups_sz != p->dns_ups_sz ||
+        memcmp(a->ups, p->dns_ups, a->ups_sz * sizeof(struct sockaddr_storage)))
+      continue;
+    if (dns_alloc(ns, a->stats_fd))
+      return 0;
+    ns->dns->pid = a->pid;
+    ns->dns->started = a->started;
+    ns->dns->ups_sz = a->ups_sz;
+    memcpy(ns->dns->ups, a->ups, a->ups_sz * sizeof(struct sockaddr_storage));
+    a->pid = 0;
+    a->stats_fd = -1;
+    INFO("DNS stub %d taken over for %s", ns->dns->pid, ns->path);
+    return 1;
+  }
+  return 0;
+}
+
+// Write the resolv.conf of the jobs in ns: the stub with the search list and
+// the options of the resolv.conf they would get without it.
+static void write_resolv(struct runns_netns *ns, const struct runns_profile *p,
+                         const char *runtime_dir) {
+  char *path = ns->dns->resolv, tmp[PATH_MAX], *line = NULL;
+  size_t line_sz = 0;
+
+  if (snprintf(path, PATH_MAX, "%s/" DNS_STUB_RESOLV, runtime_dir,
+               (unsigned long)ns->ino) >= PATH_MAX ||
+      snprintf(tmp, sizeof(tmp), "%s~", path) >= (int)sizeof(tmp)) {
+    *path = '\0';
+    return;
+  }
+  // Replaced as a whole, the running jobs keep the file they have mounted
+  FILE *f = fopen(tmp, "we");
+  FILE *src = fopen(p->resolv ? p->resolv : "/etc/resolv.conf", "re");
+  int err = !f || fputs("nameserver 127.0.0.1\n", f) == EOF;
+  while (!err && src && getline(&line, &line_sz, src) != -1) {
+    const char *s = line + strspn(line, " \t");
+    size_t len = strcspn(s, " \t\n");
+    if ((len == 6 && (!strncmp(s, "search", 6) || !strncmp(s, "domain", 6))) ||
+        (len == 7 && !strncmp(s, "options", 7)))
+      err = fputs(s, f) == EOF || (s[strlen(s) - 1] != '\n' && fputc('\n', f) == EOF);
+  }
+  free(line);
+  if (src)
+    fclose(src);
+  if ((f && fclose(f)) || err || rename(tmp, path)) {
+    WARN("Can't create %s, errno=%d", path, errno);
+    unlink(tmp);
+    *path = '\0';
+  }
+}
+
+void dns_sync(const char *runtime_dir) {
+  for (struct runns_netns *ns = netns_head, *next; ns; ns = next) {
+    next = ns->pnext;
+    struct runns_profile *p = dns_profile(ns);
+    if (ns->dns && !p) {
+      dns_stop(ns);
+    }
+    else if (p && ns->dns && ns->dns->pid && !dns_same(ns->dns, p)) {
+      INFO("DNS upstreams of %s changed", ns->path);
+      if (ns->dns->pid > 0)
+        kill(ns->dns->pid, SIGTERM);
+      ns->dns->pid = 0;
+      dns_start(ns, p);
+    }
+    else if (p && (!ns->dns || !ns->dns->pid)) {
+      if (ns->dns || !dns_adopt(ns, p))
+        dns_start(ns, p);
+    }
+    if (p && ns->dns)
+      write_resolv(ns, p, runtime_dir);
+  }
+
+  // The stubs which are not needed anymore
+  for (unsigned int i = 0; i < adopted_sz; i++) {
+    if (adopted[i].pid > 0)
+      kill(adopted[i].pid, SIGTERM);
+    if (adopted[i].stats_fd != -1)
+      close(adopted[i].stats_fd);
+  }
+  free(adopted);
+  adopted = NULL;
+  adopted_sz = 0;
+}
+
+void dns_reload(const char *runtime_dir) {
+  for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext) {
+    if (ns->dns && ns->dns->pid == -1)
+      ns->dns->pid = 0;
+  }
+  dns_sync(runtime_dir);
+}
+
+void dns_shutdown() {
+  for (struct runns_netns *ns = netns_head, *next; ns; ns = next) {
+    next = ns->pnext;
+    if (ns->dns)
+      dns_stop(ns);
+  }
+}
+
+int dns_save(int fd) {
+  unsigned int n = 0;
+
+  for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext)
+    n += ns->dns && ns->dns->pid > 0;
+  if (write(fd, (void *)&n, sizeof(n)) != sizeof(n))
+    return -1;
+  for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext) {
+    if (!ns->dns || ns->dns->pid <= 0)
+      continue;
+    struct dns_saved a = {
+      .pid = ns->dns->pid,
+      .started = ns->dns->started,
+      .stats_fd = ns->dns->stats_fd,
+      .ns_dev = ns->dev,
+      .ns_ino = ns->ino,
+      .ups_sz = ns->dns->ups_sz
+    };
+    memcpy(a.ups, ns->dns->ups, sizeof(a.ups));
+    if (write(fd, (void *)&a, sizeof(a)) != sizeof(a) ||
+        fcntl(a.stats_fd, F_SETFD, 0))
+      return -1;
+  }
+  return 0;
+}
+
+void dns_save_abort() {
+  for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext) {
+    if (ns->dns)
+      fcntl(ns->dns->stats_fd, F_SETFD, FD_CLOEXEC);
+  }
+}
+
+int dns_load(int fd) {
+  unsigned int n;
+
+  if (read(fd, (void *)&n, sizeof(n)) != sizeof(n) || n > DNS_STUBS_MAX)
+    return -1;
+  adopted = (struct dns_saved *)calloc(n ? n : 1, sizeof(struct dns_saved));
+  if (!adopted || read(fd, (void *)adopted, n * sizeof(struct dns_saved)) != (ssize_t)(n * sizeof(struct dns_saved))) {
+    free(adopted);
+    adopted = NULL;
+    return -1;
+  }
+  adopted_sz = n;
+  for (unsigned int i = 0; i < n; i++)
+    fcntl(adopted[i].stats_fd, F_SETFD, FD_CLOEXEC);
+  return 0;
+}
+
+int dns_reaped(pid_t pid) {
+  for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext) {
+    if (ns->dns && ns->dns->pid == pid) {
+      WARN("DNS stub %d for %s exited", pid, ns->path);
+      // Don't respawn a stub which can't start until the next reload
+      ns->dns->pid = time(NULL) - ns->dns->started < DNS_RESPAWN_SEC ? -1 : 0;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+const char *dns_resolv(const struct runns_netns *ns) {
+  if (!ns->dns || ns->dns->pid <= 0 || !*ns->dns->resolv)
+    return NULL;
+  return ns->dns->resolv;
+}
@@ -0,0 +1,67 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef DNS_H
+#define DNS_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <limits.h>
+#include <time.h>
+
+// resolv.conf pointing to the stub, created in the runtime directory for
+// every namespace (by its inode)
+#define DNS_STUB_RESOLV "stub-resolv.%lu.conf"
+#define DNS_MAX_UPSTREAMS 4
+// Cache key: lower case qname in wire format, qtype, qclass and flags
+#define DNS_KEY_MAX (255 + 5)
+
+struct runns_netns;
+
+// Caching stub resolver running inside a network namespace
+struct dns_stub {
+  pid_t pid;                     // 0 to be respawned, -1 if failed
+  time_t started;
+  struct runns_dns_stats *stats; // Shared with the stub process
+  int stats_fd;                  // memfd of stats, kept over restart
+  // Upstreams the stub is started with
+  struct sockaddr_storage ups[DNS_MAX_UPSTREAMS];
+  size_t ups_sz;
+  char resolv[PATH_MAX];         // resolv.conf of the jobs, empty if failed
+};
+
+// Parse the question of the query msg into the cache key. Returns 0 on
+// success, *end is set to the end of the question section.
+int dns_parse_question(const uint8_t *msg, size_t len,
+                       uint8_t *key, size_t *key_len, size_t *end);
+// Get the TTL to cache the response msg for, *negative is set for NXDOMAIN
+// and NODATA. Returns -1 if the response must not be cached.
+int dns_cache_ttl(const uint8_t *msg, size_t len, uint32_t *ttl, int *negative);
+// Decrease TTLs of all records by elapsed seconds.
+int dns_age_ttls(uint8_t *msg, size_t len, uint32_t elapsed);
+
+// Start and stop the stubs to match the loaded profiles, the stubs with
+// other upstreams are restarted.
+void dns_sync(const char *runtime_dir);
+// The same on reload, the failed stubs are started again as well.
+void dns_reload(const char *runtime_dir);
+// Stop the stubs and remove their resolv.conf files.
+void dns_shutdown();
+// Write the running stubs to fd on restart, their statistics are left open
+// over exec. dns_save_abort() closes them on exec again if it fails.
+int dns_save(int fd);
+void dns_save_abort();
+// Read the stubs of the previous image, they are taken over by the next
+// dns_sync() if their namespace and upstreams are the same.
+int dns_load(int fd);
+// Returns 1 if pid was a stub, it will be restarted by the next dns_sync().
+int dns_reaped(pid_t pid);
+// resolv.conf for jobs in ns or NULL if there is no stub in ns.
+const char *dns_resolv(const struct runns_netns *ns);
+
+#endif
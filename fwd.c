@@ -0,0 +1,213 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "fwd.h"
+
+#include <limits.h>
+
+#define FWD_MIN_BUCKETS 64
+
+struct fwd_table fwd_rules = {0};
+
+static size_t ip_len(sa_family_t family) {
+  return family == AF_INET6 ? sizeof(struct in6_addr) : sizeof(struct in_addr);
+}
+
+// FNV-1a over the key
+static unsigned int fwd_hash(const struct runns_fwd_rule *r) {
+  unsigned char key[sizeof(r->ip) + 4];
+  size_t len = ip_len(r->family);
+  unsigned int h = 2166136261u;
+
+  memcpy(key, r->ip, len);
+  key[len++] = r->family == AF_INET6 ? 6 : 4;
+  key[len++] = (unsigned char)r->proto;
+  key[len++] = r->port >> 8;
+  key[len++] = r->port & 0xff;
+  for (size_t i = 0; i < len; i++)
+    h = (h ^ key[i]) * 16777619u;
+  return h;
+}
+
+static int fwd_match(const struct fwd_rule *e, const struct runns_fwd_rule *r, unsigned int hash) {
+  return e->hash == hash && e->family == r->family && e->proto == (int)r->proto &&
+         e->port == r->port && !memcmp(e->ip, r->ip, ip_len(r->family));
+}
+
+static struct fwd_rule **fwd_find(struct fwd_table *t, const struct runns_fwd_rule *r, unsigned int hash) {
+  if (!t->nbuckets)
+    return NULL;
+  struct fwd_rule **pp = &t->buckets[hash % t->nbuckets];
+  for (; *pp; pp = &(*pp)->hnext) {
+    if (fwd_match(*pp, r, hash))
+      return pp;
+  }
+  return NULL;
+}
+
+// Keep the load factor under 1, the chains are moved in place
+static int fwd_grow(struct fwd_table *t) {
+  size_t n = t->nbuckets ? t->nbuckets * 2 : FWD_MIN_BUCKETS;
+  struct fwd_rule **b = (struct fwd_rule **)calloc(n, sizeof(struct fwd_rule *));
+  if (!b)
+    return -1;
+  for (size_t i = 0; i < t->nbuckets; i++) {
+    for (struct fwd_rule *e = t->buckets[i], *next; e; e = next) {
+      next = e->hnext;
+      e->hnext = b[e->hash % n];
+      b[e->hash % n] = e;
+    }
+  }
+  free(t->buckets);
+  t->buckets = b;
+  t->nbuckets = n;
+  return 0;
+}
+
+static int fwd_valid(const struct runns_fwd_rule *r) {
+  return (r->family == AF_INET || r->family == AF_INET6) &&
+         (r->proto == L4_PROTOCOL_TCP || r->proto == L4_PROTOCOL_UDP);
+}
+
+int fwd_add(struct fwd_table *t, const struct runns_fwd_rule *r,
+            const char *netns_path, uid_t uid) {
+  if (!fwd_valid(r))
+    return -1;
+
+  unsigned int hash = fwd_hash(r);
+  struct fwd_rule **pp = fwd_find(t, r, hash);
+  if (pp && (*pp)->uid != uid && uid != 0) {
+    WARN("uid=%d can't replace forwarding rule of uid=%d", uid, (*pp)->uid);
+    return -1;
+  }
+  struct runns_netns *ns = netns_get(netns_path);
+  if (!ns)
+    return -1;
+
+  // Replace the namespace only, sockets handed out already stay where they are
+  if (pp) {
+    netns_put((*pp)->netns);
+    (*pp)->netns = ns;
+    (*pp)->uid = uid;
+    return 0;
+  }
+
+  if (t->sz >= t->nbuckets && fwd_grow(t) && !t->nbuckets) {
+    netns_put(ns);
+    return -1;
+  }
+  struct fwd_rule *e = (struct fwd_rule *)calloc(1, sizeof(struct fwd_rule));
+  if (!e) {
+    netns_put(ns);
+    return -1;
+  }
+  memcpy(e->ip, r->ip, ip_len(r->family));
+  e->hash = hash;
+  e->family = r->family;
+  e->proto = r->proto;
+  e->port = r->port;
+  e->uid = uid;
+  e->netns = ns;
+  e->hnext = t->buckets[hash % t->nbuckets];
+  t->buckets[hash % t->nbuckets] = e;
+  ++t->sz;
+  return 0;
+}
+
+int fwd_del(struct fwd_table *t, const struct runns_fwd_rule *r, uid_t uid) {
+  struct fwd_rule **pp = fwd_find(t, r, fwd_hash(r));
+  if (!pp)
+    return -1;
+  struct fwd_rule *e = *pp;
+  if (e->uid != uid && uid != 0) {
+    WARN("uid=%d can't remove forwarding rule of uid=%d", uid, e->uid);
+    return -1;
+  }
+  *pp = e->hnext;
+  netns_put(e->netns);
+  free(e);
+  --t->sz;
+  return 0;
+}
+
+struct fwd_rule *fwd_lookup(struct fwd_table *t, const struct runns_fwd_rule *r) {
+  struct fwd_rule **pp = fwd_find(t, r, fwd_hash(r));
+  if (pp)
+    return *pp;
+
+  struct runns_fwd_rule any = *r;
+  memset(any.ip, 0, sizeof(any.ip));
+  pp = fwd_find(t, &any, fwd_hash(&any));
+  return pp ? *pp : NULL;
+}
+
+void fwd_free(struct fwd_table *t) {
+  for (size_t i = 0; i < t->nbuckets; i++) {
+    for (struct fwd_rule *e = t->buckets[i], *next; e; e = next) {
+      next = e->hnext;
+      netns_put(e->netns);
+      free(e);
+    }
+  }
+  free(t->buckets);
+  memset(t, 0, sizeof(*t));
+}
+
+int fwd_socket(const struct fwd_rule *r) {
+  int type = r->proto == L4_PROTOCOL_UDP ? SOCK_DGRAM : SOCK_STREAM;
+  return netns_socket(r->netns, r->family, type, 0);
+}
+
+int fwd_save(struct fwd_table *t, int fd) {
+  unsigned int n = t->sz;
+
+  if (write(fd, (void *)&n, sizeof(n)) != sizeof(n))
+    return -1;
+  for (size_t i = 0; i < t->nbuckets; i++) {
+    for (struct fwd_rule *e = t->buckets[i]; e; e = e->hnext) {
+      struct runns_fwd_rule r = {
+        .family = e->family,
+        .proto = e->proto,
+        .port = e->port,
+        .action = RUNNS_FWD_ADD,
+        .netns_sz = strlen(e->netns->path) + 1
+      };
+      memcpy(r.ip, e->ip, sizeof(r.ip));
+      if (write(fd, (void *)&e->uid, sizeof(e->uid)) != sizeof(e->uid) ||
+          write(fd, (void *)&r, sizeof(r)) != sizeof(r) ||
+          write(fd, e->netns->path, r.netns_sz) != (ssize_t)r.netns_sz) {
+        return -1;
+      }
+    }
+  }
+  return 0;
+}
+
+int fwd_load(struct fwd_table *t, int fd) {
+  unsigned int n;
+  uid_t uid;
+  struct runns_fwd_rule r;
+  char path[PATH_MAX];
+
+  if (read(fd, (void *)&n, sizeof(n)) != sizeof(n))
+    return -1;
+  for (unsigned int i = 0; i < n; i++) {
+    if (read(fd, (void *)&uid, sizeof(uid)) != sizeof(uid) ||
+        read(fd, (void *)&r, sizeof(r)) != sizeof(r) ||
+        !r.netns_sz || r.netns_sz > sizeof(path) ||
+        read(fd, path, r.netns_sz) != (ssize_t)r.netns_sz) {
+      return -1;
+    }
+    path[r.netns_sz - 1] = '\0';
+    if (fwd_add(t, &r, path, uid))
+      WARN("Forwarding rule into %s is lost", path);
+  }
+  return 0;
+}
@@ -0,0 +1,56 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef FWD_H
+#define FWD_H
+
+#include <netinet/in.h>
+#include <sys/types.h>
+
+struct runns_netns;
+struct runns_fwd_rule;
+
+// Forwarding rule stored in the daemon, the key is (family, proto, ip, port).
+struct fwd_rule {
+  struct fwd_rule *hnext;
+  unsigned int hash;
+  unsigned char ip[16];
+  sa_family_t family;
+  int proto;
+  in_port_t port;
+  uid_t uid;                  // Owner, only the owner or root may remove it
+  struct runns_netns *netns;
+};
+
+// Hash table of the rules. It grows with the number of rules, so a lookup
+// costs the same for a handful and for thousands of rules.
+struct fwd_table {
+  struct fwd_rule **buckets;
+  size_t nbuckets;
+  size_t sz;
+};
+
+extern struct fwd_table fwd_rules;
+
+// Add or replace the rule r forwarding into netns_path. Returns 0 on success.
+int fwd_add(struct fwd_table *t, const struct runns_fwd_rule *r,
+            const char *netns_path, uid_t uid);
+// Remove the rule matching r. Returns 0 on success, -1 if there is no such
+// rule or uid doesn't own it.
+int fwd_del(struct fwd_table *t, const struct runns_fwd_rule *r, uid_t uid);
+// Find the rule for r, a rule with the unspecified address matches any
+// address of the family.
+struct fwd_rule *fwd_lookup(struct fwd_table *t, const struct runns_fwd_rule *r);
+void fwd_free(struct fwd_table *t);
+// Create a socket for the rule inside its namespace. Returns the fd or -1.
+int fwd_socket(const struct fwd_rule *r);
+
+// Write the rules to fd and read them back, used on restart.
+int fwd_save(struct fwd_table *t, int fd);
+int fwd_load(struct fwd_table *t, int fd);
+
+#endif
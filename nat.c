@@ -0,0 +1,525 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "nat.h"
+
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <linux/netfilter.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nf_tables.h>
+#include <linux/netfilter/nf_conntrack_common.h>
+
+static const struct nat_family {
+  int family;
+  uint8_t nfproto;
+  const char *set;
+  uint32_t key_type;  // ipv4_addr and ipv6_addr of nft, informational
+  uint32_t len;
+  uint32_t saddr;     // Offsets in the network header
+  uint32_t daddr;
+} families[] = {
+  {AF_INET, NFPROTO_IPV4, "nat4", 7, 4, 12, 16},
+  {AF_INET6, NFPROTO_IPV6, "nat6", 8, 16, 8, 24},
+};
+#define NAT_FAMILIES (sizeof(families) / sizeof(families[0]))
+
+static int nat_table = 0; // The table is set up by the daemon
+
+int nat_subnet(const struct rtnl_addr *a, struct nat_subnet *s) {
+  int len = a->family == AF_INET ? 4 : 16;
+
+  if (!a->family || !a->prefix)
+    return -1;
+  memset(s, 0, sizeof(*s));
+  s->family = a->family;
+  for (int i = 0; i < len; i++) {
+    int bits = a->prefix - i * 8;
+    unsigned char mask = bits >= 8 ? 0xff : bits <= 0 ? 0 : (unsigned char)(0xff << (8 - bits));
+    s->start[i] = a->addr[i] & mask;
+    s->end[i] = s->start[i] | (unsigned char)~mask;
+  }
+  // The end of the interval is exclusive
+  int i = len - 1;
+  for (; i >= 0 && s->end[i] == 0xff; s->end[i--] = 0);
+  if (i >= 0)
+    ++s->end[i];
+  else
+    s->end_wraps = 1;
+  return 0;
+}
+
+static int subnet_eq(const struct nat_subnet *a, const struct nat_subnet *b) {
+  return a->family == b->family && !memcmp(a->start, b->start, sizeof(a->start)) &&
+         !memcmp(a->end, b->end, sizeof(a->end));
+}
+
+int nat_covers(const struct nat_subnet *a, const struct nat_subnet *b) {
+  return a->family == b->family && memcmp(a->start, b->start, sizeof(a->start)) <= 0 &&
+         (a->end_wraps || (!b->end_wraps && memcmp(b->end, a->end, sizeof(a->end)) <= 0));
+}
+
+static int subnet_find(const struct nat_subnet *v, size_t n, const struct nat_subnet *s) {
+  for (size_t i = 0; i < n; i++) {
+    if (subnet_eq(&v[i], s))
+      return i;
+  }
+  return -1;
+}
+
+// Subnets of the profiles with nat = yes, namespaces shared by several
+// profiles are counted once. The elements of an interval set can't overlap,
+// so a subnet inside another one is left out.
+static size_t collect(const struct runns_profiles *p, struct nat_subnet *v) {
+  struct nat_subnet s;
+  size_t n = 0;
+
+  for (size_t i = 0; p && i < p->sz; i++) {
+    if (!p->v[i].nat || nat_subnet(&p->v[i].veth.peer_addr, &s))
+      continue;
+    size_t j = 0;
+    for (; j < n && !nat_covers(&v[j], &s); j++);
+    if (j < n)
+      continue;
+    // Prefixes either nest or don't overlap at all
+    size_t k = 0;
+    for (j = 0; j < n; j++) {
+      if (!nat_covers(&s, &v[j]))
+        v[k++] = v[j];
+    }
+    n = k;
+    if (n == NAT_MAX_SUBNETS) {
+      WARN("Too many NAT subnets, profile %s is not masqueraded", p->v[i].name);
+      continue;
+    }
+    v[n++] = s;
+  }
+  return n;
+}
+
+static void nft_msg(struct rtnl_batch *b, uint16_t type, uint16_t flags) {
+  struct nfgenmsg nfg = {.nfgen_family = NFPROTO_INET, .version = NFNETLINK_V0};
+  rtnl_msg(b, (NFNL_SUBSYS_NFTABLES << 8) | type, flags, &nfg, sizeof(nfg));
+}
+
+// The kernel applies everything between the delimiters or nothing
+static void batch_delim(struct rtnl_batch *b, uint16_t type) {
+  struct nfgenmsg nfg = {
+    .nfgen_family = AF_UNSPEC,
+    .version = NFNETLINK_V0,
+    .res_id = htons(NFNL_SUBSYS_NFTABLES)
+  };
+  rtnl_msg_noack(b, type, &nfg, sizeof(nfg));
+}
+
+// The integers of nf_tables are big endian
+static void attr_be32(struct rtnl_batch *b, uint16_t type, uint32_t v) {
+  rtnl_attr_u32(b, type, htonl(v));
+}
+
+static void attr_data(struct rtnl_batch *b, uint16_t type, const void *data, size_t sz) {
+  struct rtattr *nest = rtnl_nest(b, type);
+  rtnl_attr(b, NFTA_DATA_VALUE, data, sz);
+  rtnl_nest_end(b, nest);
+}
+
+static void table_msg(struct rtnl_batch *b, uint16_t type, uint16_t flags) {
+  nft_msg(b, type, flags);
+  rtnl_attr_str(b, NFTA_TABLE_NAME, NAT_TABLE);
+}
+
+static void chain_add(struct rtnl_batch *b, const char *name, const char *type,
+                      uint32_t hook, int32_t prio) {
+  nft_msg(b, NFT_MSG_NEWCHAIN, NLM_F_CREATE);
+  rtnl_attr_str(b, NFTA_CHAIN_TABLE, NAT_TABLE);
+  rtnl_attr_str(b, NFTA_CHAIN_NAME, name);
+  struct rtattr *nest = rtnl_nest(b, NFTA_CHAIN_HOOK);
+  attr_be32(b, NFTA_HOOK_HOOKNUM, hook);
+  attr_be32(b, NFTA_HOOK_PRIORITY, prio);
+  rtnl_nest_end(b, nest);
+  rtnl_attr_str(b, NFTA_CHAIN_TYPE, type);
+  attr_be32(b, NFTA_CHAIN_POLICY, NF_ACCEPT);
+}
+
+static void set_add(struct rtnl_batch *b, const struct nat_family *f, uint32_t id) {
+  nft_msg(b, NFT_MSG_NEWSET, NLM_F_CREATE);
+  rtnl_attr_str(b, NFTA_SET_TABLE, NAT_TABLE);
+  rtnl_attr_str(b, NFTA_SET_NAME, f->set);
+  attr_be32(b, NFTA_SET_FLAGS, NFT_SET_INTERVAL);
+  attr_be32(b, NFTA_SET_KEY_TYPE, f->key_type);
+  attr_be32(b, NFTA_SET_KEY_LEN, f->len);
+  attr_be32(b, NFTA_SET_ID, id);
+}
+
+static struct rtattr *expr_begin(struct rtnl_batch *b, const char *name, struct rtattr **data) {
+  struct rtattr *elem = rtnl_nest(b, NFTA_LIST_ELEM);
+  rtnl_attr_str(b, NFTA_EXPR_NAME, name);
+  *data = rtnl_nest(b, NFTA_EXPR_DATA);
+  return elem;
+}
+
+static void expr_end(struct rtnl_batch *b, struct rtattr *elem, struct rtattr *data) {
+  rtnl_nest_end(b, data);
+  rtnl_nest_end(b, elem);
+}
+
+static void expr_cmp(struct rtnl_batch *b, uint32_t op, const void *v, size_t sz) {
+  struct rtattr *data, *elem = expr_begin(b, "cmp", &data);
+  attr_be32(b, NFTA_CMP_SREG, NFT_REG_1);
+  attr_be32(b, NFTA_CMP_OP, op);
+  attr_data(b, NFTA_CMP_DATA, v, sz);
+  expr_end(b, elem, data);
+}
+
+// meta nfproto <family>, the table is of the inet family
+static void expr_nfproto(struct rtnl_batch *b, const struct nat_family *f) {
+  struct rtattr *data, *elem = expr_begin(b, "meta", &data);
+  attr_be32(b, NFTA_META_KEY, NFT_META_NFPROTO);
+  attr_be32(b, NFTA_META_DREG, NFT_REG_1);
+  expr_end(b, elem, data);
+  expr_cmp(b, NFT_CMP_EQ, &f->nfproto, sizeof(f->nfproto));
+}
+
+// [ip|ip6] [saddr|daddr] [!=] @set
+static void expr_lookup(struct rtnl_batch *b, const struct nat_family *f, uint32_t offset, int inv) {
+  struct rtattr *data, *elem = expr_begin(b, "payload", &data);
+  attr_be32(b, NFTA_PAYLOAD_DREG, NFT_REG_1);
+  attr_be32(b, NFTA_PAYLOAD_BASE, NFT_PAYLOAD_NETWORK_HEADER);
+  attr_be32(b, NFTA_PAYLOAD_OFFSET, offset);
+  attr_be32(b, NFTA_PAYLOAD_LEN, f->len);
+  expr_end(b, elem, data);
+
+  elem = expr_begin(b, "lookup", &data);
+  rtnl_attr_str(b, NFTA_LOOKUP_SET, f->set);
+  attr_be32(b, NFTA_LOOKUP_SREG, NFT_REG_1);
+  if (inv)
+    attr_be32(b, NFTA_LOOKUP_FLAGS, NFT_LOOKUP_F_INV);
+  expr_end(b, elem, data);
+}
+
+// ct state established,related
+static void expr_established(struct rtnl_batch *b) {
+  const uint32_t mask = NF_CT_STATE_BIT(IP_CT_ESTABLISHED) | NF_CT_STATE_BIT(IP_CT_RELATED);
+  const uint32_t zero = 0;
+
+  struct rtattr *data, *elem = expr_begin(b, "ct", &data);
+  attr_be32(b, NFTA_CT_KEY, NFT_CT_STATE);
+  attr_be32(b, NFTA_CT_DREG, NFT_REG_1);
+  expr_end(b, elem, data);
+
+  elem = expr_begin(b, "bitwise", &data);
+  attr_be32(b, NFTA_BITWISE_SREG, NFT_REG_1);
+  attr_be32(b, NFTA_BITWISE_DREG, NFT_REG_1);
+  attr_be32(b, NFTA_BITWISE_LEN, sizeof(mask));
+  attr_data(b, NFTA_BITWISE_MASK, &mask, sizeof(mask));
+  attr_data(b, NFTA_BITWISE_XOR, &zero, sizeof(zero));
+  expr_end(b, elem, data);
+  expr_cmp(b, NFT_CMP_NEQ, &zero, sizeof(zero));
+}
+
+static void expr_verdict(struct rtnl_batch *b, uint32_t code) {
+  struct rtattr *data, *elem = expr_begin(b, "immediate", &data);
+  attr_be32(b, NFTA_IMMEDIATE_DREG, NFT_REG_VERDICT);
+  struct rtattr *imm = rtnl_nest(b, NFTA_IMMEDIATE_DATA);
+  struct rtattr *verdict = rtnl_nest(b, NFTA_DATA_VERDICT);
+  attr_be32(b, NFTA_VERDICT_CODE, code);
+  rtnl_nest_end(b, verdict);
+  rtnl_nest_end(b, imm);
+  expr_end(b, elem, data);
+}
+
+static void expr_masq(struct rtnl_batch *b) {
+  struct rtattr *data, *elem = expr_begin(b, "masq", &data);
+  expr_end(b, elem, data);
+}
+
+// socket cgroupv2 level <level> <id>, the cgroup of the socket or of its
+// ancestor at level
+static void expr_cgroup(struct rtnl_batch *b, uint32_t level, uint64_t id) {
+  struct rtattr *data, *elem = expr_begin(b, "socket", &data);
+  attr_be32(b, NFTA_SOCKET_KEY, NFT_SOCKET_CGROUPV2);
+  attr_be32(b, NFTA_SOCKET_DREG, NFT_REG_1);
+  attr_be32(b, NFTA_SOCKET_LEVEL, level);
+  expr_end(b, elem, data);
+  expr_cmp(b, NFT_CMP_EQ, &id, sizeof(id));
+}
+
+// meta mark 0 meta mark set <mark>, a mark of the job is kept
+static void expr_mark(struct rtnl_batch *b, uint32_t mark) {
+  const uint32_t zero = 0;
+
+  struct rtattr *data, *elem = expr_begin(b, "meta", &data);
+  attr_be32(b, NFTA_META_KEY, NFT_META_MARK);
+  attr_be32(b, NFTA_META_DREG, NFT_REG_1);
+  expr_end(b, elem, data);
+  expr_cmp(b, NFT_CMP_EQ, &zero, sizeof(zero));
+
+  elem = expr_begin(b, "immediate", &data);
+  attr_be32(b, NFTA_IMMEDIATE_DREG, NFT_REG_1);
+  attr_data(b, NFTA_IMMEDIATE_DATA, &mark, sizeof(mark));
+  expr_end(b, elem, data);
+
+  elem = expr_begin(b, "meta", &data);
+  attr_be32(b, NFTA_META_KEY, NFT_META_MARK);
+  attr_be32(b, NFTA_META_SREG, NFT_REG_1);
+  expr_end(b, elem, data);
+}
+
+static struct rtattr *rule_begin(struct rtnl_batch *b, const char *chain) {
+  nft_msg(b, NFT_MSG_NEWRULE, NLM_F_CREATE | NLM_F_APPEND);
+  rtnl_attr_str(b, NFTA_RULE_TABLE, NAT_TABLE);
+  rtnl_attr_str(b, NFTA_RULE_CHAIN, chain);
+  return rtnl_nest(b, NFTA_RULE_EXPRESSIONS);
+}
+
+static void rules_add(struct rtnl_batch *b, const struct nat_family *f) {
+  // Traffic between the namespaces is not masqueraded
+  struct rtattr *exprs = rule_begin(b, "postrouting");
+  expr_nfproto(b, f);
+  expr_lookup(b, f, f->saddr, 0);
+  expr_lookup(b, f, f->daddr, 1);
+  expr_masq(b);
+  rtnl_nest_end(b, exprs);
+
+  exprs = rule_begin(b, "forward");
+  expr_nfproto(b, f);
+  expr_lookup(b, f, f->daddr, 0);
+  expr_established(b);
+  expr_verdict(b, NF_ACCEPT);
+  rtnl_nest_end(b, exprs);
+
+  // The namespaces reach each other
+  exprs = rule_begin(b, "forward");
+  expr_nfproto(b, f);
+  expr_lookup(b, f, f->saddr, 0);
+  expr_lookup(b, f, f->daddr, 0);
+  expr_verdict(b, NF_ACCEPT);
+  rtnl_nest_end(b, exprs);
+
+  exprs = rule_begin(b, "forward");
+  expr_nfproto(b, f);
+  expr_lookup(b, f, f->daddr, 0);
+  expr_verdict(b, NF_DROP);
+  rtnl_nest_end(b, exprs);
+}
+
+void nat_elem(struct rtnl_batch *b, const struct nat_subnet *s) {
+  size_t len = s->family == AF_INET ? 4 : 16;
+
+  struct rtattr *elem = rtnl_nest(b, NFTA_LIST_ELEM);
+  attr_data(b, NFTA_SET_ELEM_KEY, s->start, len);
+  rtnl_nest_end(b, elem);
+  if (s->end_wraps)
+    return;
+  elem = rtnl_nest(b, NFTA_LIST_ELEM);
+  attr_data(b, NFTA_SET_ELEM_KEY, s->end, len);
+  attr_be32(b, NFTA_SET_ELEM_FLAGS, NFT_SET_ELEM_INTERVAL_END);
+  rtnl_nest_end(b, elem);
+}
+
+// One message per set with all the subnets of its family
+static size_t elems_msg(struct rtnl_batch *b, uint16_t type, const struct nat_family *f,
+                        const struct nat_subnet *v, size_t n) {
+  size_t cnt = 0;
+
+  for (size_t i = 0; i < n; i++)
+    cnt += v[i].family == f->family;
+  if (!cnt)
+    return 0;
+  nft_msg(b, type, type == NFT_MSG_NEWSETELEM ? NLM_F_CREATE : 0);
+  rtnl_attr_str(b, NFTA_SET_ELEM_LIST_TABLE, NAT_TABLE);
+  rtnl_attr_str(b, NFTA_SET_ELEM_LIST_SET, f->set);
+  struct rtattr *nest = rtnl_nest(b, NFTA_SET_ELEM_LIST_ELEMENTS);
+  for (size_t i = 0; i < n; i++) {
+    if (v[i].family == f->family)
+      nat_elem(b, &v[i]);
+  }
+  rtnl_nest_end(b, nest);
+  return cnt;
+}
+
+// Send the batch to the namespace ns, the daemon's one if NULL
+static int nat_send_to(const struct runns_netns *ns, struct rtnl_batch *b) {
+  int one = 1;
+
+  int fd = ns ? netns_socket(ns, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER) :
+                socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+  if (fd == -1)
+    return errno;
+  // The errors don't need to carry the whole message back
+  setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+  int err = rtnl_batch_send(fd, b);
+  close(fd);
+  return err;
+}
+
+static int nat_send(struct rtnl_batch *b) {
+  return nat_send_to(NULL, b);
+}
+
+static void enable_forwarding(const struct nat_subnet *v, size_t n) {
+  static const char *paths[] = {
+    "/proc/sys/net/ipv4/ip_forward",
+    "/proc/sys/net/ipv6/conf/all/forwarding"
+  };
+
+  for (size_t i = 0; i < NAT_FAMILIES; i++) {
+    size_t j = 0;
+    for (; j < n && v[j].family != families[i].family; j++);
+    if (j == n)
+      continue;
+    int fd = open(paths[i], O_WRONLY | O_CLOEXEC);
+    if (fd == -1 || write(fd, "1", 1) != 1)
+      WARN("Can't enable forwarding in %s, errno=%d", paths[i], errno);
+    if (fd != -1)
+      close(fd);
+  }
+}
+
+// Whether the table is left by a previous daemon
+static int table_exists() {
+  struct rtnl_batch b;
+
+  rtnl_batch_init(&b);
+  table_msg(&b, NFT_MSG_GETTABLE, 0);
+  return nat_send(&b) == 0;
+}
+
+int nat_init(const struct runns_profiles *p) {
+  struct nat_subnet v[NAT_MAX_SUBNETS];
+  struct rtnl_batch b;
+  size_t n = collect(p, v);
+
+  // Nothing to set up or to clean up, e.g. the kernel has no nf_tables
+  if (!n && !table_exists()) {
+    nat_table = 0;
+    return 0;
+  }
+  rtnl_batch_init(&b);
+  batch_delim(&b, NFNL_MSG_BATCH_BEGIN);
+  // The table is created first to make the delete valid if there is none
+  table_msg(&b, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+  table_msg(&b, NFT_MSG_DELTABLE, 0);
+  if (n) {
+    table_msg(&b, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+    for (size_t i = 0; i < NAT_FAMILIES; i++)
+      set_add(&b, &families[i], i + 1);
+    chain_add(&b, "postrouting", "nat", NF_INET_POST_ROUTING, 100);
+    chain_add(&b, "forward", "filter", NF_INET_FORWARD, 0);
+    for (size_t i = 0; i < NAT_FAMILIES; i++) {
+      rules_add(&b, &families[i]);
+      elems_msg(&b, NFT_MSG_NEWSETELEM, &families[i], v, n);
+    }
+  }
+  batch_delim(&b, NFNL_MSG_BATCH_END);
+
+  int err = nat_send(&b);
+  if (err) {
+    // Without NAT profiles it is only a cleanup of a previous daemon
+    if (n)
+      WARN("Can't set up nftables table " NAT_TABLE ", errno=%d", err);
+    return n ? -1 : 0;
+  }
+  nat_table = n != 0;
+  if (n) {
+    enable_forwarding(v, n);
+    INFO("nftables table " NAT_TABLE " set up for %zu subnets", n);
+  }
+  return 0;
+}
+
+void nat_sync(const struct runns_profiles *old, const struct runns_profiles *new) {
+  struct nat_subnet vo[NAT_MAX_SUBNETS], vn[NAT_MAX_SUBNETS];
+  struct nat_subnet add[NAT_MAX_SUBNETS], del[NAT_MAX_SUBNETS];
+  struct rtnl_batch b;
+  size_t no = collect(old, vo), nn = collect(new, vn), nadd = 0, ndel = 0;
+
+  if (!nat_table || !nn) {
+    nat_init(new);
+    return;
+  }
+  for (size_t i = 0; i < no; i++) {
+    if (subnet_find(vn, nn, &vo[i]) == -1)
+      del[ndel++] = vo[i];
+  }
+  for (size_t i = 0; i < nn; i++) {
+    if (subnet_find(vo, no, &vn[i]) == -1)
+      add[nadd++] = vn[i];
+  }
+  if (!nadd && !ndel)
+    return;
+
+  // Removed first, a subnet could be replaced by an overlapping one
+  rtnl_batch_init(&b);
+  batch_delim(&b, NFNL_MSG_BATCH_BEGIN);
+  for (size_t i = 0; i < NAT_FAMILIES; i++)
+    elems_msg(&b, NFT_MSG_DELSETELEM, &families[i], del, ndel);
+  for (size_t i = 0; i < NAT_FAMILIES; i++)
+    elems_msg(&b, NFT_MSG_NEWSETELEM, &families[i], add, nadd);
+  batch_delim(&b, NFNL_MSG_BATCH_END);
+
+  int err = nat_send(&b);
+  if (err) {
+    // The table was changed behind our back, start it over
+    WARN("Can't update nftables table " NAT_TABLE ", errno=%d, rebuilding it", err);
+    nat_init(new);
+    return;
+  }
+  enable_forwarding(add, nadd);
+  INFO("nftables table " NAT_TABLE ": %zu subnets added, %zu removed", nadd, ndel);
+}
+
+int nat_marks(const struct runns_netns *ns, const struct runns_profiles *p) {
+  static struct stat self = {0};
+  struct rtnl_batch b;
+  size_t n = 0;
+
+  // The table of the daemon's own namespace is the NAT one
+  if (!self.st_ino && stat("/proc/self/ns/net", &self))
+    return errno;
+  if (ns->dev == self.st_dev && ns->ino == self.st_ino)
+    return EEXIST;
+
+  rtnl_batch_init(&b);
+  batch_delim(&b, NFNL_MSG_BATCH_BEGIN);
+  table_msg(&b, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+  table_msg(&b, NFT_MSG_DELTABLE, 0);
+  for (size_t i = 0; p && i < p->sz; i++) {
+    const struct runns_profile *pr = &p->v[i];
+    if (pr->netns != ns || !pr->tc_mark)
+      continue;
+    if (!n++) {
+      table_msg(&b, NFT_MSG_NEWTABLE, NLM_F_CREATE);
+      chain_add(&b, "output", "filter", NF_INET_LOCAL_OUT, -150);
+    }
+    struct rtattr *exprs = rule_begin(&b, "output");
+    expr_cgroup(&b, pr->cgroup_level, pr->cgroup_id);
+    expr_mark(&b, pr->tc_mark);
+    rtnl_nest_end(&b, exprs);
+  }
+  batch_delim(&b, NFNL_MSG_BATCH_END);
+  return nat_send_to(ns, &b);
+}
+
+void nat_shutdown() {
+  struct rtnl_batch b;
+
+  if (!nat_table)
+    return;
+  rtnl_batch_init(&b);
+  batch_delim(&b, NFNL_MSG_BATCH_BEGIN);
+  table_msg(&b, NFT_MSG_DELTABLE, 0);
+  batch_delim(&b, NFNL_MSG_BATCH_END);
+  int err = nat_send(&b);
+  if (err)
+    WARN("Can't remove nftables table " NAT_TABLE ", errno=%d", err);
+  nat_table = 0;
+}
@@ -0,0 +1,53 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef NAT_H
+#define NAT_H
+
+#include "rtnl.h"
+
+struct runns_netns;
+struct runns_profiles;
+
+// nftables table of the daemon. The subnets of the namespaces are elements
+// of the sets nat4 and nat6, the rules never change:
+//   postrouting: saddr in the set and daddr not in it -> masquerade
+//   forward: daddr in the set -> accept established and related, and new
+//            connections from saddr in the set, drop the rest
+#define NAT_TABLE "runns"
+#define NAT_MAX_SUBNETS 128
+
+// Network of the peer address of a profile with nat = yes
+struct nat_subnet {
+  int family;
+  unsigned char start[16];
+  unsigned char end[16];  // First address after the subnet
+  int end_wraps;          // The subnet runs up to the end of the address space
+};
+
+// Rebuild the table for the subnets of the profiles in one transaction, the
+// table is removed if there are no such subnets. Returns 0 on success.
+int nat_init(const struct runns_profiles *p);
+// Add the subnets of new which are not in old and remove the ones which are
+// gone, the other elements are not touched. Falls back to nat_init(new).
+void nat_sync(const struct runns_profiles *old, const struct runns_profiles *new);
+// Remove the table
+void nat_shutdown();
+// Set up the table in the namespace ns of the jobs: the traffic of the
+// profiles in p with a class is marked by the cgroup of its socket,
+//   output: meta mark 0 and socket cgroupv2 of the profile -> mark set
+// The table is removed if there are no such profiles. Returns 0 or errno.
+int nat_marks(const struct runns_netns *ns, const struct runns_profiles *p);
+
+// Network of the address a. Returns 0 on success.
+int nat_subnet(const struct rtnl_addr *a, struct nat_subnet *s);
+// Non-zero if the subnet a contains all of b
+int nat_covers(const struct nat_subnet *a, const struct nat_subnet *b);
+// Add the element of s to the set in the current message of the batch
+void nat_elem(struct rtnl_batch *b, const struct nat_subnet *s);
+
+#endif
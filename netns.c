@@ -0,0 +1,134 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sched.h>
+
+#ifndef NS_GET_NSTYPE
+#  define NS_GET_NSTYPE _IO(0xb7, 0x3)
+#endif
+
+struct runns_netns *netns_head = NULL;
+
+struct runns_netns *netns_get(const char *path) {
+  struct stat st;
+
+  // Bulk forwarding rules refer to a few namespaces many times, don't open
+  // them again.
+  if (!stat(path, &st)) {
+    for (struct runns_netns *p = netns_head; p != NULL; p = p->pnext) {
+      if (p->dev == st.st_dev && p->ino == st.st_ino) {
+        ++p->refs;
+        return p;
+      }
+    }
+  }
+
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    WARN("Can't open netns %s, errno=%d", path, errno);
+    return NULL;
+  }
+  if (fstat(fd, &st)) {
+    WARN("Can't stat netns %s, errno=%d", path, errno);
+    close(fd);
+    return NULL;
+  }
+  // Old kernels don't know NS_GET_NSTYPE, setns() will check it then.
+  int type = ioctl(fd, NS_GET_NSTYPE);
+  if (type != -1 && type != CLONE_NEWNET) {
+    WARN("%s is not a network namespace", path);
+    close(fd);
+    return NULL;
+  }
+
+  for (struct runns_netns *p = netns_head; p != NULL; p = p->pnext) {
+    if (p->dev == st.st_dev && p->ino == st.st_ino) {
+      close(fd);
+      ++p->refs;
+      return p;
+    }
+  }
+
+  struct runns_netns *ns = (struct runns_netns *)calloc(1, sizeof(struct runns_netns));
+  if (!ns || !(ns->path = strdup(path))) {
+    WARN("Can't allocate memory for netns %s", path);
+    free(ns);
+    close(fd);
+    return NULL;
+  }
+  ns->dev = st.st_dev;
+  ns->ino = st.st_ino;
+  ns->fd = fd;
+  ns->refs = 1;
+  ns->pnext = netns_head;
+  netns_head = ns;
+
+  return ns;
+}
+
+void netns_put(struct runns_netns *ns) {
+  if (!ns || --ns->refs)
+    return;
+
+  for (struct runns_netns **pp = &netns_head; *pp; pp = &(*pp)->pnext) {
+    if (*pp == ns) {
+      *pp = ns->pnext;
+      break;
+    }
+  }
+  close(ns->fd);
+  free(ns->path);
+  free(ns);
+}
+
+static int self_fd = -1;
+
+// Switch the daemon into ns, netns_leave() must follow on success
+static int netns_enter(const struct runns_netns *ns) {
+  if (self_fd == -1) {
+    self_fd = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if (self_fd == -1) {
+      WARN("Can't open own netns, errno=%d", errno);
+      return -1;
+    }
+  }
+  if (setns(ns->fd, CLONE_NEWNET)) {
+    WARN("Can't set netns %s, errno=%d", ns->path, errno);
+    return -1;
+  }
+  return 0;
+}
+
+static void netns_leave() {
+  int err = errno;
+  // The daemon must not stay in the other namespace
+  if (setns(self_fd, CLONE_NEWNET))
+    ERR("Can't return to own netns, errno=%d", errno);
+  errno = err;
+}
+
+int netns_socket(const struct runns_netns *ns, int domain, int type, int protocol) {
+  if (netns_enter(ns))
+    return -1;
+  int fd = socket(domain, type | SOCK_CLOEXEC, protocol);
+  netns_leave();
+  return fd;
+}
+
+int netns_open(const struct runns_netns *ns, const char *path, int flags) {
+  if (netns_enter(ns))
+    return -1;
+  int fd = open(path, flags | O_CLOEXEC);
+  netns_leave();
+  return fd;
+}
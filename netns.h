@@ -0,0 +1,40 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef NETNS_H
+#define NETNS_H
+
+#include <sys/types.h>
+
+struct dns_stub;
+
+// Network namespace opened by the daemon. Namespaces are deduplicated by
+// the inode of the nsfs file, so each of them is opened only once no matter
+// how many paths, profiles or rules refer to it.
+struct runns_netns {
+  dev_t dev;
+  ino_t ino;
+  int fd;
+  unsigned int refs;
+  char *path;         // The path used to open the namespace first
+  struct dns_stub *dns; // Caching DNS stub resolver or NULL
+  struct runns_netns *pnext;
+};
+
+extern struct runns_netns *netns_head;
+
+// Open the namespace at path (or take a reference on the already opened one)
+struct runns_netns *netns_get(const char *path);
+// Drop a reference, the namespace fd is closed with the last one
+void netns_put(struct runns_netns *ns);
+// Create a socket inside the namespace. Returns the fd or -1.
+int netns_socket(const struct runns_netns *ns, int domain, int type, int protocol);
+// Open a file inside the namespace, e.g. /proc/self/net/dev. Returns the fd
+// or -1.
+int netns_open(const struct runns_netns *ns, const char *path, int flags);
+
+#endif
@@ -0,0 +1,205 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "placement.h"
+
+#include <ctype.h>
+#include <limits.h>
+#include <net/if.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+
+int parse_cpulist(const char *str, cpu_set_t *set) {
+  CPU_ZERO(set);
+  while (*str) {
+    char *end;
+    unsigned long first = strtoul(str, &end, 10), last;
+    if (end == str)
+      return -1;
+    last = first;
+    if (*end == '-') {
+      str = end + 1;
+      last = strtoul(str, &end, 10);
+      if (end == str || last < first)
+        return -1;
+    }
+    if (last >= CPU_SETSIZE)
+      return -1;
+    for (unsigned long cpu = first; cpu <= last; cpu++)
+      CPU_SET(cpu, set);
+    if (*end == ',')
+      ++end;
+    else if (*end && !isspace((unsigned char)*end))
+      return -1;
+    while (isspace((unsigned char)*end))
+      ++end;
+    str = end;
+  }
+  return CPU_COUNT(set) ? 0 : -1;
+}
+
+// Read a sysfs attribute of the network device
+static int read_dev_attr(const char *dev, const char *attr, char *buf, size_t sz) {
+  char path[PATH_MAX];
+  if (snprintf(path, sizeof(path), "/sys/class/net/%s/device/%s", dev, attr) >= (int)sizeof(path))
+    return -1;
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  ssize_t len = read(fd, buf, sz - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+  return 0;
+}
+
+// Device of the IPv4 default route
+static int default_route_dev(char *dev) {
+  FILE *f = fopen("/proc/net/route", "re");
+  char line[256];
+  int ret = -1;
+
+  if (!f)
+    return -1;
+  while (fgets(line, sizeof(line), f)) {
+    char iface[IF_NAMESIZE];
+    unsigned long dst, mask;
+    if (sscanf(line, "%15s %lx %*x %*x %*d %*d %*d %lx", iface, &dst, &mask) == 3 &&
+        !dst && !mask) {
+      strcpy(dev, iface);
+      ret = 0;
+      break;
+    }
+  }
+  fclose(f);
+  return ret;
+}
+
+// CPUs and NUMA node local to the network device
+static int set_dev(struct placement *p, const char *dev) {
+  char buf[4096];
+
+  // Virtual devices don't have a device and so CPU locality
+  if (read_dev_attr(dev, "local_cpulist", buf, sizeof(buf)) ||
+      parse_cpulist(buf, &p->cpus)) {
+    WARN("Can't get local CPUs of %s", dev);
+    return -1;
+  }
+  p->has_cpus = 1;
+  if (!read_dev_attr(dev, "numa_node", buf, sizeof(buf)) && atoi(buf) >= 0) {
+    p->has_node = 1;
+    p->node = atoi(buf);
+  }
+  return 0;
+}
+
+int placement_set_cpus(struct placement *p, const char *val) {
+  p->cpus_auto = 0;
+  if (strncmp(val, "auto", 4) || (val[4] && val[4] != ':')) {
+    p->has_cpus = !parse_cpulist(val, &p->cpus);
+    return p->has_cpus ? 0 : -1;
+  }
+  // The uplink of a profile is known only at the end of it
+  if (!val[4]) {
+    p->has_cpus = 0;
+    p->cpus_auto = 1;
+    return 0;
+  }
+  if (strlen(val + 5) >= IF_NAMESIZE || !val[5])
+    return -1;
+  return set_dev(p, val + 5);
+}
+
+int placement_set_mempolicy(struct placement *p, const char *val) {
+  static const struct {
+    const char *name;
+    int mode;
+  } modes[] = {
+    {"default", MPOL_DEFAULT},
+    {"preferred", MPOL_PREFERRED},
+    {"bind", MPOL_BIND},
+    {"interleave", MPOL_INTERLEAVE},
+    {"local", MPOL_LOCAL}
+  };
+  const char *nodes = strchr(val, ':');
+  size_t len = nodes ? (size_t)(nodes - val) : strlen(val);
+
+  p->has_mpol = 0;
+  memset(p->nodes, 0, sizeof(p->nodes));
+  for (size_t i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+    if (strlen(modes[i].name) == len && !strncmp(val, modes[i].name, len)) {
+      p->mpol_mode = modes[i].mode;
+      p->has_mpol = 1;
+    }
+  }
+  if (!p->has_mpol)
+    return -1;
+  if (!nodes)
+    return 0;
+  if (p->mpol_mode == MPOL_DEFAULT || p->mpol_mode == MPOL_LOCAL)
+    return -1;
+
+  cpu_set_t set;
+  if (parse_cpulist(nodes + 1, &set))
+    return -1;
+  for (int n = 0; n < PLACEMENT_MAX_NODES; n++) {
+    if (CPU_ISSET(n, &set))
+      p->nodes[n / (8 * sizeof(unsigned long))] |= 1UL << (n % (8 * sizeof(unsigned long)));
+  }
+  return 0;
+}
+
+int placement_finish(struct placement *p) {
+  char dev[IF_NAMESIZE];
+  int empty = 1;
+  for (size_t i = 0; i < PLACEMENT_NODE_LONGS; i++)
+    empty &= !p->nodes[i];
+
+  if (p->cpus_auto) {
+    if (*p->uplink) {
+      strcpy(dev, p->uplink);
+    }
+    else if (default_route_dev(dev)) {
+      WARN("No default route to find the uplink for auto CPUs");
+      return -1;
+    }
+    if (set_dev(p, dev))
+      return -1;
+    p->cpus_auto = 0;
+  }
+
+  if (!p->has_mpol && p->has_node) {
+    p->has_mpol = 1;
+    p->mpol_mode = MPOL_PREFERRED;
+  }
+  if (!p->has_mpol || p->mpol_mode == MPOL_DEFAULT || p->mpol_mode == MPOL_LOCAL || !empty)
+    return 0;
+  if (!p->has_node)
+    return -1;
+  p->nodes[p->node / (8 * sizeof(unsigned long))] |= 1UL << (p->node % (8 * sizeof(unsigned long)));
+  return 0;
+}
+
+int placement_apply(const struct placement *p) {
+  if (p->has_cpus && sched_setaffinity(0, sizeof(cpu_set_t), &p->cpus)) {
+    WARN("Can't set CPU affinity, errno=%d", errno);
+    return -1;
+  }
+  // No libnuma, the policy is set with the raw syscall
+  if (p->has_mpol) {
+    int empty = p->mpol_mode == MPOL_DEFAULT || p->mpol_mode == MPOL_LOCAL;
+    if (syscall(SYS_set_mempolicy, p->mpol_mode, empty ? NULL : p->nodes,
+                empty ? 0 : PLACEMENT_MAX_NODES + 1)) {
+      WARN("Can't set memory policy %d, errno=%d", p->mpol_mode, errno);
+      return -1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,48 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PLACEMENT_H
+#define PLACEMENT_H
+
+#include <sched.h>
+#include <net/if.h>
+
+#define PLACEMENT_MAX_NODES 1024
+#define PLACEMENT_NODE_LONGS (PLACEMENT_MAX_NODES / (8 * sizeof(unsigned long)))
+
+// CPU set and memory policy applied to a job before exec
+struct placement {
+  int has_cpus;
+  cpu_set_t cpus;
+  int cpus_auto;      // "auto" without a device, resolved by placement_finish
+  char uplink[IF_NAMESIZE]; // Device of "auto", the default route one if empty
+  int has_node;
+  int node;           // NUMA node of the NIC for "auto"
+  int has_mpol;
+  int mpol_mode;      // MPOL_* from linux/mempolicy.h
+  unsigned long nodes[PLACEMENT_NODE_LONGS];
+};
+
+// Parse "<cpu list>", "auto" or "auto:<dev>". Auto takes local_cpulist of
+// the device from sysfs, "auto" alone is resolved by placement_finish.
+// Returns 0 on success.
+int placement_set_cpus(struct placement *p, const char *val);
+// Parse "<bind|preferred|interleave|local|default>[:<node list>]". The
+// nodes of bind, preferred and interleave default to the NIC node of auto.
+// Returns 0 on success.
+int placement_set_mempolicy(struct placement *p, const char *val);
+// Take the CPUs of "auto" from the uplink (the device of the default route if
+// not set), fill the nodes of the policy from auto and prefer the NIC node for
+// memory if auto CPUs are used without a policy. Returns 0 on success.
+int placement_finish(struct placement *p);
+// Apply to the calling process. Returns 0 on success.
+int placement_apply(const struct placement *p);
+// Parse a CPU (or NUMA node) list, e.g. "0-3,8", into set. Returns 0 on
+// success.
+int parse_cpulist(const char *str, cpu_set_t *set);
+
+#endif
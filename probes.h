@@ -0,0 +1,26 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PROBES_H
+#define PROBES_H
+
+// USDT probes of the runns provider for perf and bpftrace. The first argument
+// of every probe is the request ID, so one launch could be followed from
+// accept to the exit of the job:
+//
+//   bpftrace -e 'usdt:/usr/bin/runns:runns:* { printf("%d %s\n", arg0, probe); }'
+//
+// A probe is a nop in the binary until a tracer attaches. Built with
+// sys/sdt.h only (--enable-usdt), empty otherwise.
+#ifdef ENABLE_USDT
+#  include <sys/sdt.h>
+#  define PROBE(name, ...) STAP_PROBEV(runns, name, ##__VA_ARGS__)
+#else
+#  define PROBE(name, ...) do { } while (0)
+#endif
+
+#endif
@@ -0,0 +1,439 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "tc.h"
+
+#include <sys/stat.h>
+#include <sys/vfs.h>
+#include <arpa/inet.h>
+#include <linux/magic.h>
+#include <ctype.h>
+#include <grp.h>
+#include <limits.h>
+
+struct runns_profiles profiles = {0};
+
+// Append an element to the array *v of *sz elements
+static int append(void **v, size_t *sz, size_t el_sz, const void *el) {
+  void *p = realloc(*v, (*sz + 1) * el_sz);
+  if (!p)
+    return -1;
+  memcpy((char *)p + *sz * el_sz, el, el_sz);
+  *v = p;
+  ++*sz;
+  return 0;
+}
+
+static char *trim(char *s) {
+  while (isspace((unsigned char)*s))
+    ++s;
+  char *end = s + strlen(s);
+  while (end > s && isspace((unsigned char)end[-1]))
+    *--end = '\0';
+  return s;
+}
+
+static int parse_ids(char *str, int is_group, void **v, size_t *sz) {
+  for (char *tok = strtok(str, ","); tok; tok = strtok(NULL, ",")) {
+    tok = trim(tok);
+    char *end;
+    unsigned long id = strtoul(tok, &end, 10);
+    if (*end != '\0' || end == tok) {
+      if (!is_group)
+        return -1;
+      struct group *gr = getgrnam(tok);
+      if (!gr)
+        return -1;
+      id = gr->gr_gid;
+    }
+    if (is_group) {
+      gid_t gid = (gid_t)id;
+      if (append(v, sz, sizeof(gid), &gid))
+        return -1;
+    }
+    else {
+      uid_t uid = (uid_t)id;
+      if (append(v, sz, sizeof(uid), &uid))
+        return -1;
+    }
+  }
+  return 0;
+}
+
+// Parse an IPv4 or IPv6 address of a DNS server
+static int parse_dns_upstream(struct runns_profile *p, const char *val) {
+  struct sockaddr_storage *ss = &p->dns_ups[p->dns_ups_sz];
+  struct sockaddr_in *in = (struct sockaddr_in *)ss;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)ss;
+
+  if (p->dns_ups_sz >= DNS_MAX_UPSTREAMS)
+    return -1;
+  memset(ss, 0, sizeof(*ss));
+  if (inet_pton(AF_INET, val, &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(53);
+  }
+  else if (inet_pton(AF_INET6, val, &in6->sin6_addr) == 1) {
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(53);
+  }
+  else {
+    return -1;
+  }
+  ++p->dns_ups_sz;
+  return 0;
+}
+
+// Parse "<IPv4>:<port>" or "[<IPv6>]:<port>" of the proxy
+static int parse_proxy(struct runns_profile *p, char *val) {
+  struct sockaddr_in *in = (struct sockaddr_in *)&p->proxy;
+  struct sockaddr_in6 *in6 = (struct sockaddr_in6 *)&p->proxy;
+  char *colon = strrchr(val, ':'), *end;
+
+  if (!colon)
+    return -1;
+  *colon = '\0';
+  unsigned long port = strtoul(colon + 1, &end, 10);
+  if (*end != '\0' || end == colon + 1 || !port || port > 65535)
+    return -1;
+  memset(&p->proxy, 0, sizeof(p->proxy));
+  size_t len = strlen(val);
+  if (*val == '[' && len > 2 && val[len - 1] == ']') {
+    val[len - 1] = '\0';
+    if (inet_pton(AF_INET6, val + 1, &in6->sin6_addr) != 1)
+      return -1;
+    in6->sin6_family = AF_INET6;
+    in6->sin6_port = htons(port);
+  }
+  else if (inet_pton(AF_INET, val, &in->sin_addr) == 1) {
+    in->sin_family = AF_INET;
+    in->sin_port = htons(port);
+  }
+  else {
+    return -1;
+  }
+  return 0;
+}
+
+// Take the upstreams from the nameserver lines of the profile resolv.conf
+static void resolv_upstreams(struct runns_profile *p) {
+  FILE *f = fopen(p->resolv, "re");
+  char *line = NULL;
+  size_t line_sz = 0;
+
+  if (!f)
+    return;
+  while (getline(&line, &line_sz, f) != -1) {
+    char *s = trim(line);
+    if (strncmp(s, "nameserver", 10) || !isspace((unsigned char)s[10]))
+      continue;
+    // Loopback servers are not reachable from the namespace through the stub
+    s = trim(s + 10);
+    if (strncmp(s, "127.", 4) && strcmp(s, "::1"))
+      parse_dns_upstream(p, s);
+  }
+  free(line);
+  fclose(f);
+}
+
+static void profile_free(struct runns_profile *p) {
+  netns_put(p->netns);
+  free(p->resolv);
+  for (size_t i = 0; i < p->envs_sz; free(p->envs[i++]));
+  free(p->envs);
+  for (size_t i = 0; i < p->progs_sz; i++) {
+    free(p->progs[i].path);
+    close(p->progs[i].fd);
+  }
+  free(p->progs);
+  if (p->cgroup_fd != -1)
+    close(p->cgroup_fd);
+  if (p->cgroup_dir_fd != -1)
+    close(p->cgroup_dir_fd);
+  free(p->uids);
+  free(p->gids);
+}
+
+// The id of a cgroup2 cgroup at path is the inode of its directory, its level
+// is the number of the directories up to the root of the file system.
+static void cgroup_locate(struct runns_profile *p, const char *path) {
+  struct stat st, up;
+  struct statfs fs;
+
+  int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1 || fstatfs(fd, &fs) || fs.f_type != CGROUP2_SUPER_MAGIC || fstat(fd, &st)) {
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  p->cgroup_id = st.st_ino;
+  p->cgroup_level = 0;
+  while (1) {
+    int parent = openat(fd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    close(fd);
+    fd = parent;
+    if (fd == -1 || fstat(fd, &up) || up.st_dev != st.st_dev || up.st_ino == st.st_ino)
+      break;
+    st = up;
+    ++p->cgroup_level;
+  }
+  if (fd != -1)
+    close(fd);
+}
+
+// Apply "key = value" to the profile p
+static int profile_set(struct runns_profile *p, const char *key, char *val) {
+  if (!strcmp(key, "netns")) {
+    if (p->netns)
+      return -1;
+    p->netns = netns_get(val);
+    return p->netns ? 0 : -1;
+  }
+  if (!strcmp(key, "resolv")) {
+    if (access(val, R_OK))
+      return -1;
+    free(p->resolv);
+    p->resolv = strdup(val);
+    return p->resolv ? 0 : -1;
+  }
+  if (!strcmp(key, "env")) {
+    char *env = strdup(val);
+    if (!env || !strchr(env, '=') || append((void **)&p->envs, &p->envs_sz, sizeof(char *), &env)) {
+      free(env);
+      return -1;
+    }
+    return 0;
+  }
+  if (!strcmp(key, "program")) {
+    struct runns_program prog = {.path = strdup(val), .fd = open(val, O_PATH | O_CLOEXEC)};
+    if (!prog.path || prog.fd == -1 || access(val, X_OK) ||
+        append((void **)&p->progs, &p->progs_sz, sizeof(prog), &prog)) {
+      free(prog.path);
+      if (prog.fd != -1)
+        close(prog.fd);
+      return -1;
+    }
+    return 0;
+  }
+  if (!strcmp(key, "cgroup")) {
+    char procs[PATH_MAX];
+    if (p->cgroup_fd != -1 ||
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", val) >= (int)sizeof(procs))
+      return -1;
+    p->cgroup_fd = open(procs, O_WRONLY | O_CLOEXEC);
+    if (p->cgroup_fd == -1)
+      return -1;
+    // Used to drain the namespace
+    p->cgroup_dir_fd = open(val, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    cgroup_locate(p, val);
+    return 0;
+  }
+  if (!strcmp(key, "cpus"))
+    return placement_set_cpus(&p->place, val);
+  if (!strcmp(key, "mempolicy"))
+    return placement_set_mempolicy(&p->place, val);
+  if (!strcmp(key, "uids"))
+    return parse_ids(val, 0, (void **)&p->uids, &p->uids_sz);
+  if (!strcmp(key, "groups"))
+    return parse_ids(val, 1, (void **)&p->gids, &p->gids_sz);
+  if (!strcmp(key, "dns-cache")) {
+    if (strcmp(val, "yes") && strcmp(val, "no"))
+      return -1;
+    p->dns_cache = !strcmp(val, "yes");
+    return 0;
+  }
+  if (!strcmp(key, "dns-upstream"))
+    return parse_dns_upstream(p, val);
+  if (!strcmp(key, "veth")) {
+    char *peer = strchr(val, ':');
+    if (*p->veth.host || !peer || peer == val || !peer[1] ||
+        peer - val >= IFNAMSIZ || strlen(peer + 1) >= IFNAMSIZ)
+      return -1;
+    memcpy(p->veth.host, val, peer - val);
+    strcpy(p->veth.peer, peer + 1);
+    return 0;
+  }
+  if (!strcmp(key, "address"))
+    return rtnl_parse_addr(val, &p->veth.host_addr);
+  if (!strcmp(key, "peer-address"))
+    return rtnl_parse_addr(val, &p->veth.peer_addr);
+  if (!strcmp(key, "nat")) {
+    if (strcmp(val, "yes") && strcmp(val, "no"))
+      return -1;
+    p->nat = !strcmp(val, "yes");
+    return 0;
+  }
+  if (!strcmp(key, "proxy"))
+    return parse_proxy(p, val);
+  if (!strcmp(key, "egress-rate"))
+    return tc_parse_rate(val, &p->veth.egress_rate);
+  if (!strcmp(key, "ingress-rate"))
+    return tc_parse_rate(val, &p->veth.ingress_rate);
+  if (!strcmp(key, "class"))
+    return tc_parse_class(val, &p->tc_mark);
+  if (!strcmp(key, "gateway")) {
+    if (strcmp(val, "yes") && strcmp(val, "no"))
+      return -1;
+    p->veth.gateway = !strcmp(val, "yes");
+    return 0;
+  }
+
+  return -1;
+}
+
+// Check that the profile is complete and terminate the environment
+static int profile_finish(struct runns_profile *p) {
+  char *null = NULL;
+  if (!p->netns || !p->progs_sz)
+    return -1;
+  if (p->dns_cache && !p->dns_ups_sz && p->resolv)
+    resolv_upstreams(p);
+  if (p->dns_cache && !p->dns_ups_sz)
+    return -1;
+  // "auto" CPUs are the ones of the NIC the namespace goes out through
+  if (p->veth.peer_addr.family && rtnl_uplink(&p->veth.peer_addr, p->place.uplink))
+    *p->place.uplink = '\0';
+  if (placement_finish(&p->place))
+    return -1;
+  // The addresses are of the veth, the gateway is the host side of it
+  if (!*p->veth.host && (p->veth.host_addr.family || p->veth.peer_addr.family))
+    return -1;
+  if (p->veth.gateway && (!p->veth.host_addr.family ||
+                          p->veth.host_addr.family != p->veth.peer_addr.family))
+    return -1;
+  if (p->nat && !p->veth.peer_addr.family)
+    return -1;
+  if (!*p->veth.host && (p->veth.egress_rate || p->veth.ingress_rate))
+    return -1;
+  // The class is matched by the cgroup2 cgroup of the jobs' sockets
+  if (p->tc_mark && (!p->veth.egress_rate || !p->cgroup_id))
+    return -1;
+  return append((void **)&p->envs, &p->envs_sz, sizeof(char *), &null) ? -1 : 0;
+}
+
+int profiles_load(const char *path, struct runns_profiles *out) {
+  FILE *f = fopen(path, "re");
+  if (!f) {
+    WARN("Can't open configuration %s, errno=%d", path, errno);
+    return -1;
+  }
+
+  char *line = NULL;
+  size_t line_sz = 0;
+  unsigned int lineno = 0;
+  struct runns_profile *cur = NULL;
+  int ret = 0;
+
+  memset(out, 0, sizeof(*out));
+  while (getline(&line, &line_sz, f) != -1) {
+    ++lineno;
+    char *s = trim(line);
+    if (*s == '\0' || *s == '#')
+      continue;
+
+    // New profile
+    if (*s == '[') {
+      char *end = strchr(s, ']');
+      size_t len = end ? (size_t)(end - s - 1) : 0;
+      if (!len || len >= RUNNS_PROFILE_MAXLEN) {
+        WARN("%s:%u: bad profile name", path, lineno);
+        ret = -1;
+        break;
+      }
+      if (cur && profile_finish(cur)) {
+        WARN("%s: profile %s is incomplete (netns, program, DNS upstreams or mempolicy nodes)", path, cur->name);
+        ret = -1;
+        break;
+      }
+      struct runns_profile p = {.cgroup_fd = -1, .cgroup_dir_fd = -1};
+      memcpy(p.name, s + 1, len);
+      if (profile_find_in(out, p.name) ||
+          append((void **)&out->v, &out->sz, sizeof(p), &p)) {
+        WARN("%s:%u: duplicated profile %s", path, lineno, p.name);
+        ret = -1;
+        break;
+      }
+      cur = &out->v[out->sz - 1];
+      continue;
+    }
+
+    char *eq = strchr(s, '=');
+    if (!cur || !eq) {
+      WARN("%s:%u: expected [profile] or key = value", path, lineno);
+      ret = -1;
+      break;
+    }
+    *eq = '\0';
+    char *key = trim(s), *val = trim(eq + 1);
+    if (profile_set(cur, key, val)) {
+      WARN("%s:%u: bad value for %s in profile %s, errno=%d", path, lineno, key, cur->name, errno);
+      ret = -1;
+      break;
+    }
+  }
+  if (!ret && cur && profile_finish(cur)) {
+    WARN("%s: profile %s is incomplete (netns, program, DNS upstreams or mempolicy nodes)", path, cur->name);
+    ret = -1;
+  }
+
+  free(line);
+  fclose(f);
+  if (ret)
+    profiles_free(out);
+  return ret;
+}
+
+void profiles_free(struct runns_profiles *p) {
+  for (size_t i = 0; i < p->sz; profile_free(&p->v[i++]));
+  free(p->v);
+  memset(p, 0, sizeof(*p));
+}
+
+struct runns_profile *profile_find_in(struct runns_profiles *p, const char *name) {
+  for (size_t i = 0; i < p->sz; i++) {
+    if (!strncmp(p->v[i].name, name, RUNNS_PROFILE_MAXLEN))
+      return &p->v[i];
+  }
+  return NULL;
+}
+
+struct runns_profile *profile_find(const char *name) {
+  return profile_find_in(&profiles, name);
+}
+
+int profile_allowed(const struct runns_profile *p, uid_t uid,
+                    const gid_t *groups, int ngroups) {
+  // No restrictions, the socket is accessible only for the runns group anyway
+  if (!p->uids_sz && !p->gids_sz)
+    return 1;
+  for (size_t i = 0; i < p->uids_sz; i++) {
+    if (p->uids[i] == uid)
+      return 1;
+  }
+  for (size_t i = 0; i < p->gids_sz; i++) {
+    for (int j = 0; j < ngroups; j++) {
+      if (p->gids[i] == groups[j])
+        return 1;
+    }
+  }
+  return 0;
+}
+
+const struct runns_program *profile_program(const struct runns_profile *p,
+                                            const char *path) {
+  if (!path || !*path)
+    return &p->progs[0];
+  for (size_t i = 0; i < p->progs_sz; i++) {
+    if (!strcmp(p->progs[i].path, path))
+      return &p->progs[i];
+  }
+  return NULL;
+}
@@ -0,0 +1,77 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <sched.h>
+#include <stdint.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+#include "dns.h"
+#include "placement.h"
+#include "rtnl.h"
+
+// Default path of the profiles configuration.
+#define DEFAULT_RUNNS_CONFIG "/etc/runns/profiles.conf"
+#define RUNNS_PROFILE_MAXLEN 64
+
+struct runns_program {
+  char *path;
+  int fd;             // O_PATH fd of the program
+};
+
+// Launch profile, all of its resources are opened when the configuration is
+// loaded, so a launch only needs a lookup by name.
+struct runns_profile {
+  char name[RUNNS_PROFILE_MAXLEN];
+  struct runns_netns *netns;
+  char *resolv;
+  char **envs;        // NULL terminated environment template
+  size_t envs_sz;
+  struct runns_program *progs;
+  size_t progs_sz;
+  int cgroup_fd;      // cgroup.procs of the cgroup or -1
+  int cgroup_dir_fd;  // Directory of the cgroup to drain it or -1
+  uint64_t cgroup_id; // Inode of a cgroup2 cgroup, 0 for cgroup v1
+  unsigned int cgroup_level; // Depth of the cgroup below the root
+  struct placement place; // CPUs and memory policy
+  uid_t *uids;
+  size_t uids_sz;
+  gid_t *gids;
+  size_t gids_sz;
+  int dns_cache;      // Run a caching DNS stub in the namespace
+  struct sockaddr_storage dns_ups[DNS_MAX_UPSTREAMS];
+  size_t dns_ups_sz;
+  struct rtnl_veth veth; // veth pair into the namespace
+  uint32_t tc_mark;   // Egress class of the jobs (TC_MARK_*) or 0
+  int nat;            // Masquerade the network of the peer address
+  struct sockaddr_storage proxy; // SOCKS5/HTTP proxy address, family 0 if none
+};
+
+struct runns_profiles {
+  struct runns_profile *v;
+  size_t sz;
+};
+
+extern struct runns_profiles profiles;
+
+// Parse the configuration at path into out. Returns 0 on success.
+int profiles_load(const char *path, struct runns_profiles *out);
+void profiles_free(struct runns_profiles *p);
+struct runns_profile *profile_find_in(struct runns_profiles *p, const char *name);
+// Lookup in the currently loaded profiles
+struct runns_profile *profile_find(const char *name);
+// Check whether a client may use the profile.
+int profile_allowed(const struct runns_profile *p, uid_t uid,
+                    const gid_t *groups, int ngroups);
+// Find the program in the allowed list, NULL or empty path means the first one.
+const struct runns_program *profile_program(const struct runns_profile *p,
+                                            const char *path);
+
+#endif
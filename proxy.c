@@ -0,0 +1,1331 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "dns.h"
+#include "creds.h"
+#include "rtnl.h"
+#include "proxy.h"
+
+#include <sys/epoll.h>
+#include <sys/mount.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <arpa/inet.h>
+#include <linux/inet_diag.h>
+#include <linux/sock_diag.h>
+#include <netdb.h>
+#include <grp.h>
+#include <sched.h>
+#include <time.h>
+
+#define PROXY_HDR_MAX 4096
+#define PROXY_MAX_CONNS 1024
+// Every connection takes two sockets and two pipes
+#define PROXY_CONN_FDS 6
+#define PROXY_HANDSHAKE_SEC 10
+#define PROXY_CONNECT_SEC 10
+// The names are resolved by the resolver processes forked in the namespace,
+// PROXY_RESOLVE_SEC limits a lookup
+#define PROXY_RESOLVERS 4
+#define PROXY_RESOLVE_SEC 10
+#define PROXY_ADDRS_MAX 8
+// Destinations requested again within PROXY_POOL_IDLE get a spare upstream
+// connection, established before the next request comes
+#define PROXY_POOL_MAX 64
+#define PROXY_POOL_IDLE 30
+#define PROXY_PIPES_MAX 64
+#define PROXY_SPLICE_SZ 65536
+#define PROXY_USERS_MAX 32
+#define PROXY_RESPAWN_SEC 5
+// Sanity limit of the proxies passed on restart
+#define PROXY_PROCS_MAX 4096
+// The proxy of the previous daemon image could be still exiting
+#define PROXY_BIND_TRIES 20
+
+/*
+ * Request parsers
+ */
+int proxy_socks_hello(const uint8_t *buf, size_t len, int *noauth) {
+  if (len < 2)
+    return 0;
+  if (buf[0] != 5 || !buf[1])
+    return -1;
+  if (len < 2 + (size_t)buf[1])
+    return 0;
+  *noauth = memchr(buf + 2, 0, buf[1]) != NULL;
+  return 2 + buf[1];
+}
+
+int proxy_socks_request(const uint8_t *buf, size_t len, struct proxy_dest *d, int *rep) {
+  size_t addr_len;
+
+  *rep = PROXY_SOCKS_FAILURE;
+  if (len < 5)
+    return 0;
+  if (buf[0] != 5 || buf[2] != 0)
+    return -1;
+  switch (buf[3]) {
+    case 1: addr_len = 4; break;
+    case 3: addr_len = 1 + buf[4]; break;
+    case 4: addr_len = 16; break;
+    default:
+      *rep = PROXY_SOCKS_BAD_ATYP;
+      return -1;
+  }
+  // VER CMD RSV ATYP ADDR PORT
+  size_t req_len = 4 + addr_len + 2;
+  if (len < req_len)
+    return 0;
+  if (buf[1] != 1) {
+    *rep = PROXY_SOCKS_BAD_COMMAND;
+    return -1;
+  }
+
+  if (buf[3] == 3) {
+    if (!buf[4] || memchr(buf + 5, 0, buf[4]))
+      return -1;
+    memcpy(d->host, buf + 5, buf[4]);
+    d->host[buf[4]] = '\0';
+  }
+  else {
+    inet_ntop(buf[3] == 1 ? AF_INET : AF_INET6, buf + 4, d->host, sizeof(d->host));
+  }
+  d->port = buf[req_len - 2] << 8 | buf[req_len - 1];
+  return d->port ? (int)req_len : -1;
+}
+
+int proxy_http_request(const char *buf, size_t len, struct proxy_dest *d, int *status) {
+  *status = 400;
+  const char *end = memmem(buf, len, "\r\n\r\n", 4);
+  if (!end)
+    return 0;
+  const char *eol = memmem(buf, end - buf + 2, "\r\n", 2);
+  if (eol - buf < 8 || memcmp(buf, "CONNECT ", 8)) {
+    *status = 405;
+    return -1;
+  }
+
+  // CONNECT <host>:<port> HTTP/1.x, an IPv6 host is put in brackets
+  const char *host = buf + 8;
+  const char *sp = memchr(host, ' ', eol - host);
+  if (!sp || eol - sp != 9 || memcmp(sp + 1, "HTTP/1.", 7))
+    return -1;
+  const char *colon = sp;
+  while (colon > host && colon[-1] != ':')
+    --colon;
+  if (colon == host || colon == sp)
+    return -1;
+  const char *host_end = colon - 1;
+  if (*host == '[') {
+    if (host_end[-1] != ']')
+      return -1;
+    ++host;
+    --host_end;
+  }
+  if (host_end == host || host_end - host >= (ptrdiff_t)sizeof(d->host))
+    return -1;
+
+  unsigned long port = 0;
+  for (const char *p = colon; p < sp; p++) {
+    if (*p < '0' || *p > '9' || (port = port * 10 + *p - '0') > 65535)
+      return -1;
+  }
+  if (!port)
+    return -1;
+  memcpy(d->host, host, host_end - host);
+  d->host[host_end - host] = '\0';
+  d->port = port;
+  return end - buf + 4;
+}
+
+/*
+ * Proxy process
+ */
+enum { PROXY_UP, PROXY_DOWN }; // client -> upstream and back
+
+enum proxy_state {
+  PROXY_AUTH,         // Groups of the client are looked up
+  PROXY_HELLO,        // Protocol is unknown or SOCKS5 greeting
+  PROXY_REQUEST,
+  PROXY_RESOLVING,
+  PROXY_CONNECTING,
+  PROXY_RELAY,
+};
+
+enum {
+  PROXY_SOCKS = 1,
+  PROXY_HTTP,
+};
+
+struct proxy_conn;
+struct proxy_spare;
+struct proxy_helper;
+
+// Socket in epoll, data.ptr points here
+struct proxy_end {
+  int fd;
+  int registered;
+  uint32_t events;
+  struct proxy_conn *conn;
+  struct proxy_spare *spare;
+  struct proxy_helper *helper;
+};
+
+// Addresses of a destination from the resolver, n is 0 if it failed
+struct proxy_addrs {
+  int n;
+  struct sockaddr_storage addr[PROXY_ADDRS_MAX];
+};
+
+// Reply of the credentials helper
+struct proxy_creds {
+  int ret;
+  struct creds c;
+};
+
+// Socket to a helper process, which answers the requests in order
+struct proxy_helper {
+  struct proxy_end end; // fd -1 if there is no process
+  int busy;
+  struct proxy_conn *conn; // Waiting for the reply of the resolver
+};
+
+struct proxy_conn {
+  struct proxy_end client;
+  struct proxy_end upstream;
+  enum proxy_state state;
+  int proto;
+  int dead;           // Freed after the current epoll batch
+  unsigned int slot;
+  time_t deadline;
+  uid_t uid;
+  struct proxy_dest dest;
+  struct proxy_helper *resolver;
+  struct proxy_addrs addrs;      // Addresses of dest
+  int next_addr;                 // The next one to try
+  struct sockaddr_storage addr;  // The address being connected
+  socklen_t addr_len;
+  int pipes[2][2];
+  size_t queued[2];   // Bytes in the pipes
+  int eof[2];
+  int shut[2];
+  struct proxy_conn *dead_next;
+  size_t len;
+  uint8_t buf[PROXY_HDR_MAX];
+};
+
+// Recently requested destination
+struct proxy_spare {
+  struct proxy_end end; // Spare upstream connection or fd -1
+  int ready;
+  struct proxy_dest dest; // Port 0 if the entry is free
+  struct sockaddr_storage addr;
+  socklen_t addr_len;
+  time_t used;
+  time_t since;       // The spare is connecting since
+};
+
+// Access decision for a local user
+struct proxy_user {
+  uid_t uid;
+  int allowed;
+  time_t until;
+};
+
+static const struct runns_profile *prof;
+static gid_t runns_gid = (gid_t)-1;
+static int ep = -1;
+static int diag_fd = -1;
+static unsigned int max_conns = PROXY_MAX_CONNS;
+static struct proxy_conn *conns[PROXY_MAX_CONNS];
+static unsigned int conns_sz;
+static struct proxy_conn *dead_conns;
+static struct proxy_spare pool[PROXY_POOL_MAX];
+static int free_pipes[PROXY_PIPES_MAX][2];
+static unsigned int free_pipes_sz;
+static struct proxy_user users[PROXY_USERS_MAX];
+static struct proxy_helper creds_helper = {.end.fd = -1};
+static struct proxy_helper resolvers[PROXY_RESOLVERS];
+
+static time_t now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+static void end_watch(struct proxy_end *e, uint32_t events) {
+  if (e->registered && e->events == events)
+    return;
+  struct epoll_event ev = {.events = events, .data.ptr = e};
+  if (epoll_ctl(ep, e->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, e->fd, &ev)) {
+    WARN("Proxy: can't watch fd %d, errno=%d", e->fd, errno);
+    return;
+  }
+  e->registered = 1;
+  e->events = events;
+}
+
+static void end_close(struct proxy_end *e) {
+  if (e->fd != -1)
+    close(e->fd);
+  e->fd = -1;
+  e->registered = 0;
+}
+
+// 0 if the socket is connected, EINPROGRESS if not yet
+static int sock_error(int fd) {
+  struct sockaddr_storage ss;
+  socklen_t ss_len = sizeof(ss);
+  int err = 0;
+  socklen_t len = sizeof(err);
+
+  if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len))
+    return errno;
+  if (err)
+    return err;
+  return getpeername(fd, (struct sockaddr *)&ss, &ss_len) ? EINPROGRESS : 0;
+}
+
+static int pipe_get(int p[2]) {
+  if (free_pipes_sz) {
+    memcpy(p, free_pipes[--free_pipes_sz], sizeof(free_pipes[0]));
+    return 0;
+  }
+  return pipe2(p, O_NONBLOCK | O_CLOEXEC);
+}
+
+// Keep an empty pipe for the next connection
+static void pipe_put(int p[2], size_t queued) {
+  if (p[0] == -1)
+    return;
+  if (!queued && free_pipes_sz < PROXY_PIPES_MAX) {
+    memcpy(free_pipes[free_pipes_sz++], p, sizeof(free_pipes[0]));
+  }
+  else {
+    close(p[0]);
+    close(p[1]);
+  }
+  p[0] = p[1] = -1;
+}
+
+static socklen_t addr_len(const struct sockaddr_storage *ss) {
+  return ss->ss_family == AF_INET ? sizeof(struct sockaddr_in) : sizeof(struct sockaddr_in6);
+}
+
+// Close the inherited descriptors but the n ones in keep
+static void close_inherited(const int *keep, int n) {
+  unsigned int lo = STDERR_FILENO + 1;
+  while (1) {
+    // The lowest one left to keep
+    unsigned int next = ~0U;
+    for (int i = 0; i < n; i++) {
+      if ((unsigned int)keep[i] >= lo && (unsigned int)keep[i] < next)
+        next = keep[i];
+    }
+    if (next == ~0U)
+      break;
+    if (next > lo)
+      close_range(lo, next - 1, 0);
+    lo = next + 1;
+  }
+  close_range(lo, ~0U, 0);
+}
+
+/*
+ * Helper processes
+ */
+static void resolver_main(int fd) {
+  struct proxy_dest d;
+  struct proxy_addrs r;
+  struct addrinfo hints = {
+    .ai_socktype = SOCK_STREAM,
+    .ai_flags = AI_ADDRCONFIG | AI_NUMERICSERV
+  };
+  char port[8];
+
+  while (recv(fd, &d, sizeof(d), 0) == sizeof(d)) {
+    struct addrinfo *ai = NULL;
+    d.host[sizeof(d.host) - 1] = '\0';
+    snprintf(port, sizeof(port), "%u", d.port);
+    r.n = 0;
+    alarm(PROXY_RESOLVE_SEC);
+    if (!getaddrinfo(d.host, port, &hints, &ai)) {
+      for (struct addrinfo *a = ai; a && r.n < PROXY_ADDRS_MAX; a = a->ai_next) {
+        if (a->ai_addrlen <= sizeof(r.addr[0]))
+          memcpy(&r.addr[r.n++], a->ai_addr, a->ai_addrlen);
+      }
+      freeaddrinfo(ai);
+    }
+    alarm(0);
+    if (send(fd, &r, sizeof(r), 0) != sizeof(r))
+      break;
+  }
+}
+
+static void creds_main(int fd) {
+  static struct proxy_creds r;
+  uid_t uid;
+
+  if (creds_drop())
+    return;
+  while (recv(fd, &uid, sizeof(uid), 0) == sizeof(uid)) {
+    alarm(CREDS_RESOLVE_TIMEOUT);
+    r.ret = creds_resolve(uid, &r.c);
+    alarm(0);
+    if (send(fd, &r, sizeof(r), 0) != sizeof(r))
+      break;
+  }
+}
+
+// Fork a process serving the requests on a socket with fn
+static int helper_start(struct proxy_helper *h, void (*fn)(int)) {
+  int sv[2];
+
+  if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv))
+    return -1;
+  pid_t pid = fork();
+  if (pid == -1) {
+    close(sv[0]);
+    close(sv[1]);
+    return -1;
+  }
+  if (pid == 0) {
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    close_inherited(&sv[1], 1);
+    fn(sv[1]);
+    _exit(EXIT_SUCCESS);
+  }
+  close(sv[1]);
+  h->end = (struct proxy_end){.fd = sv[0], .helper = h};
+  h->busy = 0;
+  h->conn = NULL;
+  end_watch(&h->end, EPOLLIN);
+  return 0;
+}
+
+/*
+ * Pool of the destinations
+ */
+static struct proxy_spare *pool_find(const struct proxy_dest *d) {
+  for (int i = 0; i < PROXY_POOL_MAX; i++) {
+    if (pool[i].dest.port == d->port && !strcasecmp(pool[i].dest.host, d->host))
+      return &pool[i];
+  }
+  return NULL;
+}
+
+static void pool_clear(struct proxy_spare *sp) {
+  end_close(&sp->end);
+  sp->ready = 0;
+  sp->dest.port = 0;
+}
+
+static void pool_add(const struct proxy_dest *d, const struct sockaddr_storage *addr, socklen_t addr_len) {
+  struct proxy_spare *sp = NULL;
+  for (int i = 0; i < PROXY_POOL_MAX; i++) {
+    if (!pool[i].dest.port) {
+      sp = &pool[i];
+      break;
+    }
+    if (!sp || pool[i].used < sp->used)
+      sp = &pool[i];
+  }
+  pool_clear(sp);
+  sp->dest = *d;
+  memcpy(&sp->addr, addr, addr_len);
+  sp->addr_len = addr_len;
+  sp->used = now();
+}
+
+static void pool_connect(struct proxy_spare *sp) {
+  sp->end.fd = socket(sp->addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sp->end.fd == -1)
+    return;
+  if (connect(sp->end.fd, (struct sockaddr *)&sp->addr, sp->addr_len) && errno != EINPROGRESS) {
+    end_close(&sp->end);
+    return;
+  }
+  sp->since = now();
+  end_watch(&sp->end, EPOLLOUT);
+}
+
+// Take the spare connection if it is still usable. Returns the fd or -1.
+static int pool_take(struct proxy_spare *sp) {
+  char c;
+
+  if (sp->end.fd == -1 || !sp->ready)
+    return -1;
+  // The data sent by the server before the request stays for the client
+  ssize_t n = recv(sp->end.fd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+  if (n == 0 || (n == -1 && errno != EAGAIN)) {
+    end_close(&sp->end);
+    sp->ready = 0;
+    return -1;
+  }
+  int fd = sp->end.fd;
+  epoll_ctl(ep, EPOLL_CTL_DEL, fd, NULL);
+  sp->end.fd = -1;
+  sp->end.registered = 0;
+  sp->ready = 0;
+  return fd;
+}
+
+static void pool_event(struct proxy_spare *sp, uint32_t events) {
+  if (sp->end.fd == -1)
+    return;
+  if (!sp->ready && !(events & (EPOLLERR | EPOLLHUP))) {
+    int err = sock_error(sp->end.fd);
+    if (err == EINPROGRESS)
+      return;
+    if (!err) {
+      sp->ready = 1;
+      end_watch(&sp->end, EPOLLRDHUP);
+      return;
+    }
+  }
+  // Closed by the server or failed
+  end_close(&sp->end);
+  sp->ready = 0;
+}
+
+/*
+ * Access control
+ */
+struct diag_owner {
+  int found;
+  uid_t uid;
+};
+
+static void diag_reply(const struct nlmsghdr *h, void *arg) {
+  struct diag_owner *o = (struct diag_owner *)arg;
+  if (h->nlmsg_type != SOCK_DIAG_BY_FAMILY)
+    return;
+  o->found = 1;
+  o->uid = ((const struct inet_diag_msg *)NLMSG_DATA(h))->idiag_uid;
+}
+
+// Owner of the local socket connected to fd. Returns -1 if the client is
+// not local.
+static int client_uid(int fd, uid_t *uid) {
+  static struct rtnl_batch b;
+  struct sockaddr_storage peer, local;
+  socklen_t peer_len = sizeof(peer), local_len = sizeof(local);
+  struct diag_owner o = {0};
+  struct inet_diag_req_v2 req = {
+    .sdiag_protocol = IPPROTO_TCP,
+    .idiag_states = ~0U,
+    .id.idiag_cookie = {INET_DIAG_NOCOOKIE, INET_DIAG_NOCOOKIE}
+  };
+
+  if (getpeername(fd, (struct sockaddr *)&peer, &peer_len) ||
+      getsockname(fd, (struct sockaddr *)&local, &local_len))
+    return -1;
+  // The client socket is the one with the swapped addresses
+  if (peer.ss_family == AF_INET) {
+    const struct sockaddr_in *p = (const struct sockaddr_in *)&peer, *l = (const struct sockaddr_in *)&local;
+    req.sdiag_family = AF_INET;
+    req.id.idiag_sport = p->sin_port;
+    req.id.idiag_dport = l->sin_port;
+    memcpy(req.id.idiag_src, &p->sin_addr, 4);
+    memcpy(req.id.idiag_dst, &l->sin_addr, 4);
+  }
+  else {
+    const struct sockaddr_in6 *p = (const struct sockaddr_in6 *)&peer, *l = (const struct sockaddr_in6 *)&local;
+    int mapped = IN6_IS_ADDR_V4MAPPED(&p->sin6_addr);
+    size_t off = mapped ? 12 : 0;
+    req.sdiag_family = mapped ? AF_INET : AF_INET6;
+    req.id.idiag_sport = p->sin6_port;
+    req.id.idiag_dport = l->sin6_port;
+    memcpy(req.id.idiag_src, p->sin6_addr.s6_addr + off, 16 - off);
+    memcpy(req.id.idiag_dst, l->sin6_addr.s6_addr + off, 16 - off);
+  }
+
+  rtnl_batch_init(&b);
+  rtnl_msg(&b, SOCK_DIAG_BY_FAMILY, 0, &req, sizeof(req));
+  rtnl_replies(&b, diag_reply, &o);
+  if (rtnl_batch_send(diag_fd, &b) || !o.found)
+    return -1;
+  *uid = o.uid;
+  return 0;
+}
+
+static struct proxy_user *user_find(uid_t uid, time_t t) {
+  struct proxy_user *u = NULL;
+
+  for (int i = 0; i < PROXY_USERS_MAX; i++) {
+    if (users[i].until > t && users[i].uid == uid)
+      return &users[i];
+    if (!u || users[i].until < u->until)
+      u = &users[i];
+  }
+  u->uid = uid;
+  u->until = 0;
+  return u;
+}
+
+// A profile without users and groups is for the runns group, like the daemon
+// socket. Returns -1 if the groups of uid are being looked up, the decision
+// comes with creds_reply() then.
+static int user_allowed(uid_t uid) {
+  time_t t = now();
+  struct proxy_user *u = user_find(uid, t);
+
+  if (u->until)
+    return u->allowed;
+  if (uid == 0 || (prof->uids_sz && profile_allowed(prof, uid, NULL, 0))) {
+    u->allowed = 1;
+    u->until = t + CREDS_TTL;
+  }
+  // The users are resolved on the host, not through the namespace
+  else if (send(creds_helper.end.fd, &uid, sizeof(uid), MSG_DONTWAIT) == sizeof(uid)) {
+    u->allowed = -1;
+    u->until = t + PROXY_HANDSHAKE_SEC;
+  }
+  else {
+    u->allowed = 0;
+    u->until = t + CREDS_RETRY;
+  }
+  return u->allowed;
+}
+
+static void conn_allowed(struct proxy_conn *c, int allowed);
+
+static void creds_reply() {
+  static struct proxy_creds r;
+
+  ssize_t n = recv(creds_helper.end.fd, &r, sizeof(r), MSG_DONTWAIT);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n != sizeof(r)) {
+    // The daemon starts the proxy again
+    WARN("Proxy %s: the credentials helper is gone", prof->name);
+    exit(EXIT_FAILURE);
+  }
+
+  const struct creds *c = &r.c;
+  int ngroups = c->ngroups == -1 ? CREDS_MAX_GROUPS : c->ngroups;
+  int allowed = 0;
+  if (r.ret || !c->found)
+    allowed = 0;
+  else if (prof->uids_sz || prof->gids_sz)
+    allowed = profile_allowed(prof, c->uid, c->groups, ngroups);
+  else
+    for (int i = 0; i < ngroups && !allowed; allowed = c->groups[i++] == runns_gid);
+
+  time_t t = now();
+  struct proxy_user *u = user_find(c->uid, t);
+  u->allowed = allowed;
+  u->until = t + (r.ret ? CREDS_RETRY : CREDS_TTL);
+  for (unsigned int i = conns_sz; i > 0; i--) {
+    if (conns[i - 1]->state == PROXY_AUTH && conns[i - 1]->uid == c->uid)
+      conn_allowed(conns[i - 1], allowed);
+  }
+}
+
+/*
+ * Connections
+ */
+static void conn_close(struct proxy_conn *c) {
+  if (c->dead)
+    return;
+  c->dead = 1;
+  end_close(&c->client);
+  end_close(&c->upstream);
+  pipe_put(c->pipes[PROXY_UP], c->queued[PROXY_UP]);
+  pipe_put(c->pipes[PROXY_DOWN], c->queued[PROXY_DOWN]);
+  // The reply of the resolver is dropped
+  if (c->resolver)
+    c->resolver->conn = NULL;
+  conns[c->slot] = conns[--conns_sz];
+  conns[c->slot]->slot = c->slot;
+  c->dead_next = dead_conns;
+  dead_conns = c;
+}
+
+static void conn_reply(struct proxy_conn *c, int rep, int status) {
+  char buf[64];
+  size_t len;
+
+  if (c->proto == PROXY_SOCKS) {
+    struct sockaddr_storage ss = {0};
+    socklen_t ss_len = sizeof(ss);
+    // VER REP RSV ATYP BND.ADDR BND.PORT
+    uint8_t *r = (uint8_t *)buf;
+    memset(r, 0, 4 + 16 + 2);
+    r[0] = 5;
+    r[1] = rep;
+    r[3] = 1;
+    len = 4 + 4 + 2;
+    if (rep == PROXY_SOCKS_OK && !getsockname(c->upstream.fd, (struct sockaddr *)&ss, &ss_len)) {
+      if (ss.ss_family == AF_INET) {
+        const struct sockaddr_in *in = (const struct sockaddr_in *)&ss;
+        memcpy(r + 4, &in->sin_addr, 4);
+        memcpy(r + 8, &in->sin_port, 2);
+      }
+      else {
+        const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&ss;
+        r[3] = 4;
+        memcpy(r + 4, &in6->sin6_addr, 16);
+        memcpy(r + 20, &in6->sin6_port, 2);
+        len = 4 + 16 + 2;
+      }
+    }
+  }
+  else {
+    const char *reason = status == 200 ? "Connection established" :
+                         status == 400 ? "Bad Request" :
+                         status == 403 ? "Forbidden" :
+                         status == 405 ? "Method Not Allowed" :
+                         status == 504 ? "Gateway Timeout" : "Bad Gateway";
+    len = snprintf(buf, sizeof(buf), "HTTP/1.1 %d %s\r\n\r\n", status, reason);
+  }
+  send(c->client.fd, buf, len, MSG_NOSIGNAL);
+}
+
+// Reply with the error of the upstream connection and close
+static void conn_fail(struct proxy_conn *c, int err) {
+  int rep = err == ECONNREFUSED ? PROXY_SOCKS_REFUSED :
+            err == ENETUNREACH ? PROXY_SOCKS_NET_UNREACH :
+            err == EHOSTUNREACH || err == ETIMEDOUT ? PROXY_SOCKS_HOST_UNREACH :
+            PROXY_SOCKS_FAILURE;
+  conn_reply(c, rep, err == ETIMEDOUT ? 504 : 502);
+  conn_close(c);
+}
+
+static int conn_try(struct proxy_conn *c, const struct sockaddr *sa, socklen_t len) {
+  int fd = socket(sa->sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (fd == -1)
+    return errno;
+  if (connect(fd, sa, len) && errno != EINPROGRESS) {
+    int err = errno;
+    close(fd);
+    return err;
+  }
+  memcpy(&c->addr, sa, len);
+  c->addr_len = len;
+  c->upstream.fd = fd;
+  c->state = PROXY_CONNECTING;
+  c->deadline = now() + PROXY_CONNECT_SEC;
+  end_watch(&c->upstream, EPOLLOUT);
+  return 0;
+}
+
+// Connect to the next address of the destination or fail with err
+static void conn_next(struct proxy_conn *c, int err) {
+  while (c->next_addr < c->addrs.n) {
+    const struct sockaddr_storage *a = &c->addrs.addr[c->next_addr++];
+    if (!(err = conn_try(c, (const struct sockaddr *)a, addr_len(a))))
+      return;
+  }
+  conn_fail(c, err);
+}
+
+static void conn_relay(struct proxy_conn *c);
+
+static void conn_connected(struct proxy_conn *c) {
+  if (pipe_get(c->pipes[PROXY_UP]) || pipe_get(c->pipes[PROXY_DOWN])) {
+    WARN("Proxy: can't create pipe, errno=%d", errno);
+    conn_fail(c, errno);
+    return;
+  }
+  conn_reply(c, PROXY_SOCKS_OK, 200);
+  // Bytes sent by the client right after the request
+  if (c->len) {
+    if (write(c->pipes[PROXY_UP][1], c->buf, c->len) != (ssize_t)c->len) {
+      conn_close(c);
+      return;
+    }
+    c->queued[PROXY_UP] = c->len;
+    c->len = 0;
+  }
+
+  // A repeated destination gets a spare connection for the next request
+  struct proxy_spare *sp = pool_find(&c->dest);
+  if (!sp)
+    pool_add(&c->dest, &c->addr, c->addr_len);
+  else if (sp->end.fd == -1)
+    pool_connect(sp);
+
+  c->state = PROXY_RELAY;
+  uint32_t events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  end_watch(&c->client, events);
+  end_watch(&c->upstream, events);
+  conn_relay(c);
+}
+
+// Pass the destination to an idle resolver, the connection waits for one
+// otherwise
+static void conn_resolve(struct proxy_conn *c) {
+  struct proxy_helper *h = NULL;
+
+  for (int i = 0; i < PROXY_RESOLVERS && !h; i++) {
+    if (resolvers[i].end.fd != -1 && !resolvers[i].busy)
+      h = &resolvers[i];
+  }
+  for (int i = 0; i < PROXY_RESOLVERS && !h; i++) {
+    if (resolvers[i].end.fd == -1 && !helper_start(&resolvers[i], resolver_main))
+      h = &resolvers[i];
+  }
+  if (!h)
+    return;
+  if (send(h->end.fd, &c->dest, sizeof(c->dest), MSG_DONTWAIT) != sizeof(c->dest)) {
+    end_close(&h->end);
+    conn_fail(c, EHOSTUNREACH);
+    return;
+  }
+  h->busy = 1;
+  h->conn = c;
+  c->resolver = h;
+}
+
+static void resolve_reply(struct proxy_helper *h) {
+  static struct proxy_addrs r;
+  struct proxy_conn *c = h->conn;
+
+  ssize_t n = recv(h->end.fd, &r, sizeof(r), MSG_DONTWAIT);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n != sizeof(r)) {
+    // Killed by the alarm or failed, another one is started on demand
+    end_close(&h->end);
+    r.n = 0;
+  }
+  h->busy = 0;
+  h->conn = NULL;
+  if (c) {
+    c->resolver = NULL;
+    c->addrs = r;
+    c->next_addr = 0;
+    conn_next(c, EHOSTUNREACH);
+  }
+
+  // Next waiting connection
+  for (unsigned int i = conns_sz; i > 0; i--) {
+    struct proxy_conn *w = conns[i - 1];
+    if (w->state == PROXY_RESOLVING && !w->resolver && !w->dead) {
+      conn_resolve(w);
+      break;
+    }
+  }
+}
+
+static void conn_request(struct proxy_conn *c) {
+  struct proxy_spare *sp = pool_find(&c->dest);
+
+  end_watch(&c->client, 0);
+  if (sp) {
+    sp->used = now();
+    c->upstream.fd = pool_take(sp);
+    if (c->upstream.fd != -1) {
+      memcpy(&c->addr, &sp->addr, sp->addr_len);
+      c->addr_len = sp->addr_len;
+      conn_connected(c);
+      return;
+    }
+    // The destination is resolved already
+    if (!conn_try(c, (struct sockaddr *)&sp->addr, sp->addr_len))
+      return;
+  }
+
+  // Resolved inside the namespace with its resolv.conf
+  c->state = PROXY_RESOLVING;
+  c->deadline = now() + PROXY_RESOLVE_SEC;
+  conn_resolve(c);
+}
+
+static void conn_read(struct proxy_conn *c) {
+  ssize_t n = recv(c->client.fd, c->buf + c->len, sizeof(c->buf) - c->len, 0);
+  if (n == -1 && (errno == EAGAIN || errno == EINTR))
+    return;
+  if (n <= 0) {
+    conn_close(c);
+    return;
+  }
+  c->len += n;
+  if (!c->proto) {
+    c->proto = c->buf[0] == 5 ? PROXY_SOCKS : PROXY_HTTP;
+    c->state = c->proto == PROXY_SOCKS ? PROXY_HELLO : PROXY_REQUEST;
+  }
+
+  int used = 0, rep = PROXY_SOCKS_FAILURE, status = 400;
+  if (c->state == PROXY_HELLO) {
+    int noauth;
+    used = proxy_socks_hello(c->buf, c->len, &noauth);
+    if (used > 0) {
+      uint8_t r[2] = {5, noauth ? 0 : 0xff};
+      if (send(c->client.fd, r, sizeof(r), MSG_NOSIGNAL) != sizeof(r) || !noauth) {
+        conn_close(c);
+        return;
+      }
+      c->len -= used;
+      memmove(c->buf, c->buf + used, c->len);
+      c->state = PROXY_REQUEST;
+    }
+    else if (used == -1) {
+      conn_close(c);
+      return;
+    }
+  }
+  if (c->state == PROXY_REQUEST) {
+    used = c->proto == PROXY_SOCKS ?
+           proxy_socks_request(c->buf, c->len, &c->dest, &rep) :
+           proxy_http_request((const char *)c->buf, c->len, &c->dest, &status);
+    if (used > 0) {
+      c->len -= used;
+      memmove(c->buf, c->buf + used, c->len);
+      conn_request(c);
+      return;
+    }
+  }
+  if (used == -1 || c->len == sizeof(c->buf)) {
+    conn_reply(c, rep, status);
+    conn_close(c);
+  }
+}
+
+// Move the data of direction d through its pipe. Returns -1 on error.
+static int relay(struct proxy_conn *c, int d) {
+  int src = d == PROXY_UP ? c->client.fd : c->upstream.fd;
+  int dst = d == PROXY_UP ? c->upstream.fd : c->client.fd;
+  int *p = c->pipes[d];
+
+  while (1) {
+    if (c->queued[d]) {
+      ssize_t n = splice(p[0], NULL, dst, NULL, c->queued[d], SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n == -1)
+        return errno == EAGAIN ? 0 : -1;
+      c->queued[d] -= n;
+      continue;
+    }
+    if (c->eof[d]) {
+      if (!c->shut[d]) {
+        shutdown(dst, SHUT_WR);
+        c->shut[d] = 1;
+      }
+      return 0;
+    }
+    ssize_t n = splice(src, NULL, p[1], NULL, PROXY_SPLICE_SZ, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n == -1)
+      return errno == EAGAIN ? 0 : -1;
+    if (n == 0)
+      c->eof[d] = 1;
+    c->queued[d] += n;
+  }
+}
+
+// Both sockets are edge triggered, each direction runs until the source is
+// drained or the destination is full.
+static void conn_relay(struct proxy_conn *c) {
+  if (relay(c, PROXY_UP) || relay(c, PROXY_DOWN) ||
+      (c->shut[PROXY_UP] && c->shut[PROXY_DOWN]))
+    conn_close(c);
+}
+
+static void conn_event(struct proxy_end *e, uint32_t events) {
+  struct proxy_conn *c = e->conn;
+
+  if (c->dead || e->fd == -1)
+    return;
+  switch (c->state) {
+    case PROXY_AUTH:
+    case PROXY_RESOLVING:
+      // Only the client hangs up here
+      conn_close(c);
+      break;
+    case PROXY_HELLO:
+    case PROXY_REQUEST:
+      if (events & (EPOLLERR | EPOLLHUP))
+        conn_close(c);
+      else
+        conn_read(c);
+      break;
+    case PROXY_CONNECTING:
+      if (e == &c->client) {
+        conn_close(c);
+        break;
+      }
+      int err = sock_error(c->upstream.fd);
+      if (err == EINPROGRESS)
+        break;
+      if (err) {
+        end_close(&c->upstream);
+        conn_next(c, err);
+        break;
+      }
+      conn_connected(c);
+      break;
+    case PROXY_RELAY:
+      conn_relay(c);
+      break;
+  }
+}
+
+static void conn_allowed(struct proxy_conn *c, int allowed) {
+  if (!allowed) {
+    WARN("Proxy %s: uid=%d is not allowed", prof->name, c->uid);
+    conn_close(c);
+    return;
+  }
+  c->state = PROXY_HELLO;
+  end_watch(&c->client, EPOLLIN);
+}
+
+static void helper_event(struct proxy_helper *h) {
+  if (h == &creds_helper)
+    creds_reply();
+  else
+    resolve_reply(h);
+}
+
+static void proxy_accept(int lfd) {
+  while (1) {
+    int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
+      return;
+    }
+
+    uid_t uid;
+    if (client_uid(fd, &uid)) {
+      WARN("Proxy %s: the client is not local", prof->name);
+      close(fd);
+      continue;
+    }
+    int allowed = user_allowed(uid);
+    if (!allowed) {
+      WARN("Proxy %s: uid=%d is not allowed", prof->name, uid);
+      close(fd);
+      continue;
+    }
+    struct proxy_conn *c = NULL;
+    if (conns_sz < max_conns)
+      c = (struct proxy_conn *)calloc(1, sizeof(struct proxy_conn));
+    if (!c) {
+      WARN("Proxy %s: too many connections", prof->name);
+      close(fd);
+      continue;
+    }
+    c->client = (struct proxy_end){.fd = fd, .conn = c};
+    c->upstream = (struct proxy_end){.fd = -1, .conn = c};
+    memset(c->pipes, -1, sizeof(c->pipes));
+    c->uid = uid;
+    c->state = PROXY_AUTH;
+    c->deadline = now() + PROXY_HANDSHAKE_SEC;
+    c->slot = conns_sz;
+    conns[conns_sz++] = c;
+    if (allowed == 1)
+      conn_allowed(c, 1);
+  }
+}
+
+static void proxy_expire() {
+  time_t t = now();
+
+  for (unsigned int i = conns_sz; i > 0; i--) {
+    struct proxy_conn *c = conns[i - 1];
+    if (c->state == PROXY_RELAY || t < c->deadline)
+      continue;
+    if (c->state == PROXY_CONNECTING) {
+      end_close(&c->upstream);
+      conn_next(c, ETIMEDOUT);
+    }
+    else if (c->state == PROXY_RESOLVING) {
+      conn_fail(c, ETIMEDOUT);
+    }
+    else {
+      conn_close(c);
+    }
+  }
+  for (int i = 0; i < PROXY_POOL_MAX; i++) {
+    struct proxy_spare *sp = &pool[i];
+    if (!sp->dest.port)
+      continue;
+    if (t - sp->used >= PROXY_POOL_IDLE)
+      pool_clear(sp);
+    else if (sp->end.fd != -1 && !sp->ready && t - sp->since >= PROXY_CONNECT_SEC)
+      end_close(&sp->end);
+  }
+}
+
+static void proxy_main(const struct runns_profile *p, const char *resolv) {
+  sigset_t mask;
+
+  // Don't outlive the daemon, the helpers are reaped by the kernel
+  signal(SIGCHLD, SIG_IGN);
+  signal(SIGHUP, SIG_DFL);
+  signal(SIGUSR2, SIG_DFL);
+  signal(SIGPIPE, SIG_IGN);
+  sigemptyset(&mask);
+  sigprocmask(SIG_SETMASK, &mask, NULL);
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  prctl(PR_SET_NAME, "runns-proxy");
+  prof = p;
+
+  struct group *gr = getgrnam("runns");
+  if (gr)
+    runns_gid = gr->gr_gid;
+
+  // The clients are on the host, the upstream sockets are created in the
+  // namespace
+  int lfd = socket(p->proxy.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0), on = 1;
+  int ret = lfd == -1 ? -1 : setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  for (int i = 0; !ret && i < PROXY_BIND_TRIES; i++) {
+    ret = bind(lfd, (const struct sockaddr *)&p->proxy, addr_len(&p->proxy));
+    if (!ret || errno != EADDRINUSE)
+      break;
+    usleep(100000);
+  }
+  if (ret || listen(lfd, SOMAXCONN)) {
+    WARN("Proxy %s: can't listen, errno=%d", p->name, errno);
+    exit(EXIT_FAILURE);
+  }
+  diag_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_SOCK_DIAG);
+  if (diag_fd == -1) {
+    WARN("Proxy %s: can't open sock_diag, errno=%d", p->name, errno);
+    exit(EXIT_FAILURE);
+  }
+  struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+  ep = epoll_create1(EPOLL_CLOEXEC);
+  if (ep == -1 || epoll_ctl(ep, EPOLL_CTL_ADD, lfd, &ev)) {
+    WARN("Proxy %s: can't create epoll, errno=%d", p->name, errno);
+    exit(EXIT_FAILURE);
+  }
+  // NSS is used from the host, like by the daemon
+  if (helper_start(&creds_helper, creds_main)) {
+    WARN("Proxy %s: can't start the credentials helper, errno=%d", p->name, errno);
+    exit(EXIT_FAILURE);
+  }
+
+  if (setns(p->netns->fd, CLONE_NEWNET)) {
+    WARN("Proxy %s: can't set netns, errno=%d", p->name, errno);
+    exit(EXIT_FAILURE);
+  }
+  if (resolv && (unshare(CLONE_NEWNS) ||
+                 mount("none", "/", NULL, MS_REC | MS_PRIVATE, NULL) ||
+                 mount(resolv, "/etc/resolv.conf", NULL, MS_BIND, NULL))) {
+    WARN("Proxy %s: can't mount %s to /etc/resolv.conf, errno=%d", p->name, resolv, errno);
+    exit(EXIT_FAILURE);
+  }
+  // Nothing from the daemon is needed here
+  int keep[] = {lfd, diag_fd, ep, creds_helper.end.fd};
+  close_inherited(keep, sizeof(keep) / sizeof(keep[0]));
+
+  struct rlimit rl;
+  if (!getrlimit(RLIMIT_NOFILE, &rl)) {
+    rl.rlim_cur = rl.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &rl);
+    getrlimit(RLIMIT_NOFILE, &rl);
+    rlim_t spare = PROXY_POOL_MAX + 2 * PROXY_PIPES_MAX + PROXY_RESOLVERS + 16;
+    rlim_t n = rl.rlim_cur > spare ? (rl.rlim_cur - spare) / PROXY_CONN_FDS : 0;
+    if (n < max_conns)
+      max_conns = n;
+  }
+  // The clients are served and the resolvers are forked unprivileged
+  if (creds_drop())
+    exit(EXIT_FAILURE);
+
+  for (int i = 0; i < PROXY_POOL_MAX; i++)
+    pool[i].end = (struct proxy_end){.fd = -1, .spare = &pool[i]};
+  for (int i = 0; i < PROXY_RESOLVERS; i++)
+    resolvers[i].end = (struct proxy_end){.fd = -1, .helper = &resolvers[i]};
+
+  while (1) {
+    struct epoll_event evs[64];
+    int n = epoll_wait(ep, evs, 64, 1000);
+    if (n == -1 && errno != EINTR) {
+      WARN("Proxy %s: epoll failed, errno=%d", p->name, errno);
+      exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < n; i++) {
+      struct proxy_end *e = (struct proxy_end *)evs[i].data.ptr;
+      if (!e)
+        proxy_accept(lfd);
+      else if (e->spare)
+        pool_event(e->spare, evs[i].events);
+      else if (e->helper)
+        helper_event(e->helper);
+      else
+        conn_event(e, evs[i].events);
+    }
+    proxy_expire();
+    while (dead_conns) {
+      struct proxy_conn *c = dead_conns;
+      dead_conns = c->dead_next;
+      free(c);
+    }
+  }
+}
+
+/*
+ * Daemon side
+ */
+struct proxy_proc {
+  char profile[RUNNS_PROFILE_MAXLEN];
+  pid_t pid;          // 0 to be started, -1 if failed
+  time_t started;
+  uint64_t sum;       // proxy_sum() of the profile, used on restart
+};
+
+static struct proxy_proc *procs;
+static size_t procs_sz;
+// Proxies passed by the previous daemon image, taken by proxy_start()
+static struct proxy_proc *adopted;
+static unsigned int adopted_sz;
+
+static struct proxy_proc *proc_find(const char *name) {
+  for (size_t i = 0; i < procs_sz; i++) {
+    if (!strncmp(procs[i].profile, name, RUNNS_PROFILE_MAXLEN))
+      return &procs[i];
+  }
+  return NULL;
+}
+
+static void proc_stop(size_t i) {
+  if (procs[i].pid > 0)
+    kill(procs[i].pid, SIGTERM);
+  procs[i] = procs[--procs_sz];
+}
+
+static uint64_t fnv(uint64_t h, const void *data, size_t sz) {
+  for (size_t i = 0; i < sz; i++)
+    h = (h ^ ((const uint8_t *)data)[i]) * 0x100000001b3ULL;
+  return h;
+}
+
+// Everything the proxy takes from the profile, it works with a copy made on
+// fork
+static uint64_t proxy_sum(const struct runns_profile *p) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  h = fnv(h, &p->proxy, sizeof(p->proxy));
+  h = fnv(h, p->netns->path, strlen(p->netns->path) + 1);
+  h = fnv(h, &p->dns_cache, sizeof(p->dns_cache));
+  if (p->resolv)
+    h = fnv(h, p->resolv, strlen(p->resolv) + 1);
+  h = fnv(h, &p->uids_sz, sizeof(p->uids_sz));
+  h = fnv(h, p->uids, p->uids_sz * sizeof(uid_t));
+  h = fnv(h, &p->gids_sz, sizeof(p->gids_sz));
+  return fnv(h, p->gids, p->gids_sz * sizeof(gid_t));
+}
+
+// Take the proxy of p left by the previous daemon image
+static int proxy_adopt(struct proxy_proc *pr, uint64_t sum) {
+  for (unsigned int i = 0; i < adopted_sz; i++) {
+    struct proxy_proc *a = &adopted[i];
+    if (a->pid > 0 && a->sum == sum && !strncmp(a->profile, pr->profile, RUNNS_PROFILE_MAXLEN)) {
+      pr->pid = a->pid;
+      pr->started = a->started;
+      a->pid = 0;
+      INFO("Proxy %d taken over for %s", pr->pid, pr->profile);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+void proxy_start() {
+  for (size_t i = 0; i < profiles.sz; i++) {
+    const struct runns_profile *p = &profiles.v[i];
+    if (!p->proxy.ss_family)
+      continue;
+
+    struct proxy_proc *pr = proc_find(p->name);
+    if (!pr) {
+      void *v = realloc(procs, (procs_sz + 1) * sizeof(struct proxy_proc));
+      if (!v) {
+        WARN("Can't allocate memory for proxy of %s", p->name);
+        continue;
+      }
+      procs = (struct proxy_proc *)v;
+      pr = &procs[procs_sz++];
+      memset(pr, 0, sizeof(*pr));
+      memcpy(pr->profile, p->name, RUNNS_PROFILE_MAXLEN);
+    }
+    if (pr->pid)
+      continue;
+    pr->sum = proxy_sum(p);
+    if (proxy_adopt(pr, pr->sum))
+      continue;
+
+    const char *resolv = dns_resolv(p->netns) ? dns_resolv(p->netns) : p->resolv;
+    pid_t pid = fork();
+    if (pid == -1) {
+      WARN("Can't fork proxy for %s", p->name);
+      continue;
+    }
+    if (pid == 0)
+      proxy_main(p, resolv); // Never returns
+    pr->pid = pid;
+    pr->started = time(NULL);
+    INFO("Proxy %d started for %s", pid, p->name);
+  }
+
+  // The proxies of the profiles which are gone or changed
+  for (unsigned int i = 0; i < adopted_sz; i++) {
+    if (adopted[i].pid > 0)
+      kill(adopted[i].pid, SIGTERM);
+  }
+  free(adopted);
+  adopted = NULL;
+  adopted_sz = 0;
+}
+
+void proxy_sync(const struct runns_profiles *old, const struct runns_profiles *new) {
+  for (size_t i = procs_sz; i > 0; i--) {
+    const struct runns_profile *a = profile_find_in((struct runns_profiles *)old, procs[i - 1].profile);
+    const struct runns_profile *b = profile_find_in((struct runns_profiles *)new, procs[i - 1].profile);
+    if (!a || !b || !b->proxy.ss_family || proxy_sum(a) != proxy_sum(b))
+      proc_stop(i - 1);
+    else if (procs[i - 1].pid == -1)
+      procs[i - 1].pid = 0;
+  }
+}
+
+void proxy_stop_all() {
+  while (procs_sz)
+    proc_stop(procs_sz - 1);
+  free(procs);
+  procs = NULL;
+}
+
+int proxy_save(int fd) {
+  unsigned int n = procs_sz;
+  if (write(fd, (void *)&n, sizeof(n)) != sizeof(n) ||
+      write(fd, (void *)procs, n * sizeof(struct proxy_proc)) != (ssize_t)(n * sizeof(struct proxy_proc)))
+    return -1;
+  return 0;
+}
+
+int proxy_load(int fd) {
+  unsigned int n;
+  if (read(fd, (void *)&n, sizeof(n)) != sizeof(n) || n > PROXY_PROCS_MAX)
+    return -1;
+  adopted = (struct proxy_proc *)calloc(n ? n : 1, sizeof(struct proxy_proc));
+  if (!adopted || read(fd, (void *)adopted, n * sizeof(struct proxy_proc)) != (ssize_t)(n * sizeof(struct proxy_proc))) {
+    free(adopted);
+    adopted = NULL;
+    return -1;
+  }
+  adopted_sz = n;
+  return 0;
+}
+
+int proxy_reaped(pid_t pid) {
+  for (size_t i = 0; i < procs_sz; i++) {
+    if (procs[i].pid == pid) {
+      WARN("Proxy %d for %s exited", pid, procs[i].profile);
+      // Don't respawn a proxy which can't start until the next reload
+      procs[i].pid = time(NULL) - procs[i].started < PROXY_RESPAWN_SEC ? -1 : 0;
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,57 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+struct runns_profiles;
+
+// SOCKS5 reply codes, RFC 1928
+#define PROXY_SOCKS_OK 0
+#define PROXY_SOCKS_FAILURE 1
+#define PROXY_SOCKS_NOT_ALLOWED 2
+#define PROXY_SOCKS_NET_UNREACH 3
+#define PROXY_SOCKS_HOST_UNREACH 4
+#define PROXY_SOCKS_REFUSED 5
+#define PROXY_SOCKS_BAD_COMMAND 7
+#define PROXY_SOCKS_BAD_ATYP 8
+
+// Destination of a request, host is a name or an address literal
+struct proxy_dest {
+  char host[256];
+  in_port_t port;     // Host byte order
+};
+
+// The parsers return the number of bytes taken from buf, 0 if more bytes
+// are needed or -1 if the request is broken.
+
+// SOCKS5 greeting, *noauth is set if the client accepts no authentication
+int proxy_socks_hello(const uint8_t *buf, size_t len, int *noauth);
+// SOCKS5 CONNECT request, *rep is the reply code for a broken request
+int proxy_socks_request(const uint8_t *buf, size_t len, struct proxy_dest *d, int *rep);
+// HTTP CONNECT request with its headers, *status is the HTTP status for a
+// broken request
+int proxy_http_request(const char *buf, size_t len, struct proxy_dest *d, int *status);
+
+// Start the proxies of the loaded profiles which are not running
+void proxy_start();
+// Stop the proxies of the profiles which are gone from new or changed
+void proxy_sync(const struct runns_profiles *old, const struct runns_profiles *new);
+void proxy_stop_all();
+// Returns 1 if pid was a proxy, it will be restarted by the next proxy_start().
+int proxy_reaped(pid_t pid);
+// Pass the running proxies to the next daemon image on restart, the first
+// proxy_start() takes over the ones whose profile is the same and stops the
+// others. Return 0 on success.
+int proxy_save(int fd);
+int proxy_load(int fd);
+
+#endif
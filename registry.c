@@ -0,0 +1,210 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "registry.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <limits.h>
+#include <poll.h>
+#include <stddef.h>
+
+static struct registry_header *reg = NULL;
+static struct registry_record *records = NULL;
+static char reg_path[PATH_MAX];
+
+#define REGISTRY_SZ (sizeof(struct registry_header) + MAX_CHILDS * sizeof(struct registry_record))
+
+int proc_start_time(pid_t pid, unsigned long long *start) {
+  char path[64], buf[1024];
+
+  snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+  int fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd == -1)
+    return -1;
+  ssize_t len = read(fd, buf, sizeof(buf) - 1);
+  close(fd);
+  if (len <= 0)
+    return -1;
+  buf[len] = '\0';
+  // comm could have spaces and parentheses, the fields start after the last ')'
+  const char *p = strrchr(buf, ')');
+  if (!p || sscanf(p + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %*u %*u"
+                          " %*d %*d %*d %*d %*d %*d %llu", start) != 1)
+    return -1;
+  return 0;
+}
+
+// The daemon could be killed between any two stores, a reader after the
+// crash sees either the old or the new record or an odd seq.
+static void record_write(struct registry_record *r, const struct registry_record *v) {
+  const size_t off = offsetof(struct registry_record, used);
+  uint32_t seq = r->seq | 1;
+
+  __atomic_store_n(&r->seq, seq, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  memcpy((char *)r + off, (const char *)v + off, sizeof(*r) - off);
+  __atomic_store_n(&r->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+// Only the daemon's user may be able to write the registry or replace it,
+// otherwise anyone could plant jobs for the daemon to signal.
+static int owned(const struct stat *st) {
+  return st->st_uid == geteuid() && !(st->st_mode & (S_IWGRP | S_IWOTH));
+}
+
+int registry_open(const char *dir) {
+  struct stat st;
+
+  if (snprintf(reg_path, sizeof(reg_path), "%s/" REGISTRY_FILE, dir) >= (int)sizeof(reg_path))
+    return -1;
+  int dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (dirfd == -1) {
+    WARN("Can't open %s, errno=%d", dir, errno);
+    return -1;
+  }
+  if (fstat(dirfd, &st) || !owned(&st)) {
+    WARN("%s is writable by other users, the job registry is disabled", dir);
+    close(dirfd);
+    return -1;
+  }
+  int fd = openat(dirfd, REGISTRY_FILE, O_RDWR | O_CREAT | O_NOFOLLOW | O_CLOEXEC, 0600);
+  close(dirfd);
+  if (fd == -1) {
+    WARN("Can't open job registry %s, errno=%d", reg_path, errno);
+    return -1;
+  }
+  if (fstat(fd, &st) || !S_ISREG(st.st_mode) || st.st_nlink != 1 || !owned(&st)) {
+    WARN("Job registry %s is not a private file, it is not used", reg_path);
+    close(fd);
+    return -1;
+  }
+  // A registry of another size is of another version or MAX_CHILDS
+  int fresh = st.st_size != (off_t)REGISTRY_SZ;
+  if (fresh && (ftruncate(fd, 0) || ftruncate(fd, REGISTRY_SZ))) {
+    WARN("Can't resize job registry %s, errno=%d", reg_path, errno);
+    close(fd);
+    return -1;
+  }
+  void *p = mmap(NULL, REGISTRY_SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (p == MAP_FAILED) {
+    WARN("Can't map job registry %s, errno=%d", reg_path, errno);
+    return -1;
+  }
+  reg = (struct registry_header *)p;
+  records = (struct registry_record *)(reg + 1);
+
+  if (reg->magic != REGISTRY_MAGIC || reg->version != REGISTRY_VERSION ||
+      reg->record_sz != sizeof(struct registry_record) || reg->nslots != MAX_CHILDS) {
+    if (!fresh)
+      WARN("Job registry %s is of another version, the jobs in it are lost", reg_path);
+    memset(p, 0, REGISTRY_SZ);
+    reg->version = REGISTRY_VERSION;
+    reg->record_sz = sizeof(struct registry_record);
+    reg->nslots = MAX_CHILDS;
+    __atomic_store_n(&reg->magic, REGISTRY_MAGIC, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+void registry_close(int unlink_file) {
+  if (!reg)
+    return;
+  munmap(reg, REGISTRY_SZ);
+  reg = NULL;
+  records = NULL;
+  if (unlink_file)
+    unlink(reg_path);
+}
+
+int registry_add(const struct runns_child *c) {
+  if (!reg)
+    return -1;
+
+  struct registry_record v = {
+    .used = 1,
+    .pid = c->pid,
+    .uid = c->uid,
+    .req_id = c->req_id,
+    .ns_dev = c->ns_dev,
+    .ns_ino = c->ns_ino
+  };
+  if (proc_start_time(c->pid, &v.start_time)) {
+    WARN("Can't get start time of %d, it is not registered", c->pid);
+    return -1;
+  }
+  for (int slot = 0; slot < MAX_CHILDS; slot++) {
+    if (!records[slot].used) {
+      record_write(&records[slot], &v);
+      return slot;
+    }
+  }
+  return -1;
+}
+
+void registry_del(int slot) {
+  const struct registry_record v = {0};
+
+  if (reg && slot >= 0 && slot < MAX_CHILDS)
+    record_write(&records[slot], &v);
+}
+
+int registry_alive(int slot, pid_t pid) {
+  unsigned long long start;
+
+  if (!reg || slot < 0 || slot >= MAX_CHILDS || !records[slot].used ||
+      records[slot].pid != pid)
+    return 0;
+  return !proc_start_time(pid, &start) && start == records[slot].start_time;
+}
+
+unsigned int registry_recover(struct runns_child *childs, unsigned int max) {
+  unsigned int n = 0, lost = 0;
+  unsigned long long start;
+
+  if (!reg)
+    return 0;
+  for (int slot = 0; slot < MAX_CHILDS; slot++) {
+    struct registry_record *r = &records[slot];
+    if (r->seq & 1) {
+      WARN("Torn record %d in job registry", slot);
+      registry_del(slot);
+      continue;
+    }
+    if (!r->used)
+      continue;
+    // The pidfd pins the process, if it hasn't exited after the start time
+    // is read the start time is its own.
+    int pidfd = sys_pidfd_open(r->pid);
+    struct pollfd pfd = {.fd = pidfd, .events = POLLIN};
+    if ((pidfd != -1 || errno == ENOSYS) && n < max &&
+        !proc_start_time(r->pid, &start) && start == r->start_time &&
+        (pidfd == -1 || !poll(&pfd, 1, 0))) {
+      childs[n++] = (struct runns_child){
+        .uid = r->uid,
+        .pid = r->pid,
+        .req_id = r->req_id,
+        .wait_fd = -1,
+        .pidfd = pidfd,
+        .ns_dev = r->ns_dev,
+        .ns_ino = r->ns_ino,
+        .slot = slot,
+        .adopted = 1
+      };
+      continue;
+    }
+    if (pidfd != -1)
+      close(pidfd);
+    registry_del(slot);
+    ++lost;
+  }
+  INFO("%u jobs recovered from %s, %u exited", n, reg_path, lost);
+  return n;
+}
@@ -0,0 +1,62 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef REGISTRY_H
+#define REGISTRY_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+struct runns_child;
+
+// Name of the registry file in the runtime directory
+#define REGISTRY_FILE "jobs"
+#define REGISTRY_MAGIC 0x4a4e5252 // "RRNJ"
+#define REGISTRY_VERSION 1
+
+struct registry_header {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t record_sz;
+  uint32_t nslots;
+};
+
+// A job in the registry. seq is odd while the record is written, such a
+// record is torn by a crash and ignored.
+struct registry_record {
+  uint32_t seq;
+  uint32_t used;
+  pid_t pid;
+  uid_t uid;
+  unsigned long long start_time; // Ticks since boot, field 22 of /proc/<pid>/stat
+  unsigned long long req_id;
+  dev_t ns_dev;
+  ino_t ns_ino;
+};
+
+// Map the registry in dir, it is created or reset if it is missing or of
+// another version. Both dir and the file must be owned by the daemon's user
+// and not writable by others. The daemon works without the registry if it
+// fails. Returns 0 on success.
+int registry_open(const char *dir);
+// Unmap the registry, the file is removed if unlink is set.
+void registry_close(int unlink_file);
+// Record the job. Returns the slot or -1.
+int registry_add(const struct runns_child *c);
+void registry_del(int slot);
+// Whether the job in slot is still pid, the start time is compared as the
+// pid could be reused.
+int registry_alive(int slot, pid_t pid);
+// Take the jobs of the previous daemon that are still running into childs.
+// A job is valid if its pidfd could be opened and its start time matches.
+// Returns the number of the jobs taken.
+unsigned int registry_recover(struct runns_child *childs, unsigned int max);
+
+// Start time of pid in ticks since boot. Returns 0 on success.
+int proc_start_time(pid_t pid, unsigned long long *start);
+
+#endif
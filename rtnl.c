@@ -0,0 +1,532 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "rtnl.h"
+
+#include <sys/time.h>
+#include <arpa/inet.h>
+#include <linux/if_link.h>
+#include <linux/veth.h>
+
+static uint32_t rtnl_seq = 0;
+
+void rtnl_batch_init(struct rtnl_batch *b) {
+  b->len = 0;
+  b->last = NULL;
+  b->n = 0;
+  b->nnoack = 0;
+  b->overflow = 0;
+}
+
+// Append sz bytes of data aligned to NLMSG_ALIGNTO to the batch
+static void *put(struct rtnl_batch *b, const void *data, size_t sz) {
+  size_t asz = NLMSG_ALIGN(sz);
+  if (b->overflow || b->len + asz > sizeof(b->buf)) {
+    b->overflow = 1;
+    return NULL;
+  }
+  char *p = b->buf + b->len;
+  memset(p, 0, asz);
+  if (data)
+    memcpy(p, data, sz);
+  b->len += asz;
+  if (b->last)
+    b->last->nlmsg_len = b->buf + b->len - (char *)b->last;
+  return p;
+}
+
+static struct nlmsghdr *msg_start(struct rtnl_batch *b, uint16_t type, uint16_t flags,
+                                  const void *hdr, size_t hdr_sz, int ack) {
+  if (ack && b->n >= RTNL_BATCH_MAX)
+    b->overflow = 1;
+  b->last = NULL;
+  struct nlmsghdr *h = (struct nlmsghdr *)put(b, NULL, NLMSG_HDRLEN);
+  if (!h)
+    return NULL;
+  if (!rtnl_seq)
+    rtnl_seq = time(NULL);
+  h->nlmsg_type = type;
+  h->nlmsg_flags = NLM_F_REQUEST | flags;
+  h->nlmsg_seq = ++rtnl_seq;
+  if (ack) {
+    // A dump is not acknowledged, it ends with NLMSG_DONE
+    if ((flags & NLM_F_DUMP) != NLM_F_DUMP)
+      h->nlmsg_flags |= NLM_F_ACK;
+    b->msgs[b->n].seq = h->nlmsg_seq;
+    b->msgs[b->n].ok_errno = 0;
+    b->msgs[b->n].ifindex = NULL;
+    b->msgs[b->n].dump = (flags & NLM_F_DUMP) == NLM_F_DUMP;
+    b->msgs[b->n].cb = NULL;
+    ++b->n;
+  }
+  else if (b->nnoack < RTNL_BATCH_NOACK) {
+    b->noack[b->nnoack++] = h->nlmsg_seq;
+  }
+  else {
+    b->overflow = 1;
+  }
+  b->last = h;
+  h->nlmsg_len = NLMSG_HDRLEN;
+  if (hdr_sz)
+    put(b, hdr, hdr_sz);
+  return b->overflow ? NULL : h;
+}
+
+struct nlmsghdr *rtnl_msg(struct rtnl_batch *b, uint16_t type, uint16_t flags,
+                          const void *hdr, size_t hdr_sz) {
+  return msg_start(b, type, flags, hdr, hdr_sz, 1);
+}
+
+struct nlmsghdr *rtnl_msg_noack(struct rtnl_batch *b, uint16_t type,
+                                const void *hdr, size_t hdr_sz) {
+  return msg_start(b, type, 0, hdr, hdr_sz, 0);
+}
+
+void rtnl_attr(struct rtnl_batch *b, uint16_t type, const void *data, size_t sz) {
+  struct rtattr *a = (struct rtattr *)put(b, NULL, RTA_LENGTH(sz));
+  if (!a)
+    return;
+  a->rta_type = type;
+  a->rta_len = RTA_LENGTH(sz);
+  if (sz)
+    memcpy(RTA_DATA(a), data, sz);
+}
+
+void rtnl_attr_str(struct rtnl_batch *b, uint16_t type, const char *s) {
+  rtnl_attr(b, type, s, strlen(s) + 1);
+}
+
+void rtnl_attr_u32(struct rtnl_batch *b, uint16_t type, uint32_t v) {
+  rtnl_attr(b, type, &v, sizeof(v));
+}
+
+struct rtattr *rtnl_nest(struct rtnl_batch *b, uint16_t type) {
+  struct rtattr *a = (struct rtattr *)put(b, NULL, RTA_LENGTH(0));
+  if (a)
+    a->rta_type = type | NLA_F_NESTED;
+  return a;
+}
+
+void rtnl_nest_end(struct rtnl_batch *b, struct rtattr *nest) {
+  if (nest && !b->overflow)
+    nest->rta_len = b->buf + b->len - (char *)nest;
+}
+
+void rtnl_allow(struct rtnl_batch *b, int err) {
+  if (b->n && !b->overflow)
+    b->msgs[b->n - 1].ok_errno = err;
+}
+
+void rtnl_ifindex(struct rtnl_batch *b, int *ifindex) {
+  if (b->n && !b->overflow)
+    b->msgs[b->n - 1].ifindex = ifindex;
+}
+
+void rtnl_replies(struct rtnl_batch *b, void (*cb)(const struct nlmsghdr *h, void *arg), void *arg) {
+  if (b->n && !b->overflow) {
+    b->msgs[b->n - 1].cb = cb;
+    b->msgs[b->n - 1].arg = arg;
+  }
+}
+
+static int batch_find(const struct rtnl_batch *b, uint32_t seq) {
+  for (unsigned int i = 0; i < b->n; i++) {
+    if (b->msgs[i].seq == seq)
+      return i;
+  }
+  return -1;
+}
+
+static int batch_noack(const struct rtnl_batch *b, uint32_t seq) {
+  for (unsigned int i = 0; i < b->nnoack; i++) {
+    if (b->noack[i] == seq)
+      return 1;
+  }
+  return 0;
+}
+
+int rtnl_batch_send(int fd, struct rtnl_batch *b) {
+  struct sockaddr_nl sa = {.nl_family = AF_NETLINK};
+  struct timeval tv = {.tv_sec = RTNL_TIMEOUT_SEC};
+  char buf[16384] __attribute__((aligned(NLMSG_ALIGNTO)));
+  unsigned int acked = 0;
+  int ret = 0;
+
+  if (b->overflow)
+    return ENOBUFS;
+  if (!b->n)
+    return 0;
+  if (sendto(fd, b->buf, b->len, 0, (struct sockaddr *)&sa, sizeof(sa)) != (ssize_t)b->len)
+    return errno ? errno : EIO;
+  // Don't hang on ACKs which never come
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  // The kernel goes on with the rest of the batch after a failed message, so
+  // there is an ACK for each of them.
+  while (acked < b->n) {
+    ssize_t len = recv(fd, buf, sizeof(buf), 0);
+    if (len == -1) {
+      if (errno == EINTR)
+        continue;
+      return errno == EAGAIN ? ETIMEDOUT : errno;
+    }
+    for (struct nlmsghdr *h = (struct nlmsghdr *)buf; NLMSG_OK(h, len); h = NLMSG_NEXT(h, len)) {
+      int i = batch_find(b, h->nlmsg_seq);
+      if (i == -1) {
+        // nfnetlink rejects the whole batch with an error on its delimiter,
+        // nothing else is sent then
+        const struct nlmsgerr *e = (const struct nlmsgerr *)NLMSG_DATA(h);
+        if (h->nlmsg_type == NLMSG_ERROR && e->error && batch_noack(b, h->nlmsg_seq))
+          return -e->error;
+        continue;
+      }
+      if (h->nlmsg_type == NLMSG_ERROR) {
+        const struct nlmsgerr *e = (const struct nlmsgerr *)NLMSG_DATA(h);
+        if (e->error && -e->error != b->msgs[i].ok_errno && !ret)
+          ret = -e->error;
+        ++acked;
+      }
+      else if (h->nlmsg_type == NLMSG_DONE) {
+        acked += b->msgs[i].dump;
+      }
+      else if (b->msgs[i].cb) {
+        b->msgs[i].cb(h, b->msgs[i].arg);
+      }
+      else if (h->nlmsg_type == RTM_NEWLINK && b->msgs[i].ifindex) {
+        *b->msgs[i].ifindex = ((const struct ifinfomsg *)NLMSG_DATA(h))->ifi_index;
+      }
+    }
+  }
+  return ret;
+}
+
+int rtnl_parse_addr(const char *s, struct rtnl_addr *a) {
+  char buf[INET6_ADDRSTRLEN + 4], *end;
+  unsigned long prefix;
+
+  if (snprintf(buf, sizeof(buf), "%s", s) >= (int)sizeof(buf))
+    return -1;
+  char *slash = strchr(buf, '/');
+  if (slash)
+    *slash++ = '\0';
+  memset(a, 0, sizeof(*a));
+  if (inet_pton(AF_INET, buf, a->addr) == 1)
+    a->family = AF_INET;
+  else if (inet_pton(AF_INET6, buf, a->addr) == 1)
+    a->family = AF_INET6;
+  else
+    return -1;
+  unsigned long max = a->family == AF_INET ? 32 : 128;
+  if (!slash) {
+    a->prefix = max;
+    return 0;
+  }
+  errno = 0;
+  prefix = strtoul(slash, &end, 10);
+  if (errno || end == slash || *end || prefix > max)
+    return -1;
+  a->prefix = prefix;
+  return 0;
+}
+
+static size_t addr_len(const struct rtnl_addr *a) {
+  return a->family == AF_INET ? 4 : 16;
+}
+
+static void link_up(struct rtnl_batch *b, const char *name) {
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC, .ifi_change = IFF_UP, .ifi_flags = IFF_UP};
+  rtnl_msg(b, RTM_SETLINK, 0, &ifi, sizeof(ifi));
+  rtnl_attr_str(b, IFLA_IFNAME, name);
+}
+
+static void link_get(struct rtnl_batch *b, const char *name, int *ifindex) {
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+  rtnl_msg(b, RTM_GETLINK, 0, &ifi, sizeof(ifi));
+  rtnl_attr_str(b, IFLA_IFNAME, name);
+  rtnl_ifindex(b, ifindex);
+}
+
+int rtnl_link_index(int fd, const char *name) {
+  struct rtnl_batch b;
+  int idx = 0;
+
+  rtnl_batch_init(&b);
+  link_get(&b, name, &idx);
+  int err = rtnl_batch_send(fd, &b);
+  if (err || !idx) {
+    errno = err ? err : ENODEV;
+    return -1;
+  }
+  return idx;
+}
+
+static void addr_add(struct rtnl_batch *b, const struct rtnl_addr *a, int ifindex) {
+  struct ifaddrmsg ifa = {
+    .ifa_family = a->family,
+    .ifa_prefixlen = a->prefix,
+    .ifa_scope = RT_SCOPE_UNIVERSE,
+    .ifa_index = ifindex
+  };
+  rtnl_msg(b, RTM_NEWADDR, NLM_F_CREATE | NLM_F_REPLACE, &ifa, sizeof(ifa));
+  rtnl_attr(b, IFA_LOCAL, a->addr, addr_len(a));
+  rtnl_attr(b, IFA_ADDRESS, a->addr, addr_len(a));
+}
+
+static void addr_del(struct rtnl_batch *b, const struct rtnl_addr *a, int ifindex) {
+  struct ifaddrmsg ifa = {
+    .ifa_family = a->family,
+    .ifa_prefixlen = a->prefix,
+    .ifa_index = ifindex
+  };
+  rtnl_msg(b, RTM_DELADDR, 0, &ifa, sizeof(ifa));
+  rtnl_allow(b, EADDRNOTAVAIL);
+  rtnl_attr(b, IFA_LOCAL, a->addr, addr_len(a));
+}
+
+// Global addresses of a link other than the configured one, e.g. left by a
+// previous configuration
+struct stale_addrs {
+  int ifindex;
+  const struct rtnl_addr *keep;
+  struct rtnl_addr v[RTNL_BATCH_MAX - 1];
+  unsigned int n;
+};
+
+static void addr_stale(const struct nlmsghdr *h, void *arg) {
+  struct stale_addrs *s = (struct stale_addrs *)arg;
+  const struct ifaddrmsg *ifa = (const struct ifaddrmsg *)NLMSG_DATA(h);
+  struct rtnl_addr a = {.family = ifa->ifa_family, .prefix = ifa->ifa_prefixlen};
+  int len = IFA_PAYLOAD(h), found = 0;
+
+  if (h->nlmsg_type != RTM_NEWADDR || (int)ifa->ifa_index != s->ifindex ||
+      ifa->ifa_scope != RT_SCOPE_UNIVERSE ||
+      (a.family != AF_INET && a.family != AF_INET6))
+    return;
+  // IFA_LOCAL is the address of the link, IFA_ADDRESS is the peer one on a
+  // point-to-point link
+  for (struct rtattr *rta = IFA_RTA(ifa); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if ((rta->rta_type == IFA_LOCAL || (rta->rta_type == IFA_ADDRESS && !found)) &&
+        RTA_PAYLOAD(rta) == addr_len(&a)) {
+      memcpy(a.addr, RTA_DATA(rta), addr_len(&a));
+      found = 1;
+    }
+  }
+  if (!found || (s->keep->family == a.family && s->keep->prefix == a.prefix &&
+                 !memcmp(s->keep->addr, a.addr, addr_len(&a))))
+    return;
+  if (s->n < sizeof(s->v) / sizeof(s->v[0]))
+    s->v[s->n++] = a;
+}
+
+// Assign the address a to the link and remove the stale ones
+static int addr_sync(int fd, const struct rtnl_addr *a, int ifindex) {
+  struct ifaddrmsg ifa = {.ifa_family = AF_UNSPEC};
+  struct stale_addrs s = {.ifindex = ifindex, .keep = a};
+  struct rtnl_batch b;
+  int err;
+
+  rtnl_batch_init(&b);
+  rtnl_msg(&b, RTM_GETADDR, NLM_F_DUMP, &ifa, sizeof(ifa));
+  rtnl_replies(&b, addr_stale, &s);
+  if ((err = rtnl_batch_send(fd, &b)))
+    return err;
+
+  rtnl_batch_init(&b);
+  for (unsigned int i = 0; i < s.n; i++)
+    addr_del(&b, &s.v[i], ifindex);
+  if (a->family)
+    addr_add(&b, a, ifindex);
+  return rtnl_batch_send(fd, &b);
+}
+
+static void route_default(struct rtnl_batch *b, const struct rtnl_addr *gw, int ifindex) {
+  struct rtmsg rtm = {
+    .rtm_family = gw->family,
+    .rtm_table = RT_TABLE_MAIN,
+    .rtm_protocol = RTPROT_STATIC,
+    .rtm_scope = RT_SCOPE_UNIVERSE,
+    .rtm_type = RTN_UNICAST
+  };
+  rtnl_msg(b, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_REPLACE, &rtm, sizeof(rtm));
+  rtnl_attr(b, RTA_GATEWAY, gw->addr, addr_len(gw));
+  rtnl_attr_u32(b, RTA_OIF, ifindex);
+}
+
+static void route_oif(const struct nlmsghdr *h, void *arg) {
+  const struct rtmsg *rtm = (const struct rtmsg *)NLMSG_DATA(h);
+  int len = RTM_PAYLOAD(h);
+
+  if (h->nlmsg_type != RTM_NEWROUTE)
+    return;
+  for (struct rtattr *rta = RTM_RTA(rtm); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+    if (rta->rta_type == RTA_OIF && RTA_PAYLOAD(rta) == sizeof(int))
+      memcpy(arg, RTA_DATA(rta), sizeof(int));
+  }
+}
+
+int rtnl_uplink(const struct rtnl_addr *src, char *dev) {
+  // Documentation addresses (RFC 5737, RFC 3849) stand for the default route
+  static const unsigned char probe4[4] = {192, 0, 2, 1};
+  static const unsigned char probe6[16] = {0x20, 0x01, 0x0d, 0xb8, [15] = 1};
+  struct rtmsg rtm = {
+    .rtm_family = src->family,
+    .rtm_dst_len = addr_len(src) * 8,
+    .rtm_src_len = addr_len(src) * 8
+  };
+  struct rtnl_batch b;
+  int oif = 0;
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1)
+    return -1;
+  rtnl_batch_init(&b);
+  rtnl_msg(&b, RTM_GETROUTE, 0, &rtm, sizeof(rtm));
+  rtnl_attr(&b, RTA_DST, src->family == AF_INET ? probe4 : probe6, addr_len(src));
+  rtnl_attr(&b, RTA_SRC, src->addr, addr_len(src));
+  // Looked up as forwarded, the source is not a local address. The loopback
+  // is always the first link.
+  rtnl_attr_u32(&b, RTA_IIF, 1);
+  rtnl_replies(&b, route_oif, &oif);
+  int err = rtnl_batch_send(fd, &b);
+  close(fd);
+  if (err || !oif || !if_indextoname(oif, dev))
+    return -1;
+  return 0;
+}
+
+// The peer is created right inside the namespace, it is never visible in
+// the host one.
+static void veth_add(struct rtnl_batch *b, const struct rtnl_veth *v, int ns_fd) {
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+
+  rtnl_msg(b, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, &ifi, sizeof(ifi));
+  rtnl_allow(b, EEXIST);
+  rtnl_attr_str(b, IFLA_IFNAME, v->host);
+  struct rtattr *info = rtnl_nest(b, IFLA_LINKINFO);
+  rtnl_attr_str(b, IFLA_INFO_KIND, "veth");
+  struct rtattr *data = rtnl_nest(b, IFLA_INFO_DATA);
+  struct rtattr *peer = rtnl_nest(b, VETH_INFO_PEER);
+  put(b, &ifi, sizeof(ifi));
+  rtnl_attr_str(b, IFLA_IFNAME, v->peer);
+  rtnl_attr_u32(b, IFLA_NET_NS_FD, ns_fd);
+  rtnl_nest_end(b, peer);
+  rtnl_nest_end(b, data);
+  rtnl_nest_end(b, info);
+}
+
+int rtnl_setup_veth(const struct runns_netns *ns, const struct rtnl_veth *v) {
+  struct rtnl_batch b;
+  struct timespec t0, t1;
+  int host_fd = -1, ns_fd = -1, host_idx = 0, peer_idx = 0, err;
+  const char *step;
+
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  host_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  ns_fd = netns_socket(ns, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (host_fd == -1 || ns_fd == -1) {
+    err = errno;
+    step = "open netlink";
+    goto fail;
+  }
+
+  // Three round trips per side: the addresses need the interface indexes and
+  // the ones already on the links.
+  rtnl_batch_init(&b);
+  veth_add(&b, v, ns->fd);
+  link_up(&b, v->host);
+  link_get(&b, v->host, &host_idx);
+  step = "create";
+  if ((err = rtnl_batch_send(host_fd, &b)))
+    goto fail;
+
+  rtnl_batch_init(&b);
+  link_up(&b, "lo");
+  link_up(&b, v->peer);
+  link_get(&b, v->peer, &peer_idx);
+  step = "bring up the peer";
+  if ((err = rtnl_batch_send(ns_fd, &b)))
+    goto fail;
+
+  step = "configure the host side";
+  if ((err = addr_sync(host_fd, &v->host_addr, host_idx)))
+    goto fail;
+
+  step = "configure the peer";
+  if ((err = addr_sync(ns_fd, &v->peer_addr, peer_idx)))
+    goto fail;
+  rtnl_batch_init(&b);
+  if (v->gateway)
+    route_default(&b, &v->host_addr, peer_idx);
+  step = "configure the peer";
+  if ((err = rtnl_batch_send(ns_fd, &b)))
+    goto fail;
+
+  close(host_fd);
+  close(ns_fd);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  INFO("veth %s:%s set up for %s in %ld us", v->host, v->peer, ns->path,
+       (t1.tv_sec - t0.tv_sec) * 1000000 + (t1.tv_nsec - t0.tv_nsec) / 1000);
+  return 0;
+
+fail:
+  WARN("Can't %s veth %s:%s for %s, errno=%d", step, v->host, v->peer, ns->path, err);
+  if (host_fd != -1)
+    close(host_fd);
+  if (ns_fd != -1)
+    close(ns_fd);
+  return -1;
+}
+
+// The same pair in the same namespace
+static int veth_eq(const struct runns_profile *a, const struct runns_profile *b) {
+  return !strcmp(a->veth.host, b->veth.host) && !strcmp(a->veth.peer, b->veth.peer) &&
+         a->netns->dev == b->netns->dev && a->netns->ino == b->netns->ino;
+}
+
+// Removing the host side removes the peer as well
+static void veth_del(const struct rtnl_veth *v) {
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+  struct rtnl_batch b;
+
+  int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if (fd == -1) {
+    WARN("Can't open netlink to remove veth %s:%s, errno=%d", v->host, v->peer, errno);
+    return;
+  }
+  rtnl_batch_init(&b);
+  rtnl_msg(&b, RTM_DELLINK, 0, &ifi, sizeof(ifi));
+  rtnl_allow(&b, ENODEV);
+  rtnl_attr_str(&b, IFLA_IFNAME, v->host);
+  int err = rtnl_batch_send(fd, &b);
+  if (err)
+    WARN("Can't remove veth %s:%s, errno=%d", v->host, v->peer, err);
+  else
+    INFO("veth %s:%s removed", v->host, v->peer);
+  close(fd);
+}
+
+void rtnl_sync(const struct runns_profiles *old) {
+  for (size_t i = 0; old && i < old->sz; i++) {
+    const struct runns_profile *o = &old->v[i];
+    size_t j = 0;
+    for (; j < i && (!*old->v[j].veth.host || strcmp(old->v[j].veth.host, o->veth.host)); j++);
+    if (!*o->veth.host || j < i)
+      continue;
+    for (j = 0; j < profiles.sz && !veth_eq(&profiles.v[j], o); j++);
+    if (j == profiles.sz)
+      veth_del(&o->veth);
+  }
+  for (size_t i = 0; i < profiles.sz; i++) {
+    const struct runns_profile *p = &profiles.v[i];
+    if (*p->veth.host)
+      rtnl_setup_veth(p->netns, &p->veth);
+  }
+}
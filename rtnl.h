@@ -0,0 +1,110 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef RTNL_H
+#define RTNL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+struct runns_netns;
+struct runns_profiles;
+
+#define RTNL_BATCH_SZ 32768
+#define RTNL_BATCH_MAX 32
+#define RTNL_BATCH_NOACK 4
+// The replies are waited for at most
+#define RTNL_TIMEOUT_SEC 5
+
+// Batch of netlink messages sent with one sendmsg(). Every message asks for
+// an ACK, the batch is done when all of them are acknowledged.
+struct rtnl_batch {
+  char buf[RTNL_BATCH_SZ];
+  size_t len;
+  struct nlmsghdr *last;
+  unsigned int n;
+  struct {
+    uint32_t seq;
+    int ok_errno;     // Error which is not a failure, e.g. EEXIST
+    int *ifindex;     // Set from the RTM_NEWLINK reply
+    int dump;         // Done with NLMSG_DONE instead of an ACK
+    void (*cb)(const struct nlmsghdr *h, void *arg);
+    void *arg;
+  } msgs[RTNL_BATCH_MAX];
+  // Messages without an ACK, an error on one of them fails the whole batch
+  uint32_t noack[RTNL_BATCH_NOACK];
+  unsigned int nnoack;
+  int overflow;
+};
+
+// Address with a prefix length, family is 0 if not set
+struct rtnl_addr {
+  int family;
+  unsigned char addr[16];
+  unsigned char prefix;
+};
+
+// veth pair of a profile, the peer lives in the profile namespace
+struct rtnl_veth {
+  char host[IFNAMSIZ]; // Empty if the profile has no veth
+  char peer[IFNAMSIZ];
+  struct rtnl_addr host_addr;
+  struct rtnl_addr peer_addr;
+  int gateway;        // Default route in the namespace via host_addr
+  unsigned long long egress_rate;  // Shaping in bytes per second, 0 if not
+  unsigned long long ingress_rate; // shaped, see tc.h
+};
+
+void rtnl_batch_init(struct rtnl_batch *b);
+// Start a message with the family header hdr, a dump request with NLM_F_DUMP
+// is done with NLMSG_DONE. Returns NULL if the batch is full.
+struct nlmsghdr *rtnl_msg(struct rtnl_batch *b, uint16_t type, uint16_t flags,
+                          const void *hdr, size_t hdr_sz);
+// Start a message which is not acknowledged, e.g. a delimiter of an
+// nfnetlink batch
+struct nlmsghdr *rtnl_msg_noack(struct rtnl_batch *b, uint16_t type,
+                                const void *hdr, size_t hdr_sz);
+// Append an attribute to the last message
+void rtnl_attr(struct rtnl_batch *b, uint16_t type, const void *data, size_t sz);
+void rtnl_attr_str(struct rtnl_batch *b, uint16_t type, const char *s);
+void rtnl_attr_u32(struct rtnl_batch *b, uint16_t type, uint32_t v);
+// Nested attributes are appended between rtnl_nest() and rtnl_nest_end()
+struct rtattr *rtnl_nest(struct rtnl_batch *b, uint16_t type);
+void rtnl_nest_end(struct rtnl_batch *b, struct rtattr *nest);
+// Accept err as success for the last message
+void rtnl_allow(struct rtnl_batch *b, int err);
+// Take the interface index from the reply to the last message
+void rtnl_ifindex(struct rtnl_batch *b, int *ifindex);
+// Pass the replies to the last message (other than ACKs) to cb
+void rtnl_replies(struct rtnl_batch *b, void (*cb)(const struct nlmsghdr *h, void *arg), void *arg);
+// Send the batch on the netlink socket fd and wait for all the ACKs.
+// Returns 0 or the errno of the first failed message.
+int rtnl_batch_send(int fd, struct rtnl_batch *b);
+
+// Index of the interface name. Returns -1 with errno set on failure.
+int rtnl_link_index(int fd, const char *name);
+
+// Parse "<address>/<prefix>", the prefix defaults to the host one.
+// Returns 0 on success.
+int rtnl_parse_addr(const char *s, struct rtnl_addr *a);
+// Create the veth pair with the peer in ns, assign the addresses, bring the
+// links up and add the default route. Existing links and addresses are
+// reused, other global addresses of the links are removed. Returns 0 on
+// success.
+int rtnl_setup_veth(const struct runns_netns *ns, const struct rtnl_veth *v);
+// Device the host routes the traffic from src to the outside through, e.g.
+// the one of a source routing rule of the namespace. dev has IF_NAMESIZE
+// bytes. Returns 0 on success.
+int rtnl_uplink(const struct rtnl_addr *src, char *dev);
+// Set up the veth pairs of the loaded profiles and remove the ones of the
+// profiles in old which are gone (old is NULL on start)
+void rtnl_sync(const struct runns_profiles *old);
+
+#endif
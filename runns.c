@@ -5,42 +5,43 @@
  * SPDX-License-Identifier: MIT
  */
 
+#include "runns.h"
+
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "dns.h"
+#include "fwd.h"
+#include "placement.h"
+#include "acct.h"
+#include "probes.h"
+#include "registry.h"
+#include "rtnl.h"
+#include "nat.h"
+#include "tc.h"
+#include "creds.h"
+#include "proxy.h"
+
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <sys/mman.h>
 #include <sys/mount.h>
-#include <pwd.h>
+#include <sys/prctl.h>
+#include <poll.h>
 #include <grp.h>
 #include <syslog.h>
 
 #include <fcntl.h>
-#include "runns.h"
 
 #include <sched.h>
 
 #include <libgen.h>
 #include <limits.h>
 
-// Emit log message
-#define ERR(format, ...) \
-    do { \
-      syslog(LOG_INFO | LOG_DAEMON, "runns.c:%d / errno=%d / " format "\n", __LINE__, errno, ##__VA_ARGS__); \
-      stop_daemon(0); \
-    } while (0)
-
-#define WARN(format, ...) \
-    do { \
-      syslog(LOG_INFO | LOG_DAEMON, "runns.c:%d / warning / " format "\n", __LINE__, ##__VA_ARGS__); \
-    } while (0)
-
-#define INFO(format, ...) \
-    { \
-      syslog(LOG_INFO | LOG_DAEMON, "runns.c:%d / info / " format "\n", __LINE__, ##__VA_ARGS__); \
-    } while (0)
-
 struct runns_header hdr = {0};
 int sockfd = 0;
 struct runns_child childs[MAX_CHILDS] = {0};
+unsigned long long req_id = 0; // ID of the current request, see probes.h
 unsigned int childs_run = 0;
 char *program = 0;
 char *netns = 0;
@@ -52,15 +53,76 @@ char runns_socket[PATH_MAX] = DEFAULT_RUNNS_SOCKET;
 char runns_socket_dir[PATH_MAX] = {0};
 enum is_default_dir {default_dir, not_default_dir} defdir = default_dir;
 struct ucred cred;
+int stdio_fds[RUNNS_STDIO_FDS] = {-1, -1, -1};
+sigset_t orig_sigmask;
+volatile sig_atomic_t got_sigchld = 0;
+volatile sig_atomic_t got_sighup = 0;
+volatile sig_atomic_t got_restart = 0;
+char *config = 0;
+char self_exe[PATH_MAX] = {0};
+int sock_owner = 1;     // The socket file is ours to remove
+
+// systemd passes activated sockets starting from this fd.
+#define SD_LISTEN_FDS_START 3
+
+// State passed to the new daemon image on restart (see restart_daemon()).
+#define RUNNS_STATE_MAGIC 0x52554e53 // RUNS
+#define RUNNS_STATE_VERSION 9
+struct runns_state {
+  unsigned int magic;
+  unsigned int version;
+  unsigned int child_sz;
+  unsigned int childs_run;
+  unsigned long long req_id;
+  int sock_owner;
+};
+
+// Longest argument or environment string accepted by execve().
+#define MAX_ARG_STRLEN (32 * 4096)
+// Most argv or environment strings accepted in a request
+#define MAX_ARG_COUNT 4096
+
+// Seconds to wait for the jobs after SIGTERM by default and after SIGKILL
+#define TERMINATE_DEADLINE 5
+#define TERMINATE_KILL_WAIT 2
+
+// Everything needed to start a job, filled either from the request or
+// from a profile.
+struct runns_launch {
+  int netns_fd;
+  const char *resolv;
+  const char *program;
+  int prog_fd;            // O_PATH fd of the program or -1
+  char **args;
+  char **envs;
+  int cgroup_fd;          // cgroup.procs to join or -1
+  const struct placement *place; // CPUs and memory policy or NULL
+  const struct runns_netns *ns;
+};
 
-int drop_priv(uid_t _uid);
 void stop_daemon(int flag);
 int clean_pids();
+void remove_child(unsigned int i);
 void free_tvars();
-int create_ptms();
+int create_ptms(int data_sockfd);
 int clean_socket();
 int parse_flag(int data_sockfd);
 int do_netns(int data_sockfd);
+int do_profile(int data_sockfd);
+int do_forward(int data_sockfd);
+int request_placement(struct placement *place);
+int do_terminate(int data_sockfd);
+void terminate_jobs(int data_sockfd, int *pidfds, pid_t *pids, unsigned int n,
+                    const int *cg_fds, unsigned int ncg);
+void spawn_job(int data_sockfd, const struct runns_launch *l);
+void refuse_job(int data_sockfd);
+void reload_config();
+int adopt_socket();
+void create_socket(struct sockaddr_un *addr);
+void restart_daemon();
+void load_state(int fd);
+void close_stdio_fds();
+void reap_childs();
 
 
 struct option opts[] =
@@ -68,15 +130,30 @@ struct option opts[] =
   { .name = "help", .has_arg = 0, .flag = 0, .val = 'h' },
   { .name = "dir", .has_arg = 1, .flag = 0, .val = 'd' },
   { .name = "socket", .has_arg = 1, .flag = 0, .val = 's' },
+  { .name = "config", .has_arg = 1, .flag = 0, .val = 'c' },
   { 0, 0, 0, 0 }
 };
 
+void sig_handler(int sig) {
+  if (sig == SIGCHLD)
+    got_sigchld = 1;
+  else if (sig == SIGHUP)
+    got_sighup = 1;
+  else if (sig == SIGUSR2)
+    got_restart = 1;
+}
+
 void help_me() {
   const char *hstr = \
 "runns [options]\n"                                                                          \
 "Options:\n"                                                                                 \
 "-h|--help             help\n"                                                               \
-"-s|--socket           override default runns socket path (" DEFAULT_RUNNS_SOCKET ")\n";
+"-s|--socket           override default runns socket path (" DEFAULT_RUNNS_SOCKET ")\n"      \
+"-c|--config           launch profiles configuration (" DEFAULT_RUNNS_CONFIG ")\n"           \
+"                      reloaded on SIGHUP\n"                                                 \
+"\n"                                                                                         \
+"The listening socket could be passed by systemd (socket activation). On SIGUSR2\n"          \
+"or runnsctl --restart the daemon re-executes itself keeping the socket and jobs.\n";
 
   puts(hstr);
   exit(EXIT_SUCCESS);
@@ -84,7 +161,7 @@ void help_me() {
 
 
 int main(int argc, char **argv) {
-  const char *optstring = "hs:";
+  const char *optstring = "hs:c:";
   int opt;
   int len;
 
@@ -94,8 +171,9 @@ int main(int argc, char **argv) {
         help_me();
         break;
       case 's':
-        // Get absolute path
-        if (!realpath(dirname(optarg), runns_socket)) {
+        // Get absolute path, dirname() modifies its argument
+        strncpy(runns_socket_dir, optarg, PATH_MAX - 1);
+        if (!realpath(dirname(runns_socket_dir), runns_socket)) {
           fputs("Can't get a real path\n", stderr);
           ERR("Can't get a real path of the socket filename");
         }
@@ -113,6 +191,12 @@ int main(int argc, char **argv) {
         }
         defdir = not_default_dir;
         break;
+      case 'c':
+        if (!(config = realpath(optarg, NULL))) {
+          fputs("Can't get a real path of the configuration\n", stderr);
+          ERR("Can't get a real path of %s", optarg);
+        }
+        break;
       default:
         ERR("Wrong option: %c", (char)opt);
     }
@@ -123,6 +207,7 @@ int main(int argc, char **argv) {
   char *last_slash = strrchr(runns_socket, '/');
   if (!last_slash)
     ERR("Can't deduce directory name in %s", runns_socket);
+  memset(runns_socket_dir, 0, sizeof(runns_socket_dir));
   memcpy(runns_socket_dir, runns_socket, last_slash - runns_socket);
 
   // Check the root
@@ -136,165 +221,237 @@ int main(int argc, char **argv) {
   if (!glob_pid)
     ERR("Can't allocate memory");
 
-  if (daemon(0, 0))
-    ERR("Can't daemonize the process");
+  // Remember the binary to re-execute on restart, the file could be
+  // replaced by then.
+  if (readlink("/proc/self/exe", self_exe, sizeof(self_exe) - 1) == -1)
+    ERR("Can't read /proc/self/exe");
 
   // Set safe umask and create directory.
   umask(0022);
-  if (defdir == default_dir) {
-    if (!access(runns_socket, F_OK)) {
-      WARN("Old socket file %s has been found", runns_socket);
-      if (unlink(runns_socket))
-        ERR("Can't remove the socket file");
-      else
-        INFO("Old socket file has been removed");
-    }
-    else {
-      if (access(runns_socket_dir, F_OK)) {
-        if (mkdir(runns_socket_dir, 0755) < 0)
-          ERR("Can't create directory %s", runns_socket_dir);
-      }
-    }
+  int adopted = adopt_socket();
+  if (adopted) {
+    // Already daemonized or run by systemd, nothing to set up.
+    INFO("Using inherited socket %d (%s)", sockfd, adopted == 2 ? "restart" : "socket activation");
+  }
+  else {
+    if (daemon(0, 0))
+      ERR("Can't daemonize the process");
+    create_socket(&addr);
   }
 
-  // Up daemon socket.
-  sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
-  if (sockfd == -1)
-    ERR("Something gone very wrong, socket = %d", sockfd);
-  if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) == -1)
-    ERR("Can't bind socket to %s", addr.sun_path);
-  // Switch permissions and group.
-  struct group *group;
-  group = getgrnam("runns");
-  if (!group)
-    ERR("Can't get runns group\n");
-  if (chown(addr.sun_path, 0, group->gr_gid) ||
-      chmod(addr.sun_path, 0775)) {
+  // A restart passes the jobs in the state, after a crash they are taken
+  // from the registry.
+  if (!registry_open(runns_socket_dir) && !childs_run)
+    childs_run = registry_recover(childs, MAX_CHILDS);
 
-    ERR("Can't chown/chmod");
+  // Load launch profiles, the default configuration is optional.
+  if (config) {
+    if (profiles_load(config, &profiles))
+      ERR("Can't load configuration %s", config);
+  }
+  else if (!access(DEFAULT_RUNNS_CONFIG, F_OK)) {
+    config = strdup(DEFAULT_RUNNS_CONFIG);
+    if (!config || profiles_load(config, &profiles))
+      ERR("Can't load configuration " DEFAULT_RUNNS_CONFIG);
   }
+  INFO("%zu launch profiles loaded", profiles.sz);
+  rtnl_sync(NULL);
+  tc_sync(NULL);
+  nat_init(&profiles);
+  dns_sync(runns_socket_dir);
+  proxy_start();
+
+  // Adopt orphaned jobs to be able to wait for them. SIGCHLD is blocked
+  // and delivered only inside ppoll() to avoid a race with accept().
+  if (prctl(PR_SET_CHILD_SUBREAPER, 1))
+    ERR("Can't become a child subreaper");
+  struct sigaction sa = {.sa_handler = sig_handler, .sa_flags = SA_NOCLDSTOP};
+  sigemptyset(&sa.sa_mask);
+  if (sigaction(SIGCHLD, &sa, NULL) || sigaction(SIGHUP, &sa, NULL) ||
+      sigaction(SIGUSR2, &sa, NULL))
+    ERR("Can't set signal handlers");
+  sigset_t block_mask;
+  sigemptyset(&block_mask);
+  sigaddset(&block_mask, SIGCHLD);
+  sigaddset(&block_mask, SIGHUP);
+  sigaddset(&block_mask, SIGUSR2);
+  if (sigprocmask(SIG_BLOCK, &block_mask, &orig_sigmask))
+    ERR("Can't block signals");
+  // The mask is inherited through restart, don't keep the signals blocked.
+  sigdelset(&orig_sigmask, SIGCHLD);
+  sigdelset(&orig_sigmask, SIGHUP);
+  sigdelset(&orig_sigmask, SIGUSR2);
+
+  if (listen(sockfd, 16) == -1)
+    ERR("Can't start listen socket %d (%s)", sockfd, addr.sun_path);
 
   INFO("runns daemon has started");
 
   while (1) {
-    if (listen(sockfd, 16) == -1)
-      ERR("Can't start listen socket %d (%s)", sockfd, addr.sun_path);
+    if (got_sigchld)
+      reap_childs();
+    if (got_sighup)
+      reload_config();
+    if (got_restart)
+      restart_daemon();
+
+    struct timespec timeout;
+    if (acct_timer(&timeout)) {
+      // Jobs taken from the registry are not our children, nobody reports
+      // their exit.
+      clean_pids();
+      acct_sample(childs, childs_run);
+    }
+
+    struct pollfd pfd = {.fd = sockfd, .events = POLLIN};
+    int ready = ppoll(&pfd, 1, &timeout, &orig_sigmask);
+    if (ready == -1) {
+      if (errno == EINTR)
+        continue;
+      ERR("Can't poll socket %d (%s)", sockfd, addr.sun_path);
+    }
+    if (!ready)
+      continue;
 
-    int data_sockfd = accept(sockfd, 0, 0);
-    if (data_sockfd == -1)
+    int data_sockfd = accept4(sockfd, 0, 0, SOCK_CLOEXEC);
+    if (data_sockfd == -1) {
+      if (errno == EINTR || errno == ECONNABORTED)
+        continue;
       ERR("Can't accept connection");
+    }
     const socklen_t cred_len = (socklen_t)sizeof(struct ucred);
     if (getsockopt(data_sockfd, SOL_SOCKET, SO_PEERCRED, &cred, &cred_len) == -1) {
       WARN("Can't get user credentials");
       close(data_sockfd);
       continue;
     }
+    ++req_id;
+    PROBE(accept, req_id, cred.uid, cred.pid);
 
-    int ret = read(data_sockfd, (void *)&hdr, sizeof(hdr));
+    // Header could carry client's stdio fds.
+    int nfds = RUNNS_STDIO_FDS;
+    int ret = recv_fds(data_sockfd, (void *)&hdr, sizeof(hdr), stdio_fds, &nfds);
     if (ret == -1)
       WARN("Can't read data");
+    if (!(hdr.flag & RUNNS_STDIO) || nfds != RUNNS_STDIO_FDS) {
+      if (hdr.flag & RUNNS_STDIO)
+        WARN("Expected %d stdio fds, got %d", RUNNS_STDIO_FDS, nfds);
+      for (int i = 0; i < nfds; close(stdio_fds[i++]));
+      hdr.flag &= ~(RUNNS_STDIO);
+      nfds = 0;
+    }
+    for (int i = nfds; i < RUNNS_STDIO_FDS; stdio_fds[i++] = -1);
 
-    if (parse_flag(data_sockfd))
+    PROBE(header, req_id, hdr.flag, hdr.op_mode);
+    if (parse_flag(data_sockfd)) {
+      close_stdio_fds();
       continue;
+    }
 
     // Read the operational mode
     INFO("op mode = %d", hdr.op_mode);
     switch (hdr.op_mode) {
       case OP_MODE_FWD_PORT:
-        // TODO: Handle OP_MODE_FWD_PORT
-        INFO("Nothing can be done for OP_MODE_FWD_PORT yet. Skip");
+        do_forward(data_sockfd);
         break;
       case OP_MODE_NETNS:
         do_netns(data_sockfd);
         break;
+      case OP_MODE_PROFILE:
+        do_profile(data_sockfd);
+        break;
+      case OP_MODE_TERMINATE:
+        do_terminate(data_sockfd);
+        break;
       default:
         WARN("Skipping. Unknown op mode");
+        close(data_sockfd);
     }
-
+    close_stdio_fds();
   }
 
   return 0;
 }
 
-int drop_priv(uid_t _uid) {
-  struct passwd *pw = getpwuid(_uid);
-  if (pw) {
-    uid_t uid = pw->pw_uid;
-    gid_t gid = pw->pw_gid;
-
-    if (initgroups(pw->pw_name, gid) != 0)
-      ERR("Couldn't initialize the supplementary group list");
-    endpwent();
-
-    if (setgid(gid) != 0 || setuid(uid) != 0) {
-      ERR("Couldn't change to '%.32s' uid=%lu gid=%lu",
-          pw->pw_name,
-          (unsigned long)uid,
-          (unsigned long)gid);
-    }
-
-    if (chdir(pw->pw_dir)) {
-      ERR("Couldn't chdir to %s for '%.32s' uid=%lu gid=%lu",
-          pw->pw_dir,
-          pw->pw_name,
-          (unsigned long)uid,
-          (unsigned long)gid);
-    }
-  }
-  else
-    ERR("Couldn't find a user with UID=%d", _uid);
-}
-
-
 void stop_daemon(int flag) {
   INFO("runns daemon going down");
   if (sockfd) {
     close(sockfd);
-    unlink(runns_socket);
-    if (defdir == default_dir)
-      rmdir(runns_socket_dir);
+    if (sock_owner) {
+      unlink(runns_socket);
+      if (defdir == default_dir)
+        rmdir(runns_socket_dir);
+    }
   }
   free_tvars();
+  dns_shutdown();
+  proxy_stop_all();
+  fwd_free(&fwd_rules);
+  profiles_free(&profiles);
   munmap(glob_pid, sizeof(glob_pid));
+  if (flag & RUNNS_STOP)
+    clean_pids();
+  registry_close((flag & RUNNS_STOP) && !childs_run);
+  // The namespaces of the jobs left keep their egress
+  if ((flag & RUNNS_STOP) && !childs_run)
+    nat_shutdown();
 
   int ret = flag ? flag & RUNNS_STOP : EXIT_FAILURE;
   exit(ret);
 }
 
+void remove_child(unsigned int i) {
+  registry_del(childs[i].slot);
+  if (childs[i].pidfd != -1)
+    close(childs[i].pidfd);
+  if (i != childs_run - 1)
+    memcpy(childs + i, childs + childs_run - 1, sizeof(struct runns_child));
+  --childs_run;
+}
+
 int clean_pids() {
   for (unsigned int i = childs_run; i > 0 ; i--)
   {
-    if (kill(childs[i - 1].pid, 0))
-    {
-      if (i != childs_run)
-      {
-        memcpy(childs + i - 1, childs + childs_run - 1, sizeof(struct runns_child));
-      }
-      --childs_run;
-    }
+    // A child is a zombie until reap_childs() sends its status, the jobs of
+    // a crashed daemon are reaped by someone else and their pids could be
+    // reused.
+    const struct runns_child *c = &childs[i - 1];
+    struct pollfd pfd = {.fd = c->pidfd, .events = POLLIN};
+    int gone;
+    if (!c->adopted)
+      gone = kill(c->pid, 0) != 0;
+    else if (c->pidfd != -1)
+      gone = poll(&pfd, 1, 0) != 0;
+    else
+      gone = !registry_alive(c->slot, c->pid);
+    if (gone)
+      remove_child(i - 1);
   }
 }
 
 
 void free_tvars() {
-  free(program);
-  free(netns);
-  if (resolv) {
-    free(resolv);
-    resolv = 0;
-  }
   if (args)
-    for (size_t i = 1; i < hdr.args_sz - 3; free(args[i++]));
+    for (size_t i = 1; args[i]; free(args[i++]));
   if (envs)
-    for (size_t i = 0; i < hdr.env_sz - 2; free(envs[i++]));
+    for (size_t i = 0; envs[i]; free(envs[i++]));
+  free(program);
+  free(netns);
+  free(resolv);
   free(envs);
   free(args);
-  memset((void *)&hdr, 1, sizeof(hdr));
+  program = netns = resolv = 0;
+  args = envs = 0;
+  memset((void *)&hdr, 0, sizeof(hdr));
 }
 
 
-int create_ptms() {
-  int ptmfd = open("/dev/ptmx", O_RDWR);
+int create_ptms(int data_sockfd) {
+  int ptmfd = open("/dev/ptmx", O_RDWR | O_CLOEXEC);
+  if (ptmfd == -1) {
+    WARN("Fail to open /dev/ptmx, errno=%d", errno);
+    return errno;
+  }
   char ptsname[0xff];
   if (ptsname_r(ptmfd, ptsname, 0xff)) {
     WARN("Fail to get ptsname, errno=%d", errno);
@@ -309,7 +466,14 @@ int create_ptms() {
     return errno;
   }
   int ptsfd = open(ptsname, O_RDWR);
-  tcsetattr(ptsfd, TCSANOW, &hdr.tmode);
+  if (ptsfd == -1) {
+    WARN("Fail to open %s, errno=%d", ptsname, errno);
+    return errno;
+  }
+  // Keep the default line discipline if the client is not on a terminal,
+  // a valid termios always has a character size set in c_cflag.
+  if (hdr.tmode.c_cflag & CSIZE)
+    tcsetattr(ptsfd, TCSANOW, &hdr.tmode);
   if (dup2(ptsfd, STDIN_FILENO) == -1) {
     WARN("Fail to dup2 pt for stdin, errno=%d", errno);
     return errno;
@@ -322,6 +486,16 @@ int create_ptms() {
     WARN("Fail to dup2 pt for stderr, errno=%d", errno);
     return errno;
   }
+  if (ptsfd > STDERR_FILENO)
+    close(ptsfd);
+
+  // Hand the master side to the client which relays the terminal.
+  char ack = 0;
+  if (send_fds(data_sockfd, &ack, sizeof(ack), &ptmfd, 1) == -1) {
+    WARN("Fail to send pt master to the client, errno=%d", errno);
+    return errno;
+  }
+  close(ptmfd);
 
   return 0;
 }
@@ -337,28 +511,158 @@ int parse_flag(int data_sockfd) {
     }
     else {
       WARN("Client with %d UID tried to kill the daemon ", cred.uid);
+      close(data_sockfd);
       return 1;
     }
   }
 
-  // Transfer list of childs
+  // Re-execute the daemon keeping the socket and the jobs.
+  if (hdr.flag & RUNNS_RESTART) {
+    close(data_sockfd);
+    if (cred.uid == 0) {
+      INFO("restart requested");
+      got_restart = 1;
+    }
+    else
+      WARN("Client with %d UID tried to restart the daemon ", cred.uid);
+    return 1;
+  }
+
+  // Transfer DNS stub statistics
+  if (hdr.flag & RUNNS_DNS_STATS) {
+    INFO("uid=%d ask for DNS statistics", cred.uid);
+    unsigned int n = 0;
+    for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext)
+      n += ns->dns != NULL;
+    if (write(data_sockfd, (void *)&n, sizeof(n)) == -1)
+      WARN("Can't send number of DNS stubs to the client %d", cred.uid);
+    for (struct runns_netns *ns = netns_head; ns; ns = ns->pnext) {
+      if (!ns->dns)
+        continue;
+      struct runns_dns_record rec = {.stats = *ns->dns->stats};
+      strncpy(rec.netns, ns->path, sizeof(rec.netns) - 1);
+      if (write(data_sockfd, (void *)&rec, sizeof(rec)) == -1) {
+        WARN("Can't send DNS statistics to the client %d", cred.uid);
+        break;
+      }
+    }
+    close(data_sockfd);
+    return 1;
+  }
+
+  // Transfer forwarding rules, there could be a lot of them so the whole
+  // list is sent at once.
+  if (hdr.flag & RUNNS_FWD_LIST) {
+    INFO("uid=%d ask for forwarding rules", cred.uid);
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    unsigned int n = fwd_rules.sz;
+    if (f)
+      fwrite((void *)&n, sizeof(n), 1, f);
+    for (size_t i = 0; f && i < fwd_rules.nbuckets; i++) {
+      for (struct fwd_rule *e = fwd_rules.buckets[i]; e; e = e->hnext) {
+        struct runns_fwd_rule r = {
+          .family = e->family,
+          .proto = e->proto,
+          .port = e->port,
+          .netns_sz = strlen(e->netns->path) + 1
+        };
+        memcpy(r.ip, e->ip, sizeof(r.ip));
+        fwrite((void *)&r, sizeof(r), 1, f);
+        fwrite(e->netns->path, r.netns_sz, 1, f);
+      }
+    }
+    if (!f || fclose(f) || send_fds(data_sockfd, buf, buf_sz, NULL, 0) != (ssize_t)buf_sz)
+      WARN("Can't send forwarding rules to the client %d", cred.uid);
+    free(buf);
+    close(data_sockfd);
+    return 1;
+  }
+
+  // Transfer list of childs with the last sample of their resources, root
+  // sees the jobs of all users.
   if (hdr.flag & RUNNS_LIST) {
-    // TODO rets
     INFO("uid=%d ask for pid list", cred.uid);
     clean_pids();
-    // Count the number of jobs for uid
     unsigned int jobs = 0;
-    for (int i = 0; i < childs_run; i++) {
-      if (childs[i].uid == cred.uid)
-        ++jobs;
+    size_t buf_sz = sizeof(jobs) + childs_run * sizeof(struct runns_job_record);
+    char *buf = (char *)malloc(buf_sz);
+    if (!buf)
+      ERR("Can't allocate memory for the list of jobs");
+    struct runns_job_record *rec = (struct runns_job_record *)(buf + sizeof(jobs));
+    for (unsigned int i = 0; i < childs_run; i++) {
+      if (cred.uid != 0 && childs[i].uid != cred.uid)
+        continue;
+      rec[jobs] = (struct runns_job_record){
+        .uid = childs[i].uid,
+        .pid = childs[i].pid,
+        .stats = childs[i].stats
+      };
+      acct_netns_name(childs[i].ns_dev, childs[i].ns_ino, rec[jobs].netns, sizeof(rec[jobs].netns));
+      ++jobs;
     }
+    memcpy(buf, (void *)&jobs, sizeof(jobs));
+    buf_sz = sizeof(jobs) + jobs * sizeof(struct runns_job_record);
+    if (send_fds(data_sockfd, buf, buf_sz, NULL, 0) != (ssize_t)buf_sz)
+      WARN("Can't send the list of jobs to the client %d", cred.uid);
+    free(buf);
+    close(data_sockfd);
+    return 1;
+  }
 
-    if (write(data_sockfd, (void *)&jobs, sizeof(jobs)) == -1)
-      ERR("Can't send number of jobs to the client %d", cred.uid);
-    for (unsigned int i = 0; i < jobs; i++) {
-      if (write(data_sockfd, (void *)&childs[i], sizeof(struct runns_child)) == -1)
-        ERR("Can't send child info to the client %d", cred.uid);
+  // Transfer interface counters of the namespaces, a record per interface
+  if (hdr.flag & RUNNS_NETNS_STATS) {
+    INFO("uid=%d ask for netns statistics", cred.uid);
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    unsigned int n = 0;
+    for (struct acct_netns *a = acct_netns_head; a; a = a->next)
+      n += a->ifs_sz;
+    if (f)
+      fwrite((void *)&n, sizeof(n), 1, f);
+    for (struct acct_netns *a = acct_netns_head; f && a; a = a->next) {
+      struct runns_if_record rec = {.sampled_usec = a->sampled_usec};
+      acct_netns_name(a->dev, a->ino, rec.netns, sizeof(rec.netns));
+      for (size_t i = 0; i < a->ifs_sz; i++) {
+        rec.stats = a->ifs[i];
+        fwrite((void *)&rec, sizeof(rec), 1, f);
+      }
     }
+    if (!f || fclose(f) || send_fds(data_sockfd, buf, buf_sz, NULL, 0) != (ssize_t)buf_sz)
+      WARN("Can't send netns statistics to the client %d", cred.uid);
+    free(buf);
+    close(data_sockfd);
+    return 1;
+  }
+
+  // Transfer queue statistics of the shaped veths, they are read from the
+  // kernel on request. Profiles sharing a veth are reported once.
+  if (hdr.flag & RUNNS_QOS_STATS) {
+    INFO("uid=%d ask for QoS statistics", cred.uid);
+    char *buf = NULL;
+    size_t buf_sz = 0;
+    FILE *f = open_memstream(&buf, &buf_sz);
+    unsigned int n = 0;
+    if (f)
+      fwrite((void *)&n, sizeof(n), 1, f);
+    for (size_t i = 0; f && i < profiles.sz; i++) {
+      const struct rtnl_veth *v = &profiles.v[i].veth;
+      size_t j = 0;
+      for (; j < i && strcmp(profiles.v[j].veth.host, v->host); j++);
+      if (*v->host && j == i)
+        n += tc_stats(profiles.v[i].netns, v, f);
+    }
+    if (!f || fclose(f) || buf_sz < sizeof(n)) {
+      WARN("Can't collect QoS statistics for the client %d", cred.uid);
+    }
+    else {
+      memcpy(buf, (void *)&n, sizeof(n));
+      if (send_fds(data_sockfd, buf, buf_sz, NULL, 0) != (ssize_t)buf_sz)
+        WARN("Can't send QoS statistics to the client %d", cred.uid);
+    }
+    free(buf);
     close(data_sockfd);
     return 1;
   }
@@ -367,63 +671,510 @@ int parse_flag(int data_sockfd) {
 }
 
 
-int do_netns(int data_sockfd) {
-  int ret;
+// Read exactly sz bytes from the client.
+int recv_all(int fd, void *buf, size_t sz) {
+  if (!sz)
+    return 0;
+  ssize_t ret = recv(fd, buf, sz, MSG_WAITALL);
+  return ret == (ssize_t)sz ? 0 : -1;
+}
+
+
+// Read a length prefixed string from the client.
+char *recv_str(int fd) {
+  size_t sz;
+  if (recv_all(fd, (void *)&sz, sizeof(size_t)) || !sz || sz > MAX_ARG_STRLEN)
+    return NULL;
+  char *str = (char *)malloc(sz);
+  if (!str)
+    return NULL;
+  if (recv_all(fd, (void *)str, sz)) {
+    free(str);
+    return NULL;
+  }
+  str[sz - 1] = '\0';
+  return str;
+}
+
 
+// Read argv for the program, args[0] is the program itself.
+int recv_args(int data_sockfd) {
+  if (hdr.args_sz > MAX_ARG_COUNT) {
+    WARN("Too many arguments (%zu) from uid=%d", hdr.args_sz, cred.uid);
+    return -1;
+  }
+  args = (char **)calloc(hdr.args_sz + 2, sizeof(char *)); // program name + null at the end
+  if (!args) {
+    WARN("Can't allocate memory for %zu arguments", hdr.args_sz);
+    return -1;
+  }
+  args[0] = program;
+  for (size_t i = 1; i <= hdr.args_sz; i++) {
+    if (!(args[i] = recv_str(data_sockfd))) {
+      WARN("Can't read argv[%zu] from uid=%d", i, cred.uid);
+      return -1;
+    }
+  }
+  return 0;
+}
+
+
+// Apply the placement of the request on top of place
+int request_placement(struct placement *place) {
+  hdr.place.cpus[RUNNS_PLACEMENT_MAXLEN - 1] = '\0';
+  hdr.place.mempolicy[RUNNS_PLACEMENT_MAXLEN - 1] = '\0';
+  if ((*hdr.place.cpus && placement_set_cpus(place, hdr.place.cpus)) ||
+      (*hdr.place.mempolicy && placement_set_mempolicy(place, hdr.place.mempolicy)) ||
+      placement_finish(place)) {
+    WARN("uid=%d asked for bad placement cpus=%s mempolicy=%s",
+         cred.uid, hdr.place.cpus, hdr.place.mempolicy);
+    return -1;
+  }
+  return 0;
+}
+
+
+int do_netns(int data_sockfd) {
+  if (hdr.prog_sz >= PATH_MAX || hdr.netns_sz >= PATH_MAX || hdr.resolv_sz >= PATH_MAX ||
+      hdr.env_sz > MAX_ARG_COUNT) {
+    WARN("Bad request sizes from uid=%d", cred.uid);
+    goto out;
+  }
   // Read program name and network namespace name
-  program = (char *)malloc(hdr.prog_sz);
-  netns = (char *)malloc(hdr.netns_sz);
-  if (!program || !netns)
-    ERR("Can't allocate memory (program=%p, netns=%p", program, netns);
+  program = (char *)calloc(1, hdr.prog_sz + 1);
+  netns = (char *)calloc(1, hdr.netns_sz + 1);
+  if (!program || !netns) {
+    WARN("Can't allocate memory (program=%p, netns=%p)", program, netns);
+    goto out;
+  }
   if (hdr.resolv_sz) {
-    resolv = (char *)malloc(hdr.resolv_sz);
+    resolv = (char *)calloc(1, hdr.resolv_sz + 1);
     if (!resolv) {
-      ERR("Can't allocate memory for resolv.conf path");
+      WARN("Can't allocate memory for resolv.conf path");
+      goto out;
     }
   }
-  ret = read(data_sockfd, (void *)program, hdr.prog_sz);
-  ret = read(data_sockfd, (void *)netns, hdr.netns_sz);
-  if (hdr.resolv_sz) {
-    ret = read(data_sockfd, (void *)resolv, hdr.resolv_sz);
+  if (recv_all(data_sockfd, (void *)program, hdr.prog_sz) ||
+      recv_all(data_sockfd, (void *)netns, hdr.netns_sz) ||
+      (hdr.resolv_sz && recv_all(data_sockfd, (void *)resolv, hdr.resolv_sz))) {
+    WARN("Can't read the request from uid=%d", cred.uid);
+    goto out;
   }
   INFO("uid=%d program=%s netns=%s resolv=%s", cred.uid, program, netns, hdr.resolv_sz ? resolv : "inherited");
 
-  // Read argv for the program
-  if (hdr.args_sz) {
-    hdr.args_sz += 2; // program name + null at the end
-    args = (char **)malloc(hdr.args_sz*sizeof(char *));
-    if (!args)
-      ERR("Can't allocate memory (args = %p)", args);
-    args[0] = program;
-    args[hdr.args_sz - 1] = 0;
-    for (int i = 1; i < hdr.args_sz - 1; i++) {
-      size_t sz;
-      ret = read(data_sockfd, (void *)&sz, sizeof(size_t));
-      args[i] = (char *)malloc(sz);
-      ret = read(data_sockfd, (void *)args[i], sz);
+  if (recv_args(data_sockfd))
+    goto out;
+
+  // Read environment variables
+  envs = (char **)calloc(hdr.env_sz + 1, sizeof(char *));
+  if (!envs) {
+    WARN("Can't allocate memory for environment");
+    goto out;
+  }
+  for (size_t i = 0; i < hdr.env_sz; i++) {
+    if (!(envs[i] = recv_str(data_sockfd))) {
+      WARN("Can't read environment from uid=%d", cred.uid);
+      goto out;
     }
   }
-  else
-    args = 0;
 
-  // Read environment variables
-  if (hdr.env_sz) {
-    envs = (char **)malloc(++hdr.env_sz*sizeof(char *));
-    for (int i = 0; i < hdr.env_sz - 1; i++) {
-      size_t env_sz;
-      ret = read(data_sockfd, (void *)&env_sz, sizeof(size_t));
-      envs[i] = (char *)malloc(env_sz);
-      ret = read(data_sockfd, (void *)envs[i], env_sz);
+  PROBE(request, req_id, program, netns);
+
+  struct placement place = {0};
+  if (request_placement(&place))
+    goto out;
+  struct runns_netns *ns = netns_get(netns);
+  if (!ns)
+    goto out;
+  struct runns_launch l = {
+    .netns_fd = ns->fd,
+    .resolv = resolv ? resolv : dns_resolv(ns),
+    .program = program,
+    .prog_fd = -1,
+    .args = args,
+    .envs = envs,
+    .cgroup_fd = -1,
+    .place = &place,
+    .ns = ns
+  };
+  spawn_job(data_sockfd, &l);
+  netns_put(ns);
+  free_tvars();
+  return 0;
+
+out:
+  refuse_job(data_sockfd);
+  free_tvars();
+  return -1;
+}
+
+
+int do_profile(int data_sockfd) {
+  char name[RUNNS_PROFILE_MAXLEN] = {0};
+  gid_t groups[NGROUPS_MAX];
+  socklen_t groups_len = sizeof(groups);
+
+  if (!hdr.profile_sz || hdr.profile_sz > sizeof(name) ||
+      recv_all(data_sockfd, (void *)name, hdr.profile_sz)) {
+    WARN("Can't read profile name from uid=%d", cred.uid);
+    goto out;
+  }
+  name[sizeof(name) - 1] = '\0';
+  if (hdr.prog_sz >= PATH_MAX) {
+    WARN("Too long program from uid=%d", cred.uid);
+    goto out;
+  }
+  program = (char *)calloc(1, hdr.prog_sz + 1);
+  if (!program) {
+    WARN("Can't allocate memory for program");
+    goto out;
+  }
+  if (recv_all(data_sockfd, (void *)program, hdr.prog_sz) || recv_args(data_sockfd)) {
+    WARN("Can't read the request from uid=%d", cred.uid);
+    goto out;
+  }
+
+  struct runns_profile *p = profile_find(name);
+  if (!p) {
+    WARN("uid=%d asked for unknown profile %s", cred.uid, name);
+    goto out;
+  }
+  if (getsockopt(data_sockfd, SOL_SOCKET, SO_PEERGROUPS, groups, &groups_len) == -1)
+    groups_len = 0;
+  if (!profile_allowed(p, cred.uid, groups, groups_len / sizeof(gid_t)) &&
+      !profile_allowed(p, cred.uid, &cred.gid, 1)) {
+    WARN("uid=%d is not allowed to use profile %s", cred.uid, name);
+    goto out;
+  }
+  const struct runns_program *prog = profile_program(p, program);
+  if (!prog) {
+    WARN("uid=%d asked for %s which is not allowed in profile %s", cred.uid, program, name);
+    goto out;
+  }
+  INFO("uid=%d profile=%s program=%s", cred.uid, name, prog->path);
+  PROBE(request, req_id, prog->path, p->netns->path);
+  struct placement place = p->place;
+  if (request_placement(&place))
+    goto out;
+
+  args[0] = prog->path;
+  struct runns_launch l = {
+    .netns_fd = p->netns->fd,
+    .resolv = dns_resolv(p->netns) ? dns_resolv(p->netns) : p->resolv,
+    .program = prog->path,
+    .prog_fd = prog->fd,
+    .args = args,
+    .envs = p->envs,
+    .cgroup_fd = p->cgroup_fd,
+    .place = &place,
+    .ns = p->netns
+  };
+  spawn_job(data_sockfd, &l);
+  args[0] = program;
+  free_tvars();
+  return 0;
+
+out:
+  refuse_job(data_sockfd);
+  free_tvars();
+  return -1;
+}
+
+
+// Apply a batch of forwarding rules. The table is updated in place, so the
+// other rules and the sockets handed out already are not touched.
+int do_forward(int data_sockfd) {
+  struct runns_fwd_reply reply = {0};
+  struct runns_fwd_rule r;
+  char path[PATH_MAX];
+
+  for (size_t i = 0; i < hdr.fwd_sz; i++) {
+    if (recv_all(data_sockfd, (void *)&r, sizeof(r)) || r.netns_sz > sizeof(path) ||
+        recv_all(data_sockfd, (void *)path, r.netns_sz)) {
+      WARN("Can't read forwarding rules from uid=%d", cred.uid);
+      close(data_sockfd);
+      return -1;
+    }
+    path[r.netns_sz ? r.netns_sz - 1 : 0] = '\0';
+
+    switch (r.action) {
+      case RUNNS_FWD_ADD:
+        if (*path && !fwd_add(&fwd_rules, &r, path, cred.uid))
+          ++reply.added;
+        else
+          ++reply.failed;
+        break;
+      case RUNNS_FWD_DEL:
+        if (!fwd_del(&fwd_rules, &r, cred.uid))
+          ++reply.removed;
+        else
+          ++reply.failed;
+        break;
+      case RUNNS_FWD_LOOKUP: {
+        // The status is followed by the socket created in the rule's netns
+        struct fwd_rule *e = fwd_lookup(&fwd_rules, &r);
+        int fd = e ? fwd_socket(e) : -1;
+        int err = fd == -1 ? (e ? errno : ENOENT) : 0;
+        if (send_fds(data_sockfd, (void *)&err, sizeof(err), &fd, fd == -1 ? 0 : 1) == -1)
+          WARN("Can't send forwarding socket to uid=%d", cred.uid);
+        if (fd != -1)
+          close(fd);
+        reply.failed += err != 0;
+        break;
+      }
+      default:
+        ++reply.failed;
     }
-    envs[hdr.env_sz - 1] = 0;
   }
-  else
-    envs = 0;
 
+  reply.total = fwd_rules.sz;
+  INFO("uid=%d forwarding rules: %u added, %u removed, %u failed, %u total",
+       cred.uid, reply.added, reply.removed, reply.failed, reply.total);
+  if (send(data_sockfd, (void *)&reply, sizeof(reply), MSG_NOSIGNAL) == -1)
+    WARN("Can't send forwarding reply to uid=%d", cred.uid);
   close(data_sockfd);
+  return 0;
+}
+
+
+// Terminate the jobs of a uid and/or a netns in a single request. Waiting
+// for the deadline is done by a forked worker, so the daemon keeps serving.
+int do_terminate(int data_sockfd) {
+  struct stat st = {0};
+  int pidfds[MAX_CHILDS], cg_fds[MAX_CHILDS];
+  pid_t pids[MAX_CHILDS];
+  unsigned int n = 0, ncg = 0;
+
+  if (hdr.netns_sz) {
+    if (hdr.netns_sz >= PATH_MAX || !(netns = (char *)calloc(1, hdr.netns_sz + 1))) {
+      WARN("Can't read netns of %zu bytes from uid=%d", hdr.netns_sz, cred.uid);
+      goto out;
+    }
+    if (recv_all(data_sockfd, (void *)netns, hdr.netns_sz) || stat(netns, &st)) {
+      WARN("Can't read netns to terminate from uid=%d", cred.uid);
+      goto out;
+    }
+  }
+  if (cred.uid != 0 && hdr.term.by_uid && hdr.term.uid != cred.uid) {
+    WARN("uid=%d tried to terminate jobs of uid=%d", cred.uid, hdr.term.uid);
+    goto out;
+  }
+  if (!hdr.term.deadline)
+    hdr.term.deadline = TERMINATE_DEADLINE;
+  else if (hdr.term.deadline > RUNNS_TERMINATE_MAX_DEADLINE)
+    hdr.term.deadline = RUNNS_TERMINATE_MAX_DEADLINE;
+  // Root drains everything only when asked explicitly
+  uid_t uid = hdr.term.by_uid ? hdr.term.uid : cred.uid;
+  int by_uid = hdr.term.by_uid || cred.uid != 0 || !hdr.netns_sz;
 
+  clean_pids();
+  for (unsigned int i = 0; i < childs_run; i++) {
+    if ((by_uid && childs[i].uid != uid) ||
+        (hdr.netns_sz && (childs[i].ns_dev != st.st_dev || childs[i].ns_ino != st.st_ino)))
+      continue;
+    pidfds[n] = childs[i].pidfd;
+    pids[n++] = childs[i].pid;
+  }
+  // The cgroup2 cgroups of the profiles of a drained namespace are drained as
+  // well, it catches the processes forked by the jobs. A cgroup shared with a
+  // profile of another namespace is left alone.
+  if (cred.uid == 0 && !hdr.term.by_uid && hdr.netns_sz) {
+    for (size_t i = 0; i < profiles.sz; i++) {
+      const struct runns_profile *p = &profiles.v[i];
+      if (p->cgroup_dir_fd == -1 || !p->cgroup_id ||
+          p->netns->dev != st.st_dev || p->netns->ino != st.st_ino)
+        continue;
+      size_t j = 0;
+      for (; j < profiles.sz; j++) {
+        const struct runns_profile *q = &profiles.v[j];
+        if (q->cgroup_id == p->cgroup_id &&
+            (j < i || q->netns->dev != st.st_dev || q->netns->ino != st.st_ino))
+          break;
+      }
+      if (j == profiles.sz)
+        cg_fds[ncg++] = p->cgroup_dir_fd;
+    }
+  }
+  INFO("uid=%d terminates %u jobs (uid=%d netns=%s) in %us", cred.uid, n,
+       by_uid ? (int)uid : -1, hdr.netns_sz ? netns : "any", hdr.term.deadline);
+
+  pid_t worker = fork();
+  if (worker == -1) {
+    WARN("Can't fork to terminate jobs, errno=%d", errno);
+    goto out;
+  }
+  if (worker == 0) {
+    close(sockfd);
+    terminate_jobs(data_sockfd, pidfds, pids, n, cg_fds, ncg);
+    exit(EXIT_SUCCESS);
+  }
+
+out:
+  close(data_sockfd);
+  free_tvars();
+  return 0;
+}
+
+
+static int elapsed_ms(const struct timespec *start) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int)((now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000);
+}
+
+// Number of the jobs still running, the finished ones get -1 in pids
+static unsigned int poll_jobs(int *pidfds, pid_t *pids, unsigned int n, int timeout_ms) {
+  struct pollfd fds[MAX_CHILDS];
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1) {
+    unsigned int alive = 0;
+    nfds_t nfds = 0;
+    for (unsigned int i = 0; i < n; i++) {
+      if (pids[i] == -1)
+        continue;
+      // Without a pidfd fall back to the pid, the daemon reaps it quickly
+      if (pidfds[i] == -1 && kill(pids[i], 0)) {
+        pids[i] = -1;
+        continue;
+      }
+      ++alive;
+      if (pidfds[i] != -1)
+        fds[nfds++] = (struct pollfd){.fd = pidfds[i], .events = POLLIN};
+    }
+    int left = timeout_ms - elapsed_ms(&start);
+    if (!alive || left <= 0)
+      return alive;
+    // Poll the pid based jobs from time to time
+    if (nfds < alive && left > 100)
+      left = 100;
+    if (poll(fds, nfds, left) > 0) {
+      for (nfds_t j = 0; j < nfds; j++) {
+        if (!(fds[j].revents & POLLIN))
+          continue;
+        for (unsigned int i = 0; i < n; i++) {
+          if (pidfds[i] == fds[j].fd)
+            pids[i] = -1;
+        }
+      }
+    }
+  }
+}
+
+static void signal_jobs(int *pidfds, pid_t *pids, unsigned int n, int sig) {
+  for (unsigned int i = 0; i < n; i++) {
+    if (pids[i] == -1)
+      continue;
+    if ((pidfds[i] != -1 ? sys_pidfd_send_signal(pidfds[i], sig) : kill(pids[i], sig)) &&
+        errno == ESRCH)
+      pids[i] = -1;
+  }
+}
+
+// Signal the members of a cgroup except the jobs, those are signaled on
+// their own
+static void signal_cgroup(int cg_fd, const pid_t *pids, unsigned int n, int sig) {
+  int fd = openat(cg_fd, "cgroup.procs", O_RDONLY | O_CLOEXEC);
+  FILE *procs = fd == -1 ? NULL : fdopen(fd, "r");
+  long pid;
+
+  if (!procs) {
+    WARN("Can't read cgroup members, errno=%d", errno);
+    if (fd != -1)
+      close(fd);
+    return;
+  }
+  while (fscanf(procs, "%ld", &pid) == 1) {
+    unsigned int i = 0;
+    for (; i < n && pids[i] != (pid_t)pid; i++);
+    if (i == n)
+      kill((pid_t)pid, sig);
+  }
+  fclose(procs);
+}
+
+static int cgroup_populated(int cg_fd) {
+  char buf[128];
+  int fd = openat(cg_fd, "cgroup.events", O_RDONLY | O_CLOEXEC);
+  ssize_t len = fd == -1 ? -1 : read(fd, buf, sizeof(buf) - 1);
+
+  if (fd != -1)
+    close(fd);
+  if (len <= 0)
+    return 0;
+  buf[len] = 0;
+  return strstr(buf, "populated 1") != NULL;
+}
+
+// Number of the cgroups still populated, the empty ones get -1 in cg_fds
+static unsigned int poll_cgroups(int *cg_fds, unsigned int n, int timeout_ms) {
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  while (1) {
+    unsigned int populated = 0;
+    for (unsigned int i = 0; i < n; i++) {
+      if (cg_fds[i] == -1)
+        continue;
+      if (cgroup_populated(cg_fds[i]))
+        ++populated;
+      else
+        cg_fds[i] = -1;
+    }
+    int left = timeout_ms - elapsed_ms(&start);
+    if (!populated || left <= 0)
+      return populated;
+    usleep((left > 100 ? 100 : left) * 1000);
+  }
+}
+
+void terminate_jobs(int data_sockfd, int *pidfds, pid_t *pids, unsigned int n,
+                    const int *cg_fds, unsigned int ncg) {
+  struct runns_terminate_reply reply = {.matched = n};
+  int cgs[MAX_CHILDS];
+  struct timespec start;
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  memcpy(cgs, cg_fds, ncg * sizeof(*cgs));
+  signal_jobs(pidfds, pids, n, SIGTERM);
+  for (unsigned int i = 0; i < ncg; i++)
+    signal_cgroup(cgs[i], pids, n, SIGTERM);
+  unsigned int alive = poll_jobs(pidfds, pids, n, hdr.term.deadline * 1000);
+  // The processes forked by the jobs get the rest of the deadline
+  unsigned int populated = poll_cgroups(cgs, ncg, hdr.term.deadline * 1000 - elapsed_ms(&start));
+  reply.terminated = n - alive;
+  if (alive || populated) {
+    signal_jobs(pidfds, pids, n, SIGKILL);
+    for (unsigned int i = 0; i < ncg; i++) {
+      if (cgs[i] == -1)
+        continue;
+      // cgroup.kill appeared in Linux 5.14
+      int fd = openat(cgs[i], "cgroup.kill", O_WRONLY | O_CLOEXEC);
+      if (fd == -1) {
+        signal_cgroup(cgs[i], pids, n, SIGKILL);
+        continue;
+      }
+      if (write(fd, "1", 1) != 1)
+        WARN("Can't kill cgroup, errno=%d", errno);
+      close(fd);
+    }
+    reply.remaining = poll_jobs(pidfds, pids, n, TERMINATE_KILL_WAIT * 1000);
+    reply.killed = alive - reply.remaining;
+  }
+
+  INFO("%u jobs: %u terminated, %u killed, %u remaining", reply.matched,
+       reply.terminated, reply.killed, reply.remaining);
+  if (send(data_sockfd, (void *)&reply, sizeof(reply), MSG_NOSIGNAL) == -1)
+    WARN("Can't send terminate reply to uid=%d", cred.uid);
+}
+
+
+void spawn_job(int data_sockfd, const struct runns_launch *l) {
   clean_pids();
   if (childs_run < MAX_CHILDS) {
+    const struct creds *user = creds_get(cred.uid);
     // Make fork
     pid_t child = fork();
     if (child == -1)
@@ -437,26 +1188,40 @@ int do_netns(int data_sockfd) {
         exit(0);
       }
 
+      PROBE(fork, req_id, getpid());
       // Un-map shared memory from the parent.
       munmap(glob_pid, sizeof(glob_pid));
 
       // Detach child from parent
       setsid();
+      sigprocmask(SIG_SETMASK, &orig_sigmask, NULL);
 
       // Redirect stdin, stdout, stderr to new PTS
       if (hdr.flag & RUNNS_NPTMS) {
         int err;
-        if (err = create_ptms()) {
+        if (err = create_ptms(data_sockfd)) {
           exit(err);
         }
       }
+      // or to the fds passed by the client
+      else if (hdr.flag & RUNNS_STDIO) {
+        for (int i = 0; i < RUNNS_STDIO_FDS; i++) {
+          if (dup2(stdio_fds[i], i) == -1) {
+            WARN("Fail to dup2 client fd %d, errno=%d", i, errno);
+            exit(EXIT_FAILURE);
+          }
+        }
+      }
 
       // Set netns
-      int netfd = open(netns, 0);
-      setns(netfd, CLONE_NEWNET);
+      if (setns(l->netns_fd, CLONE_NEWNET)) {
+        WARN("Can't set netns, errno=%d", errno);
+        exit(EXIT_FAILURE);
+      }
+      PROBE(setns, req_id);
 
       // Unshare mount namespace
-      if (resolv) {
+      if (l->resolv) {
         if (unshare(CLONE_NEWNS | CLONE_FS | CLONE_THREAD) < 0) {
           WARN("Can't unshare mount namespace, errno=%d", errno);
           exit(EXIT_FAILURE);
@@ -467,29 +1232,350 @@ int do_netns(int data_sockfd) {
           exit(EXIT_FAILURE);
         }
 
-        if (mount(resolv, "/etc/resolv.conf", NULL, MS_BIND, NULL) < 0) {
-          WARN("Can't mount %s to /etc/resolv.conf, errno=%d", resolv, errno);
+        if (mount(l->resolv, "/etc/resolv.conf", NULL, MS_BIND, NULL) < 0) {
+          WARN("Can't mount %s to /etc/resolv.conf, errno=%d", l->resolv, errno);
           exit(EXIT_FAILURE);
         }
+        PROBE(mount, req_id, l->resolv);
       }
 
-      // Drop privileges and execute command
-      drop_priv(cred.uid);
-      if (execve(program, (char * const *)args, (char * const *)envs) == -1) {
-        WARN("Can not run %s, execve failed with errno=%d", program, errno);
+      // Join cgroup and pin to CPUs
+      if (l->cgroup_fd != -1) {
+        char pid[16];
+        int len = snprintf(pid, sizeof(pid), "%d", getpid());
+        if (write(l->cgroup_fd, pid, len) != len) {
+          WARN("Can't move %s to cgroup, errno=%d", pid, errno);
+          exit(EXIT_FAILURE);
+        }
+      }
+      if (l->place && placement_apply(l->place))
+        exit(EXIT_FAILURE);
+
+      // Drop privileges and execute command, NSS is asked here only if the
+      // daemon has nothing cached for the user yet
+      if (!user) {
+        static struct creds resolved;
+        if (creds_resolve(cred.uid, &resolved)) {
+          WARN("Can't resolve uid=%d", cred.uid);
+          exit(EXIT_FAILURE);
+        }
+        user = &resolved;
+      }
+      if (creds_apply(user))
+        exit(EXIT_FAILURE);
+      PROBE(drop_priv, req_id, cred.uid);
+      PROBE(exec, req_id, l->program);
+      if (l->prog_fd != -1)
+        fexecve(l->prog_fd, (char * const *)l->args, (char * const *)l->envs);
+      if (execve(l->program, (char * const *)l->args, (char * const *)l->envs) == -1) {
+        WARN("Can not run %s, execve failed with errno=%d", l->program, errno);
         exit(EXIT_FAILURE);
       }
     }
     else
       waitpid(child, 0, 0);
 
-    // Save child.
+    // Save child. The exit status is sent on the client socket in the
+    // RUNNS_WAIT mode, see reap_childs().
     INFO("Forked %d", *glob_pid);
     childs[childs_run].uid = cred.uid;
     childs[childs_run].pid = *glob_pid;
+    childs[childs_run].req_id = req_id;
+    childs[childs_run].wait_fd = -1;
+    // The pid can't be reused before it is reaped here, so the pidfd
+    // refers to the job for sure.
+    childs[childs_run].pidfd = sys_pidfd_open(*glob_pid);
+    childs[childs_run].ns_dev = l->ns ? l->ns->dev : 0;
+    childs[childs_run].ns_ino = l->ns ? l->ns->ino : 0;
+    childs[childs_run].adopted = 0;
+    memset(&childs[childs_run].stats, 0, sizeof(childs[childs_run].stats));
+    if (l->ns)
+      acct_netns_path(l->ns->dev, l->ns->ino, l->ns->path);
+    childs[childs_run].slot = registry_add(&childs[childs_run]);
+    if (hdr.flag & RUNNS_WAIT)
+      childs[childs_run].wait_fd = data_sockfd;
+    else
+      close(data_sockfd);
     ++childs_run;
-    free_tvars();
+    PROBE(spawned, req_id, *glob_pid);
   }
-  else
+  else {
     INFO("Maximum number of childs has been reached.");
+    refuse_job(data_sockfd);
+  }
+}
+
+// The client of RUNNS_WAIT learns that its job was not started
+void refuse_job(int data_sockfd) {
+  const int status = RUNNS_WAIT_FAILED;
+
+  if ((hdr.flag & RUNNS_WAIT) &&
+      send(data_sockfd, (void *)&status, sizeof(status), MSG_NOSIGNAL) == -1)
+    WARN("Can't send the refusal to the client %d", cred.uid);
+  close(data_sockfd);
+}
+
+
+void close_stdio_fds() {
+  for (int i = 0; i < RUNNS_STDIO_FDS; i++) {
+    if (stdio_fds[i] != -1) {
+      close(stdio_fds[i]);
+      stdio_fds[i] = -1;
+    }
+  }
+}
+
+
+void create_socket(struct sockaddr_un *addr) {
+  if (defdir == default_dir) {
+    if (!access(runns_socket, F_OK)) {
+      WARN("Old socket file %s has been found", runns_socket);
+      if (unlink(runns_socket))
+        ERR("Can't remove the socket file");
+      else
+        INFO("Old socket file has been removed");
+    }
+    else {
+      if (access(runns_socket_dir, F_OK)) {
+        if (mkdir(runns_socket_dir, 0755) < 0)
+          ERR("Can't create directory %s", runns_socket_dir);
+      }
+    }
+  }
+
+  // Up daemon socket.
+  sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (sockfd == -1)
+    ERR("Something gone very wrong, socket = %d", sockfd);
+  if (bind(sockfd, (struct sockaddr *)addr, sizeof(*addr)) == -1)
+    ERR("Can't bind socket to %s", addr->sun_path);
+  // Switch permissions and group.
+  struct group *group;
+  group = getgrnam("runns");
+  if (!group)
+    ERR("Can't get runns group\n");
+  if (chown(addr->sun_path, 0, group->gr_gid) ||
+      chmod(addr->sun_path, 0775)) {
+
+    ERR("Can't chown/chmod");
+  }
+}
+
+
+void reload_config() {
+  struct runns_profiles p, old;
+
+  got_sighup = 0;
+  if (!config) {
+    WARN("SIGHUP: no configuration to reload");
+    return;
+  }
+  // Keep the old profiles if the new configuration is broken.
+  if (profiles_load(config, &p)) {
+    WARN("Can't reload configuration %s, keep the old one", config);
+    return;
+  }
+  nat_sync(&profiles, &p);
+  proxy_sync(&profiles, &p);
+  old = profiles;
+  profiles = p;
+  INFO("%zu launch profiles reloaded", profiles.sz);
+  creds_flush();
+  rtnl_sync(&old);
+  tc_sync(&old);
+  profiles_free(&old);
+  dns_reload(runns_socket_dir);
+  proxy_start();
+}
+
+
+// Take the listening socket from the previous daemon image or from systemd.
+// Returns 2 if the socket is inherited on restart, 1 from systemd and 0 if
+// there is none.
+int adopt_socket() {
+  int restart = 0;
+  const char *env = getenv("RUNNS_LISTEN_FD");
+  if (env) {
+    sockfd = atoi(env);
+    // Left to systemd unless the state says the socket file is ours
+    sock_owner = 0;
+    if ((env = getenv("RUNNS_STATE_FD")))
+      load_state(atoi(env));
+    unsetenv("RUNNS_LISTEN_FD");
+    unsetenv("RUNNS_STATE_FD");
+    restart = 1;
+  }
+  else if ((env = getenv("LISTEN_PID")) && atoi(env) == getpid() &&
+           (env = getenv("LISTEN_FDS")) && atoi(env) > 0) {
+    if (atoi(env) > 1)
+      WARN("%s sockets passed, only the first one is used", env);
+    sockfd = SD_LISTEN_FDS_START;
+    sock_owner = 0;
+    unsetenv("LISTEN_PID");
+    unsetenv("LISTEN_FDS");
+    unsetenv("LISTEN_FDNAMES");
+  }
+  else
+    return 0;
+
+  int type;
+  socklen_t len = sizeof(type);
+  if (getsockopt(sockfd, SOL_SOCKET, SO_TYPE, &type, &len) || type != SOCK_STREAM)
+    ERR("Inherited fd %d is not a stream socket", sockfd);
+  if (fcntl(sockfd, F_SETFD, FD_CLOEXEC))
+    ERR("Can't set FD_CLOEXEC on %d", sockfd);
+
+  return restart ? 2 : 1;
+}
+
+
+void load_state(int fd) {
+  struct runns_state st;
+
+  if (read(fd, (void *)&st, sizeof(st)) != sizeof(st) ||
+      st.magic != RUNNS_STATE_MAGIC || st.version != RUNNS_STATE_VERSION ||
+      st.child_sz != sizeof(struct runns_child) || st.childs_run > MAX_CHILDS) {
+    WARN("Bad state passed from the previous daemon, the jobs are lost");
+  }
+  else {
+    ssize_t sz = st.childs_run * sizeof(struct runns_child);
+    if (read(fd, (void *)childs, sz) != sz)
+      WARN("Can't read jobs passed from the previous daemon");
+    else
+      childs_run = st.childs_run;
+    req_id = st.req_id;
+    sock_owner = st.sock_owner;
+    if (fwd_load(&fwd_rules, fd))
+      WARN("Can't read forwarding rules passed from the previous daemon");
+    else if (acct_load(fd))
+      WARN("Can't read namespaces of the jobs passed from the previous daemon");
+    else if (proxy_load(fd))
+      WARN("Can't read proxies passed from the previous daemon");
+    else if (dns_load(fd))
+      WARN("Can't read DNS stubs passed from the previous daemon");
+  }
+  close(fd);
+
+  for (unsigned int i = 0; i < childs_run; i++) {
+    if (childs[i].wait_fd != -1)
+      fcntl(childs[i].wait_fd, F_SETFD, FD_CLOEXEC);
+    if (childs[i].pidfd != -1)
+      fcntl(childs[i].pidfd, F_SETFD, FD_CLOEXEC);
+  }
+  INFO("%u jobs taken over", childs_run);
+}
+
+
+// Re-execute the daemon binary passing the listening socket and the jobs, so
+// no connection is refused during the restart. Clients waiting for the jobs
+// keep their sockets as well.
+void restart_daemon() {
+  char fd_str[2][16];
+  char *argv[6] = {self_exe, 0};
+  int argc = 1;
+
+  got_restart = 0;
+  INFO("restarting %s", self_exe);
+  clean_pids();
+
+  int memfd = memfd_create("runns-state", 0);
+  struct runns_state st = {
+    .magic = RUNNS_STATE_MAGIC,
+    .version = RUNNS_STATE_VERSION,
+    .child_sz = sizeof(struct runns_child),
+    .childs_run = childs_run,
+    .req_id = req_id,
+    .sock_owner = sock_owner
+  };
+  if (memfd == -1 ||
+      write(memfd, (void *)&st, sizeof(st)) != sizeof(st) ||
+      write(memfd, (void *)childs, childs_run * sizeof(struct runns_child)) !=
+        (ssize_t)(childs_run * sizeof(struct runns_child)) ||
+      fwd_save(&fwd_rules, memfd) ||
+      acct_save(memfd) ||
+      proxy_save(memfd) ||
+      dns_save(memfd) ||
+      lseek(memfd, 0, SEEK_SET)) {
+    WARN("Can't save the state, errno=%d", errno);
+    dns_save_abort();
+    if (memfd != -1)
+      close(memfd);
+    return;
+  }
+
+  fcntl(sockfd, F_SETFD, 0);
+  for (unsigned int i = 0; i < childs_run; i++) {
+    if (childs[i].wait_fd != -1)
+      fcntl(childs[i].wait_fd, F_SETFD, 0);
+    if (childs[i].pidfd != -1)
+      fcntl(childs[i].pidfd, F_SETFD, 0);
+  }
+  snprintf(fd_str[0], sizeof(fd_str[0]), "%d", sockfd);
+  snprintf(fd_str[1], sizeof(fd_str[1]), "%d", memfd);
+  setenv("RUNNS_LISTEN_FD", fd_str[0], 1);
+  setenv("RUNNS_STATE_FD", fd_str[1], 1);
+  if (defdir == not_default_dir) {
+    argv[argc++] = "-s";
+    argv[argc++] = runns_socket;
+  }
+  if (config) {
+    argv[argc++] = "-c";
+    argv[argc++] = config;
+  }
+
+  execv(self_exe, argv);
+
+  // Still here, continue with the old image.
+  WARN("Can't execute %s, errno=%d", self_exe, errno);
+  unsetenv("RUNNS_LISTEN_FD");
+  unsetenv("RUNNS_STATE_FD");
+  close(memfd);
+  dns_save_abort();
+  fcntl(sockfd, F_SETFD, FD_CLOEXEC);
+  for (unsigned int i = 0; i < childs_run; i++) {
+    if (childs[i].wait_fd != -1)
+      fcntl(childs[i].wait_fd, F_SETFD, FD_CLOEXEC);
+    if (childs[i].pidfd != -1)
+      fcntl(childs[i].pidfd, F_SETFD, FD_CLOEXEC);
+  }
+  dns_sync(runns_socket_dir);
+  proxy_start();
+}
+
+
+void reap_childs() {
+  int status, stubs = 0, proxies = 0;
+  pid_t pid;
+
+  got_sigchld = 0;
+  while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+    if (dns_reaped(pid)) {
+      stubs = 1;
+      continue;
+    }
+    if (creds_reaped(pid, status))
+      continue;
+    if (proxy_reaped(pid)) {
+      proxies = 1;
+      continue;
+    }
+    for (unsigned int i = 0; i < childs_run; i++) {
+      if (childs[i].pid != pid)
+        continue;
+      INFO("Child %d exited with status 0x%x", pid, status);
+      PROBE(exit, childs[i].req_id, pid, status);
+      if (childs[i].wait_fd != -1) {
+        if (send(childs[i].wait_fd, (void *)&status, sizeof(status), MSG_NOSIGNAL) == -1)
+          WARN("Can't send exit status of %d to the client %d", pid, childs[i].uid);
+        close(childs[i].wait_fd);
+      }
+      // The pid could be reused from now on
+      remove_child(i);
+      break;
+    }
+  }
+  if (stubs)
+    dns_sync(runns_socket_dir);
+  if (proxies)
+    proxy_start();
 }
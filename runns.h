@@ -8,7 +8,7 @@
 #ifndef RUNNS_H
 #define RUNNS_H
 
-#define __USE_GNU
+#define _GNU_SOURCE
 #define _XOPEN_SOURCE
 #define __USE_XOPEN_EXTENDED
 #include <stdio.h>
@@ -24,6 +24,7 @@
 #include <termios.h>
 #include <netinet/in.h>
 #include <fcntl.h>
+#include <sys/syscall.h>
 
 #define STR_TOKEN(x) #x
 
@@ -41,16 +42,61 @@
 // RUNNS_STOP -- wait for childs to exit and then exit.
 // RUNNS_LIST -- list childs runned by runns.
 // RUNNS_NPTS -- create control terminal for forked process.
+// RUNNS_STDIO -- stdin, stdout and stderr for forked process are passed
+//                with the header via SCM_RIGHTS.
+// RUNNS_WAIT -- keep connection open and send the exit status of forked
+//               process back to the client, RUNNS_WAIT_FAILED if the
+//               request was refused.
+// RUNNS_RESTART -- re-execute the daemon keeping the socket and childs.
+// RUNNS_DNS_STATS -- send statistics of the DNS stub resolvers.
+// RUNNS_FWD_LIST -- send the forwarding rules.
+// RUNNS_NETNS_STATS -- send the interface counters of the namespaces.
+// RUNNS_QOS_STATS -- send the queue statistics of the shaped namespaces.
 #define RUNNS_STOP        (int)1 << 1
 #define RUNNS_LIST        (int)1 << 2
 #define RUNNS_NPTMS       (int)1 << 3
+#define RUNNS_STDIO       (int)1 << 4
+#define RUNNS_WAIT        (int)1 << 5
+#define RUNNS_RESTART     (int)1 << 6
+#define RUNNS_DNS_STATS   (int)1 << 7
+#define RUNNS_FWD_LIST    (int)1 << 8
+#define RUNNS_NETNS_STATS (int)1 << 9
+#define RUNNS_QOS_STATS   (int)1 << 10
+
+// Status of RUNNS_WAIT for a job which was not started, neither
+// WIFEXITED() nor WIFSIGNALED() is true for it.
+#define RUNNS_WAIT_FAILED -1
+
+// Number of fds passed with RUNNS_STDIO: stdin, stdout, stderr.
+#define RUNNS_STDIO_FDS   3
 
 typedef enum {
   OP_MODE_UNK = 0,
   OP_MODE_NETNS,
-  OP_MODE_FWD_PORT
+  OP_MODE_FWD_PORT,
+  OP_MODE_PROFILE,
+  OP_MODE_TERMINATE
 } OP_MODES;
 
+// CPU and memory placement requested for a job, see --cpus and --mempolicy.
+// Empty strings keep the defaults of the daemon (or of the profile).
+#define RUNNS_PLACEMENT_MAXLEN 64
+struct runns_placement {
+  char cpus[RUNNS_PLACEMENT_MAXLEN];
+  char mempolicy[RUNNS_PLACEMENT_MAXLEN];
+};
+
+// Jobs to terminate with OP_MODE_TERMINATE, the netns path is sent after
+// the header (netns_sz). Users other than root could terminate only their
+// own jobs.
+struct runns_terminate {
+  int by_uid;
+  uid_t uid;
+  unsigned int deadline; // Seconds from SIGTERM to SIGKILL
+};
+// Longer deadlines are cut to this
+#define RUNNS_TERMINATE_MAX_DEADLINE 86400
+
 // common header for server and client
 struct runns_header {
   size_t prog_sz;
@@ -58,14 +104,101 @@ struct runns_header {
   size_t resolv_sz;
   size_t env_sz;
   size_t args_sz;
+  size_t profile_sz;
+  size_t fwd_sz;      // Number of forwarding rules for OP_MODE_FWD_PORT
   unsigned int flag;
   struct termios tmode;
+  struct runns_placement place;
+  struct runns_terminate term;
   OP_MODES op_mode;
 };
 
+// Resources of a job, sampled by the daemon on a timer
+struct runns_job_stats {
+  unsigned long long sampled_usec;  // CLOCK_REALTIME of the sample, 0 if none yet
+  unsigned long long cpu_usec;      // User and system time
+  unsigned int cpu_permille;        // CPU usage since the previous sample
+  unsigned long long rss_kb;
+  unsigned long long read_bytes;    // Storage I/O
+  unsigned long long write_bytes;
+};
+
 struct runns_child {
   uid_t uid;
   pid_t pid;
+  unsigned long long req_id; // ID of the request in the USDT probes
+  int wait_fd;        // Client socket for RUNNS_WAIT or -1
+  int pidfd;          // -1 if pidfd_open() is not supported
+  dev_t ns_dev;       // Network namespace of the job
+  ino_t ns_ino;
+  int slot;           // Record in the job registry or -1
+  int adopted;        // Taken from the registry, not a child of the daemon
+  struct runns_job_stats stats;
+};
+
+// Job of --list
+struct runns_job_record {
+  uid_t uid;
+  pid_t pid;
+  char netns[256];    // Path or net:[<inode>] if the path is unknown
+  struct runns_job_stats stats;
+};
+
+// Interface counters of a network namespace, one record per interface
+struct runns_if_stats {
+  char name[16];
+  unsigned long long rx_bytes;
+  unsigned long long rx_packets;
+  unsigned long long rx_errs;
+  unsigned long long rx_drop;
+  unsigned long long tx_bytes;
+  unsigned long long tx_packets;
+  unsigned long long tx_errs;
+  unsigned long long tx_drop;
+};
+
+struct runns_if_record {
+  char netns[256];    // Path or net:[<inode>] if the path is unknown
+  unsigned long long sampled_usec;
+  struct runns_if_stats stats;
+};
+
+// Queue statistics of a shaped namespace, one record per traffic class
+struct runns_qos_record {
+  char netns[256];
+  char dev[16];
+  char cls[16];       // total, interactive, default or bulk
+  int egress;         // Traffic leaving the namespace
+  unsigned long long rate; // Bytes per second
+  unsigned long long bytes;
+  unsigned long long packets;
+  unsigned int drops;
+  unsigned int overlimits;
+  unsigned int backlog; // Bytes queued
+  unsigned int qlen;    // Packets queued
+};
+
+// Result of OP_MODE_TERMINATE
+struct runns_terminate_reply {
+  unsigned int matched;
+  unsigned int terminated; // Exited after SIGTERM
+  unsigned int killed;     // Exited after SIGKILL
+  unsigned int remaining;  // Still running
+};
+
+// DNS stub resolver statistics, see --dns-stats
+struct runns_dns_stats {
+  unsigned long long queries;
+  unsigned long long hits;          // Answered from the cache (incl. negative)
+  unsigned long long negative_hits; // NXDOMAIN/NODATA answered from the cache
+  unsigned long long misses;        // Forwarded upstream
+  unsigned long long failures;      // Upstream timeouts and errors
+  unsigned long long entries;       // Entries in the cache
+};
+
+struct runns_dns_record {
+  char netns[256];
+  struct runns_dns_stats stats;
 };
 
 // Structures for librunns
@@ -88,4 +221,110 @@ struct netns_list {
   struct netns_list *pnext;
 };
 
+// Forwarding rules, OP_MODE_FWD_PORT
+typedef enum {
+  RUNNS_FWD_ADD = 0,  // Add or replace a rule
+  RUNNS_FWD_DEL,      // Remove a rule, netns is not needed
+  RUNNS_FWD_LOOKUP    // Get a socket created in the netns of the rule
+} RUNNS_FWD_ACTIONS;
+
+// A rule is followed by netns_sz bytes of the netns path on the wire.
+struct runns_fwd_rule {
+  unsigned char ip[sizeof(struct in6_addr)];
+  sa_family_t family; // AF_INET or AF_INET6
+  L4_PROTOCOLS proto; // TCP or UDP
+  in_port_t port;     // Host byte order
+  RUNNS_FWD_ACTIONS action;
+  size_t netns_sz;
+};
+
+// Reply for a batch of rules
+struct runns_fwd_reply {
+  unsigned int added;
+  unsigned int removed;
+  unsigned int failed;
+  unsigned int total; // Rules in the table after the batch
+};
+
+// Send buf with nfds file descriptors attached (SCM_RIGHTS).
+static inline ssize_t send_fds(int sock, const void *buf, size_t len,
+                               const int *fds, int nfds) {
+  struct iovec iov = {.iov_base = (void *)buf, .iov_len = len};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  union {
+    char buf[CMSG_SPACE(RUNNS_STDIO_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+
+  if (nfds > RUNNS_STDIO_FDS) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (nfds > 0) {
+    msg.msg_control = ctrl.buf;
+    msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+    memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+  }
+
+  return sendmsg(sock, &msg, MSG_NOSIGNAL);
+}
+
+// Receive buf and up to *nfds file descriptors. On return *nfds holds the
+// number of received descriptors, the extra ones are closed.
+static inline ssize_t recv_fds(int sock, void *buf, size_t len,
+                               int *fds, int *nfds) {
+  struct iovec iov = {.iov_base = buf, .iov_len = len};
+  struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+  union {
+    char buf[CMSG_SPACE(RUNNS_STDIO_FDS * sizeof(int))];
+    struct cmsghdr align;
+  } ctrl;
+  int max = *nfds;
+
+  msg.msg_control = ctrl.buf;
+  msg.msg_controllen = sizeof(ctrl.buf);
+  *nfds = 0;
+  ssize_t ret = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+  if (ret < 0)
+    return ret;
+
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int n = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    int *p = (int *)CMSG_DATA(cmsg);
+    for (int i = 0; i < n; i++) {
+      if (*nfds < max)
+        fds[(*nfds)++] = p[i];
+      else
+        close(p[i]);
+    }
+  }
+
+  return ret;
+}
+
+// No wrappers in older libc
+static inline int sys_pidfd_open(pid_t pid) {
+#ifdef SYS_pidfd_open
+  return syscall(SYS_pidfd_open, pid, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
+static inline int sys_pidfd_send_signal(int pidfd, int sig) {
+#ifdef SYS_pidfd_send_signal
+  return syscall(SYS_pidfd_send_signal, pidfd, sig, NULL, 0);
+#else
+  errno = ENOSYS;
+  return -1;
+#endif
+}
+
 #endif
@@ -9,6 +9,10 @@
 #include <arpa/inet.h>
 #include <limits.h>
 #include <strings.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/ioctl.h>
 
 #define CLIENT_NAME "runnsctl"
 
@@ -20,7 +24,7 @@ void cleanup();
     do { \
         fprintf(stderr, CLIENT_NAME ":%d / errno=%d / " format "\n", __LINE__, errno, ##__VA_ARGS__); \
         cleanup(); \
-        exit(0); \
+        exit(EXIT_FAILURE); \
     } while (0)
 #define WARN(format, ...) \
     do { \
@@ -46,6 +50,22 @@ void cleanup();
 enum wide_opts {
   OPT_SET_NETNS = 0xFF01,
   OPT_RESOLV = 0xFF02,
+  OPT_STDIO = 0xFF03,
+  OPT_PROFILE = 0xFF04,
+  OPT_RESTART = 0xFF05,
+  OPT_DNS_STATS = 0xFF06,
+  OPT_FWD_DEL = 0xFF07,
+  OPT_FWD_FILE = 0xFF08,
+  OPT_FWD_LIST = 0xFF09,
+  OPT_CPUS = 0xFF0A,
+  OPT_MEMPOLICY = 0xFF0B,
+  OPT_TERMINATE = 0xFF0C,
+  OPT_TERMINATE_UID = 0xFF0D,
+  OPT_TERMINATE_NETNS = 0xFF0E,
+  OPT_DEADLINE = 0xFF0F,
+  OPT_NETNS_STATS = 0xFF10,
+  OPT_JSON = 0xFF11,
+  OPT_QOS_STATS = 0xFF12,
   OPT_SOCKET = 0xFFAA
 };
 
@@ -54,11 +74,17 @@ enum wide_opts {
  */
 int netns_size = 0;
 int sockfd = 0;
-struct netns_list *ns_head = NULL;
+FILE *fwd_stream = NULL;  // Forwarding rules in the wire format
+char *fwd_buf = NULL;
+size_t fwd_buf_sz = 0;
 struct runns_header hdr = {0};
-const char *prog = 0, *netns = 0, *resolv = 0;
+const char *prog = 0, *netns = 0, *resolv = 0, *profile = 0;
+int stdio_fds[RUNNS_STDIO_FDS] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
 struct sockaddr_un addr = {.sun_family = AF_UNIX, .sun_path = DEFAULT_RUNNS_SOCKET};
 char verbose = 0;
+char json = 0;            // Machine-readable output of the lists and stats
+struct termios saved_tmode;
+int tmode_saved = 0;
 extern char **environ;
 
 void help_me() {
@@ -67,14 +93,44 @@ void help_me() {
 "Options:  \n"                                                        \
 "-h|--help             help\n"                                        \
 "-s|--stop             stop daemon (only root)\n"                     \
-"-l|--list             list childs\n"                                 \
+"--restart             restart daemon keeping the jobs (only root)\n"  \
+"-l|--list             list childs (of all users for root), with -v\n" \
+"                      or --json their CPU, memory and I/O\n"          \
+"--netns-stats         show interface counters of the namespaces\n"   \
+"--dns-stats           show statistics of the DNS stubs\n"            \
+"--qos-stats           show queue statistics of the shaped namespaces\n" \
+"--json                print the lists and statistics in JSON\n"       \
 "-p|--program <path>   program to run in desired netns\n"             \
 "-t|--create-ptms      create control terminal\n"                     \
+"--stdio[=<in>,<out>,<err>]\n"                                        \
+"                      pass own stdio (or the given fds) to program\n" \
+"-w|--wait             wait for program and return its exit status\n" \
 "-f|--forward-port     <ip>:<port>:<netns path>:<proto><ip family>\n" \
 "                      <ip family> could be 4 or 6\n"                 \
 "                      <netns path> path to the netns fd\n"           \
+"                      IPv6 <ip> is put in brackets: [::1]\n"         \
+"--forward-del <ip>:<port>[:<proto><ip family>]\n"                    \
+"                      remove a forwarding rule\n"                     \
+"--forward-file <path> add (or remove with leading '-') forwarding\n"  \
+"                      rules from the file, one per line, - is stdin\n" \
+"--forward-list        list forwarding rules\n"                        \
 "--set-netns <path>    network namespace to switch\n"                 \
-"--resolv <path>       path to resolv.conf to be used in program"     \
+"--resolv <path>       path to resolv.conf to be used in program\n"   \
+"--profile <name>      run program (or the first one) allowed in the\n" \
+"                      daemon's launch profile\n"                      \
+"--cpus <list>|auto[:<dev>]\n"                                         \
+"                      pin program to CPUs, auto takes the CPUs local\n" \
+"                      to <dev> (or to the default route device)\n"    \
+"--mempolicy <bind|preferred|interleave|local>[:<nodes>]\n"            \
+"                      NUMA memory policy for program, the nodes\n"    \
+"                      default to the device node with --cpus auto\n"  \
+"--terminate           terminate all own jobs\n"                       \
+"--terminate-uid <uid> terminate all jobs of uid (others only root)\n" \
+"--terminate-netns <path>\n"                                           \
+"                      terminate all jobs in the network namespace,\n" \
+"                      own ones unless root or --terminate-uid\n"     \
+"--deadline <sec>      wait for the jobs before SIGKILL (5 s, a day\n" \
+"                      at most)\n"                                     \
 "--socket <path>       path to the runns socket\n"                    \
 "-v|--verbose          be verbose\n";
 
@@ -82,98 +138,458 @@ void help_me() {
   exit(EXIT_SUCCESS);
 }
 
-void parse_l4_proto(char *l4_proto_str, L4_PROTOCOLS *l4_proto, sa_family_t *family) {
-    // Basic checks and calc the size of the str
-    if (!l4_proto_str || !l4_proto || !family) {
-        ERR("NULL slipped in 0x%x 0x%x 0x%x", l4_proto_str, l4_proto, family);
-    }
-    *l4_proto_str++ = '\0';
+// Parse <proto><ip family>, e.g. tcp4 or UDP6. Returns 0 on success.
+int parse_l4_proto(const char *str, L4_PROTOCOLS *l4_proto, sa_family_t *family) {
+  if (strlen(str) != 4)
+    return -1;
+  if (strncasecmp(str, "tcp", 3) == 0)
+    *l4_proto = L4_PROTOCOL_TCP;
+  else if (strncasecmp(str, "udp", 3) == 0)
+    *l4_proto = L4_PROTOCOL_UDP;
+  else
+    return -1;
+  if (str[3] == '4')
     *family = AF_INET;
-    *l4_proto = L4_PROTOCOL_UNK;
-    size_t l4_proto_str_sz = strlen(l4_proto_str);
-    if (l4_proto_str_sz != 4) {
-        WARN("L4 protocol has wrong size %d != 4. Skip", l4_proto_str_sz);
-        return;
-    }
-    // Get IP family
-    switch (l4_proto_str[3]) {
-        case '4':
-            *family = AF_INET;
-            break;
-        case '6':
-            *family = AF_INET6;
-            break;
-        default:
-            WARN("L4 protocol has wrong IP family %c (only 4 and 6 are allowed). Fallback to 4", l4_proto_str[3]);
+  else if (str[3] == '6')
+    *family = AF_INET6;
+  else
+    return -1;
+  return 0;
+}
+
+// Parse <ip>:<port>[:<netns path>][:<proto><ip family>] into r, an IPv6
+// address is put in brackets. The protocol is tcp by default. *path points
+// into str. Returns 0 on success.
+int parse_fwd_rule(char *str, struct runns_fwd_rule *r, char **path) {
+  char *ip = str, *port, *rest;
+
+  memset(r, 0, sizeof(*r));
+  if (*ip == '[') {
+    char *end = strchr(++ip, ']');
+    if (!end || end[1] != ENV_SEPARATOR)
+      return -1;
+    *end = '\0';
+    port = end + 2;
+  }
+  else {
+    if (!(port = strchr(ip, ENV_SEPARATOR)))
+      return -1;
+    *port++ = '\0';
+  }
+
+  char *end;
+  unsigned long port_num = strtoul(port, &end, 10);
+  if (end == port || port_num > 0xffff || (*end && *end != ENV_SEPARATOR))
+    return -1;
+  r->port = (in_port_t)port_num;
+  rest = *end ? end + 1 : end;
+
+  // The last field is the protocol if it looks like one
+  char *last = strrchr(rest, ENV_SEPARATOR);
+  char *l4 = last ? last + 1 : rest;
+  sa_family_t family = AF_UNSPEC;
+  if (!parse_l4_proto(l4, &r->proto, &family)) {
+    if (last)
+      *last = '\0';
+    else
+      rest = end + strlen(end); // Empty path
+  }
+  else
+    r->proto = L4_PROTOCOL_TCP;
+
+  if (inet_pton(AF_INET, ip, r->ip) == 1)
+    r->family = AF_INET;
+  else if (inet_pton(AF_INET6, ip, r->ip) == 1)
+    r->family = AF_INET6;
+  else
+    return -1;
+  if (family != AF_UNSPEC && family != r->family)
+    return -1;
+
+  *path = rest;
+  return 0;
+}
+
+// Queue a forwarding rule for the daemon, rules are sent in one batch.
+void add_netns(char *str, RUNNS_FWD_ACTIONS action) {
+  struct runns_fwd_rule r;
+  char *path;
+
+  if (!str || parse_fwd_rule(str, &r, &path))
+    ERR("Bad forwarding rule %s, expected <ip>:<port>:<netns path>[:<proto><ip family>]", str ? str : "");
+  if (action == RUNNS_FWD_ADD && !*path)
+    ERR("Forwarding rule for port %d needs netns path", r.port);
+
+  if (!fwd_stream && !(fwd_stream = open_memstream(&fwd_buf, &fwd_buf_sz)))
+    ERR("Can't allocate memory for forwarding rules");
+  r.action = action;
+  r.netns_sz = *path ? strlen(path) + 1 : 0;
+  if (fwrite((void *)&r, sizeof(r), 1, fwd_stream) != 1 ||
+      (r.netns_sz && fwrite(path, r.netns_sz, 1, fwd_stream) != 1)) {
+    ERR("Can't allocate memory for forwarding rules");
+  }
+  DEBUG("adding port=%d family=%d netns=%s proto=%d action=%d", r.port, r.family, path, r.proto, action);
+  ++netns_size;
+}
+
+// Read forwarding rules from the file, one rule per line. Lines starting
+// with '-' remove rules, '#' starts a comment.
+void load_fwd_file(const char *path) {
+  FILE *f = strcmp(path, "-") ? fopen(path, "r") : stdin;
+  char *line = NULL;
+  size_t line_sz = 0;
+  ssize_t len;
+
+  if (!f)
+    ERR("Can't open forwarding rules %s", path);
+  while ((len = getline(&line, &line_sz, f)) != -1) {
+    char *s = line;
+    while (len > 0 && (s[len - 1] == '\n' || s[len - 1] == ' ' || s[len - 1] == '\t'))
+      s[--len] = '\0';
+    while (*s == ' ' || *s == '\t')
+      ++s;
+    if (!*s || *s == '#')
+      continue;
+    if (*s == '-')
+      add_netns(s + 1, RUNNS_FWD_DEL);
+    else
+      add_netns(*s == '+' ? s + 1 : s, RUNNS_FWD_ADD);
+  }
+  free(line);
+  if (f != stdin)
+    fclose(f);
+}
+
+void cleanup() {
+  if (fwd_stream)
+    fclose(fwd_stream);
+  free(fwd_buf);
+  fwd_stream = NULL;
+  fwd_buf = NULL;
+
+  if (sockfd)
+    close(sockfd);
+}
+
+void restore_tmode() {
+  if (tmode_saved)
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved_tmode);
+}
+
+static int write_all(int fd, const char *buf, size_t sz) {
+  for (size_t off = 0; off < sz;) {
+    ssize_t n = write(fd, buf + off, sz - off);
+    if (n == -1)
+      return -1;
+    off += n;
+  }
+  return 0;
+}
+
+// Copy available data from one fd to another. splice() through the pipe is
+// used while both ends support it, otherwise fall back to read()/write().
+// Returns the number of bytes moved, 0 on EOF and -1 on error.
+ssize_t copy_fd(int from, int to, int pipefd[2], int *use_splice) {
+  char buf[4096];
+  ssize_t ret;
+
+  if (*use_splice) {
+    ret = splice(from, NULL, pipefd[1], NULL, 1 << 16, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (ret == -1 && errno == EINVAL) {
+      *use_splice = 0;
+      return copy_fd(from, to, pipefd, use_splice);
     }
-    // Get proto
-    if (strncasecmp(l4_proto_str, "tcp", 3) == 0) {
-        *l4_proto = L4_PROTOCOL_TCP;
-    } else if (strncasecmp(l4_proto_str, "udp", 3) == 0) {
-        *l4_proto = L4_PROTOCOL_UDP;
-    } else {
-        WARN("L4 protocol %s is not correct", l4_proto_str);
+    if (ret <= 0)
+      return ret;
+    for (ssize_t left = ret; left > 0;) {
+      ssize_t n = splice(pipefd[0], NULL, to, NULL, left, SPLICE_F_MOVE);
+      if (n == -1 && errno == EINVAL) {
+        // The destination can't be spliced to (e.g. O_APPEND), the bytes
+        // already in the pipe are moved by hand
+        *use_splice = 0;
+        n = read(pipefd[0], buf, (size_t)left < sizeof(buf) ? (size_t)left : sizeof(buf));
+        if (n > 0 && write_all(to, buf, n))
+          return -1;
+      }
+      if (n <= 0)
+        return -1;
+      left -= n;
     }
+    return ret;
+  }
 
-    DEBUG("l4_proto_str=%s l4_proto=%d family=%d", l4_proto_str, l4_proto, family);
+  ret = read(from, buf, sizeof(buf));
+  if (ret <= 0)
+    return ret;
+  return write_all(to, buf, ret) ? -1 : ret;
 }
 
-void add_netns(char *ip) {
-    if (!ip) {
-        ERR("forward string is empty");
+// Pass EOF of the local input as the remote terminal does it
+static void send_eof(int ptmfd) {
+  struct termios t;
+  if (!tcgetattr(ptmfd, &t) && (t.c_lflag & ICANON) && write(ptmfd, &t.c_cc[VEOF], 1) != 1)
+    WARN("Can't pass EOF to the terminal");
+}
+
+// Relay the local terminal to the pt master received from the daemon until
+// the program closes the slave side. ptmfd is left open.
+void relay_ptm(int ptmfd) {
+  int in_pipe[2], out_pipe[2];
+  int in_splice = 1, out_splice = 1, in_file = 0;
+  struct winsize ws;
+
+  if (pipe2(in_pipe, O_CLOEXEC) || pipe2(out_pipe, O_CLOEXEC))
+    ERR("Can't create pipes for the terminal relay");
+
+  // Switch the local terminal to raw mode, the remote one does the job.
+  if (isatty(STDIN_FILENO) && !tcgetattr(STDIN_FILENO, &saved_tmode)) {
+    struct termios raw = saved_tmode;
+    cfmakeraw(&raw);
+    tmode_saved = 1;
+    atexit(restore_tmode);
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+  }
+
+  // Propagate window size changes.
+  sigset_t mask;
+  sigemptyset(&mask);
+  sigaddset(&mask, SIGWINCH);
+  sigprocmask(SIG_BLOCK, &mask, NULL);
+  int sigfd = signalfd(-1, &mask, SFD_CLOEXEC);
+  if (sigfd == -1)
+    ERR("Can't create signalfd");
+  if (!ioctl(STDIN_FILENO, TIOCGWINSZ, &ws))
+    ioctl(ptmfd, TIOCSWINSZ, &ws);
+
+  int epfd = epoll_create1(EPOLL_CLOEXEC);
+  if (epfd == -1)
+    ERR("Can't create epoll instance");
+  int fds[] = {STDIN_FILENO, ptmfd, sigfd};
+  for (int i = 0; i < 3; i++) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fds[i]};
+    if (epoll_ctl(epfd, EPOLL_CTL_ADD, fds[i], &ev) == -1) {
+      // A regular file (or /dev/null) can't be polled, it is always ready
+      if (fds[i] == STDIN_FILENO && errno == EPERM)
+        in_file = 1;
+      else if (fds[i] != STDIN_FILENO)
+        ERR("Can't add fd %d to epoll", fds[i]);
     }
-    char *port = NULL, *netns_path = NULL;
-    size_t ip_len = strlen(ip);
-    port = strchr(ip, ENV_SEPARATOR);
-    if (port && (size_t)port < ((size_t)ip + ip_len))
-        netns_path = strchr(port + 1, ENV_SEPARATOR);
-    if (!port || !netns_path) { // Mandatory fields
-        WARN("skipping %s -- port and netns_path are mandatory fields", ip);
-        return;
+  }
+
+  for (int running = 1; running;) {
+    struct epoll_event evs[3];
+    // The file is read in chunks between the output, so the program is not
+    // stuck on a full terminal while the input is written
+    if (in_file) {
+      ssize_t ret = copy_fd(STDIN_FILENO, ptmfd, in_pipe, &in_splice);
+      if (ret <= 0) {
+        if (ret == -1)
+          WARN("Can't read the input, errno=%d", errno);
+        in_file = 0;
+        send_eof(ptmfd);
+      }
     }
-    *port++ = '\0';
-    *netns_path++ = '\0';
-    // An optional field for level 4 protocols according to the OSI model
-    char *l4_proto_str = strchr(netns_path + 1, ENV_SEPARATOR);
-    L4_PROTOCOLS l4_proto = L4_PROTOCOL_UNK;
-    sa_family_t family = AF_UNSPEC;
-    parse_l4_proto(l4_proto_str, &l4_proto, &family);
-
-    // Open a netns file to get a fd
-    int netns_fd = open(netns_path, 0);
-    if (netns_fd < 0) {
-        ERR("Can't open netns %s errno: %s", netns_path, strerror(errno));
+    int n = epoll_wait(epfd, evs, 3, in_file ? 0 : -1);
+    if (n == -1) {
+      if (errno == EINTR)
+        continue;
+      ERR("epoll_wait failed");
+    }
+    for (int i = 0; i < n; i++) {
+      int fd = evs[i].data.fd;
+      if (fd == sigfd) {
+        struct signalfd_siginfo si;
+        if (read(sigfd, &si, sizeof(si)) > 0 && !ioctl(STDIN_FILENO, TIOCGWINSZ, &ws))
+          ioctl(ptmfd, TIOCSWINSZ, &ws);
+      } else if (fd == STDIN_FILENO) {
+        ssize_t ret = copy_fd(STDIN_FILENO, ptmfd, in_pipe, &in_splice);
+        if (ret == 0 || (ret == -1 && errno != EAGAIN))
+          epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+        if (ret == 0)
+          send_eof(ptmfd);
+      } else {
+        // EIO: the slave side has been closed
+        ssize_t ret = copy_fd(ptmfd, STDOUT_FILENO, out_pipe, &out_splice);
+        if (ret == 0 || (ret == -1 && errno != EAGAIN))
+          running = 0;
+      }
+    }
+  }
+
+  restore_tmode();
+  tmode_saved = 0;
+  close(epfd);
+  close(sigfd);
+  close(in_pipe[0]); close(in_pipe[1]);
+  close(out_pipe[0]); close(out_pipe[1]);
+}
+
+void send_args(int argc, char **argv) {
+  for (int i = optind; i < argc; i++) {
+    size_t sz = strlen(argv[i]) + 1; // strlen + \0
+    if (write(sockfd, (void *)&sz, sizeof(size_t)) == -1 ||
+        write(sockfd, (void *)argv[i], sz) == -1) {
+
+      ERR("Can't send argv to the daemon");
     }
+  }
+}
 
-    // Create a new netns
-    struct netns_list *ns = (struct netns_list *)malloc(sizeof(struct netns_list));
-    inet_pton(family, ip, ns->node.ip);
-    ns->node.port = atoi(port);
-    ns->node.fd = netns_fd;
-    ns->node.family = family;
-    ns->node.proto = l4_proto;
-    ns->pnext = NULL;
-    DEBUG("adding port=%d ip=%s(0x%x), netns=%s, proto=%d", ns->node.port, ip, *((int *)ns->node.ip), ns->node.netns, ns->node.proto);
-    ++netns_size;
-    // Insert into the list of netns
-    if (ns_head) {
-      struct netns_list *p;
-      for (p = ns_head; p != NULL; p = p->pnext);
-      p->pnext = ns;
+// Send the batch of forwarding rules and read the result
+void send_fwd(struct runns_fwd_reply *reply) {
+  if (fflush(fwd_stream) ||
+      send_fds(sockfd, fwd_buf, fwd_buf_sz, NULL, 0) != (ssize_t)fwd_buf_sz) {
+    ERR("Can't send forwarding rules to the daemon");
+  }
+  if (recv(sockfd, (void *)reply, sizeof(*reply), MSG_WAITALL) != sizeof(*reply))
+    ERR("Can't read the forwarding reply from the daemon");
+}
+
+void print_fwd_rules() {
+  unsigned int n;
+  struct runns_fwd_rule r;
+  char path[PATH_MAX], ip[INET6_ADDRSTRLEN];
+
+  if (recv(sockfd, (void *)&n, sizeof(n), MSG_WAITALL) != sizeof(n))
+    ERR("Can't read number of forwarding rules from the daemon");
+  for (unsigned int i = 0; i < n; i++) {
+    if (recv(sockfd, (void *)&r, sizeof(r), MSG_WAITALL) != sizeof(r) ||
+        !r.netns_sz || r.netns_sz > sizeof(path) ||
+        recv(sockfd, path, r.netns_sz, MSG_WAITALL) != (ssize_t)r.netns_sz) {
+      ERR("Can't read forwarding rule from the daemon");
+    }
+    path[r.netns_sz - 1] = '\0';
+    if (!inet_ntop(r.family, r.ip, ip, sizeof(ip)))
+      continue;
+    printf("%s %d %s%c %s\n", ip, r.port, r.proto == L4_PROTOCOL_UDP ? "udp" : "tcp",
+           r.family == AF_INET6 ? '6' : '4', path);
+  }
+}
+
+// Print str as a JSON string
+void print_json_str(const char *str) {
+  putchar('"');
+  for (; *str; str++) {
+    if (*str == '"' || *str == '\\')
+      printf("\\%c", *str);
+    else if ((unsigned char)*str < 0x20)
+      printf("\\u%04x", *str);
+    else
+      putchar(*str);
+  }
+  putchar('"');
+}
+
+void print_jobs() {
+  unsigned int n;
+  struct runns_job_record rec;
+
+  if (recv(sockfd, (void *)&n, sizeof(n), MSG_WAITALL) != sizeof(n))
+    ERR("Can't read number of childs from the daemon");
+  if (json)
+    printf("[");
+  else if (verbose)
+    printf("%-8s %-6s %10s %5s %10s %14s %14s  %s\n", "PID", "UID", "CPU(s)",
+           "CPU%", "RSS(KiB)", "READ(B)", "WRITE(B)", "NETNS");
+  for (unsigned int i = 0; i < n; i++) {
+    if (recv(sockfd, (void *)&rec, sizeof(rec), MSG_WAITALL) != sizeof(rec))
+      ERR("Can't read child info from the daemon");
+    rec.netns[sizeof(rec.netns) - 1] = '\0';
+    const struct runns_job_stats *s = &rec.stats;
+    if (json) {
+      printf("%s{\"pid\":%d,\"uid\":%d,\"netns\":", i ? "," : "", rec.pid, rec.uid);
+      print_json_str(rec.netns);
+      if (s->sampled_usec)
+        printf(",\"sampled_usec\":%llu,\"cpu_usec\":%llu,\"cpu_permille\":%u,"
+               "\"rss_kb\":%llu,\"read_bytes\":%llu,\"write_bytes\":%llu",
+               s->sampled_usec, s->cpu_usec, s->cpu_permille, s->rss_kb,
+               s->read_bytes, s->write_bytes);
+      printf("}");
+    } else if (!verbose) {
+      printf("%d\n", rec.pid);
+    } else if (!s->sampled_usec) {
+      printf("%-8d %-6d %10s %5s %10s %14s %14s  %s\n", rec.pid, rec.uid,
+             "-", "-", "-", "-", "-", rec.netns);
     } else {
-      ns_head = ns;
+      printf("%-8d %-6d %10.2f %5.1f %10llu %14llu %14llu  %s\n", rec.pid, rec.uid,
+             s->cpu_usec / 1e6, s->cpu_permille / 10.0, s->rss_kb,
+             s->read_bytes, s->write_bytes, rec.netns);
     }
+  }
+  if (json)
+    printf("]\n");
 }
 
-void cleanup() {
-  for (struct netns_list *p = ns_head; p != NULL;) {
-    struct netns_list *ptmp = p->pnext;
-    free(p);
-    p = ptmp;
+void print_netns_stats() {
+  unsigned int n;
+  struct runns_if_record rec;
+
+  if (recv(sockfd, (void *)&n, sizeof(n), MSG_WAITALL) != sizeof(n))
+    ERR("Can't read number of interfaces from the daemon");
+  if (json)
+    printf("[");
+  for (unsigned int i = 0; i < n; i++) {
+    if (recv(sockfd, (void *)&rec, sizeof(rec), MSG_WAITALL) != sizeof(rec))
+      ERR("Can't read interface counters from the daemon");
+    rec.netns[sizeof(rec.netns) - 1] = '\0';
+    rec.stats.name[sizeof(rec.stats.name) - 1] = '\0';
+    const struct runns_if_stats *s = &rec.stats;
+    if (json) {
+      printf("%s{\"netns\":", i ? "," : "");
+      print_json_str(rec.netns);
+      printf(",\"interface\":");
+      print_json_str(s->name);
+      printf(",\"sampled_usec\":%llu,\"rx_bytes\":%llu,\"rx_packets\":%llu,"
+             "\"rx_errs\":%llu,\"rx_drop\":%llu,\"tx_bytes\":%llu,\"tx_packets\":%llu,"
+             "\"tx_errs\":%llu,\"tx_drop\":%llu}",
+             rec.sampled_usec, s->rx_bytes, s->rx_packets, s->rx_errs, s->rx_drop,
+             s->tx_bytes, s->tx_packets, s->tx_errs, s->tx_drop);
+    } else {
+      printf("%s %s: rx_bytes=%llu rx_packets=%llu rx_errs=%llu rx_drop=%llu "
+             "tx_bytes=%llu tx_packets=%llu tx_errs=%llu tx_drop=%llu\n",
+             rec.netns, s->name, s->rx_bytes, s->rx_packets, s->rx_errs, s->rx_drop,
+             s->tx_bytes, s->tx_packets, s->tx_errs, s->tx_drop);
+    }
   }
+  if (json)
+    printf("]\n");
+}
 
-  if (sockfd)
-    close(sockfd);
+void print_qos_stats() {
+  unsigned int n;
+  struct runns_qos_record rec;
+
+  if (recv(sockfd, (void *)&n, sizeof(n), MSG_WAITALL) != sizeof(n))
+    ERR("Can't read number of traffic classes from the daemon");
+  if (json)
+    printf("[");
+  for (unsigned int i = 0; i < n; i++) {
+    if (recv(sockfd, (void *)&rec, sizeof(rec), MSG_WAITALL) != sizeof(rec))
+      ERR("Can't read queue statistics from the daemon");
+    rec.netns[sizeof(rec.netns) - 1] = '\0';
+    rec.dev[sizeof(rec.dev) - 1] = '\0';
+    rec.cls[sizeof(rec.cls) - 1] = '\0';
+    if (json) {
+      printf("%s{\"netns\":", i ? "," : "");
+      print_json_str(rec.netns);
+      printf(",\"interface\":");
+      print_json_str(rec.dev);
+      printf(",\"direction\":\"%s\",\"class\":", rec.egress ? "egress" : "ingress");
+      print_json_str(rec.cls);
+      printf(",\"rate\":%llu,\"bytes\":%llu,\"packets\":%llu,\"drops\":%u,"
+             "\"overlimits\":%u,\"backlog\":%u,\"qlen\":%u}",
+             rec.rate, rec.bytes, rec.packets, rec.drops, rec.overlimits,
+             rec.backlog, rec.qlen);
+    } else {
+      printf("%s %s %s %s: rate=%llubit bytes=%llu packets=%llu drops=%u "
+             "overlimits=%u backlog=%ub qlen=%u\n",
+             rec.netns, rec.dev, rec.egress ? "egress" : "ingress", rec.cls,
+             rec.rate * 8, rec.bytes, rec.packets, rec.drops, rec.overlimits,
+             rec.backlog, rec.qlen);
+    }
+  }
+  if (json)
+    printf("]\n");
 }
 
 void send_netns(int argc, char **argv) {
@@ -194,16 +610,7 @@ void send_netns(int argc, char **argv) {
   }
 
   // Transfer argv
-  if (hdr.args_sz > 0) {
-    for (int i = optind; i < argc; i++) {
-      size_t sz = strlen(argv[i]) + 1; // strlen + \0
-      if (write(sockfd, (void *)&sz, sizeof(size_t)) == -1 ||
-          write(sockfd, (void *)argv[i], sz) == -1) {
-
-        ERR("Can't send argv to the daemon");
-      }
-    }
-  }
+  send_args(argc, argv);
 
   // Transfer environment variables
   for (int i = 0; i < hdr.env_sz; i++) {
@@ -219,6 +626,17 @@ void send_netns(int argc, char **argv) {
     ERR("Can't send EOF to the daemon");
 }
 
+// Only the profile name, the program and argv are sent, the rest is known
+// to the daemon.
+void send_profile(int argc, char **argv) {
+  if (write(sockfd, (void *)profile, hdr.profile_sz) == -1 ||
+      (prog && write(sockfd, (void *)prog, hdr.prog_sz) == -1)) {
+
+    ERR("Can't send profile name or program to the daemon");
+  }
+  send_args(argc, argv);
+}
+
 void parse_cmdline(int argc, char **argv) {
   struct option opts[] = {
     { .name = "help", .has_arg = 0, .flag = 0, .val = 'h' },
@@ -227,13 +645,30 @@ void parse_cmdline(int argc, char **argv) {
     { .name = "stop", .has_arg = 0, .flag = 0, .val = 's' },
     { .name = "list", .has_arg = 0, .flag = 0, .val = 'l' },
     { .name = "create-ptms", .has_arg = 0, .flag = 0, .val = 't' },
+    { .name = "stdio", .has_arg = 2, .flag = 0, .val = OPT_STDIO },
+    { .name = "wait", .has_arg = 0, .flag = 0, .val = 'w' },
     { .name = "forward-port", .has_arg = 1, .flag = 0, .val = 'f' },
     { .name = "set-netns", .has_arg = 1, .flag = 0, .val = OPT_SET_NETNS },
     { .name = "resolv", .has_arg = 1, .flag = 0, .val = OPT_RESOLV },
     { .name = "socket", .has_arg = 1, .flag = 0, .val = OPT_SOCKET },
+    { .name = "profile", .has_arg = 1, .flag = 0, .val = OPT_PROFILE },
+    { .name = "restart", .has_arg = 0, .flag = 0, .val = OPT_RESTART },
+    { .name = "dns-stats", .has_arg = 0, .flag = 0, .val = OPT_DNS_STATS },
+    { .name = "forward-del", .has_arg = 1, .flag = 0, .val = OPT_FWD_DEL },
+    { .name = "forward-file", .has_arg = 1, .flag = 0, .val = OPT_FWD_FILE },
+    { .name = "forward-list", .has_arg = 0, .flag = 0, .val = OPT_FWD_LIST },
+    { .name = "cpus", .has_arg = 1, .flag = 0, .val = OPT_CPUS },
+    { .name = "mempolicy", .has_arg = 1, .flag = 0, .val = OPT_MEMPOLICY },
+    { .name = "terminate", .has_arg = 0, .flag = 0, .val = OPT_TERMINATE },
+    { .name = "terminate-uid", .has_arg = 1, .flag = 0, .val = OPT_TERMINATE_UID },
+    { .name = "terminate-netns", .has_arg = 1, .flag = 0, .val = OPT_TERMINATE_NETNS },
+    { .name = "deadline", .has_arg = 1, .flag = 0, .val = OPT_DEADLINE },
+    { .name = "netns-stats", .has_arg = 0, .flag = 0, .val = OPT_NETNS_STATS },
+    { .name = "json", .has_arg = 0, .flag = 0, .val = OPT_JSON },
+    { .name = "qos-stats", .has_arg = 0, .flag = 0, .val = OPT_QOS_STATS },
     { 0, 0, 0, 0 }
   };
-  const char *optstring = "hp:vsltf:";
+  const char *optstring = "hp:vsltf:w";
   int opt, len;
   // Parse command line options
   if (argc <= 1)
@@ -250,6 +685,21 @@ void parse_cmdline(int argc, char **argv) {
       case 'l':
         hdr.flag |= RUNNS_LIST;
         break;
+      case OPT_RESTART:
+        hdr.flag |= RUNNS_RESTART;
+        break;
+      case OPT_DNS_STATS:
+        hdr.flag |= RUNNS_DNS_STATS;
+        break;
+      case OPT_NETNS_STATS:
+        hdr.flag |= RUNNS_NETNS_STATS;
+        break;
+      case OPT_QOS_STATS:
+        hdr.flag |= RUNNS_QOS_STATS;
+        break;
+      case OPT_JSON:
+        json = 1;
+        break;
       case 'p':
         prog = optarg;
         hdr.prog_sz = strlen(prog) + 1;
@@ -257,24 +707,87 @@ void parse_cmdline(int argc, char **argv) {
       case 't':
         hdr.flag |= RUNNS_NPTMS;
         break;
+      case OPT_STDIO:
+        if (optarg &&
+            sscanf(optarg, "%d,%d,%d", &stdio_fds[0], &stdio_fds[1], &stdio_fds[2]) != RUNNS_STDIO_FDS) {
+          ERR("--stdio expects <in>,<out>,<err> fds, got %s", optarg);
+        }
+        hdr.flag |= RUNNS_STDIO;
+        break;
+      case 'w':
+        hdr.flag |= RUNNS_WAIT;
+        break;
       case 'f':
-        if (hdr.op_mode == OP_MODE_NETNS) {
-          ERR("--forward-port and --set-netns mutually exclusive");
+      case OPT_FWD_DEL:
+      case OPT_FWD_FILE:
+        if (hdr.op_mode == OP_MODE_NETNS || hdr.op_mode == OP_MODE_PROFILE ||
+            hdr.op_mode == OP_MODE_TERMINATE) {
+          ERR("--forward-port, --set-netns, --profile and --terminate mutually exclusive");
         }
         hdr.op_mode = OP_MODE_FWD_PORT;
-        add_netns(optarg);
+        if (opt == OPT_FWD_FILE)
+          load_fwd_file(optarg);
+        else
+          add_netns(optarg, opt == 'f' ? RUNNS_FWD_ADD : RUNNS_FWD_DEL);
+        break;
+      case OPT_FWD_LIST:
+        hdr.flag |= RUNNS_FWD_LIST;
+        break;
+      case OPT_CPUS:
+      case OPT_MEMPOLICY: {
+        char *dst = opt == OPT_CPUS ? hdr.place.cpus : hdr.place.mempolicy;
+        if (strlen(optarg) >= RUNNS_PLACEMENT_MAXLEN)
+          ERR("--cpus and --mempolicy are limited to " STR_TOKEN(RUNNS_PLACEMENT_MAXLEN) " characters");
+        strcpy(dst, optarg);
         break;
+      }
       case 'v':
         verbose = 1;
         break;
       case OPT_SET_NETNS:
-        if (hdr.op_mode == OP_MODE_FWD_PORT) {
-          ERR("--forward-port and --set-netns mutually exclusive");
+        if (hdr.op_mode == OP_MODE_FWD_PORT || hdr.op_mode == OP_MODE_PROFILE ||
+            hdr.op_mode == OP_MODE_TERMINATE) {
+          ERR("--forward-port, --set-netns, --profile and --terminate mutually exclusive");
         }
         hdr.op_mode = OP_MODE_NETNS;
         netns = optarg;
         hdr.netns_sz = strlen(netns) + 1;
         break;
+      case OPT_PROFILE:
+        if (hdr.op_mode == OP_MODE_FWD_PORT || hdr.op_mode == OP_MODE_NETNS ||
+            hdr.op_mode == OP_MODE_TERMINATE) {
+          ERR("--forward-port, --set-netns, --profile and --terminate mutually exclusive");
+        }
+        hdr.op_mode = OP_MODE_PROFILE;
+        profile = optarg;
+        hdr.profile_sz = strlen(profile) + 1;
+        break;
+      case OPT_TERMINATE:
+      case OPT_TERMINATE_UID:
+      case OPT_TERMINATE_NETNS:
+        if (hdr.op_mode != OP_MODE_UNK && hdr.op_mode != OP_MODE_TERMINATE) {
+          ERR("--forward-port, --set-netns, --profile and --terminate mutually exclusive");
+        }
+        hdr.op_mode = OP_MODE_TERMINATE;
+        if (opt == OPT_TERMINATE_UID) {
+          char *end;
+          hdr.term.by_uid = 1;
+          hdr.term.uid = strtoul(optarg, &end, 10);
+          if (!*optarg || *end)
+            ERR("Wrong uid: %s", optarg);
+        } else if (opt == OPT_TERMINATE_NETNS) {
+          netns = optarg;
+          hdr.netns_sz = strlen(netns) + 1;
+        }
+        break;
+      case OPT_DEADLINE: {
+        char *end;
+        unsigned long deadline = strtoul(optarg, &end, 10);
+        if (!*optarg || *end || !deadline || *optarg == '-')
+          ERR("Wrong deadline: %s", optarg);
+        hdr.term.deadline = deadline > RUNNS_TERMINATE_MAX_DEADLINE ? RUNNS_TERMINATE_MAX_DEADLINE : deadline;
+        break;
+      }
       case OPT_RESOLV:
         resolv = optarg;
         hdr.resolv_sz = strlen(resolv) + 1;
@@ -296,15 +809,18 @@ void parse_cmdline(int argc, char **argv) {
 int main(int argc, char **argv) {
   parse_cmdline(argc, argv);
   // Sanity checks
-  if (hdr.op_mode == OP_MODE_FWD_PORT && !ns_head) {
+  if (hdr.op_mode == OP_MODE_FWD_PORT && !netns_size) {
     ERR("Nothing to forward");
   }
-  if (hdr.op_mode == OP_MODE_NETNS && !hdr.flag && (!netns || !prog)) {
+  if (hdr.op_mode == OP_MODE_NETNS && !(hdr.flag & (RUNNS_STOP | RUNNS_LIST | RUNNS_RESTART | RUNNS_DNS_STATS | RUNNS_FWD_LIST)) && (!netns || !prog)) {
     ERR("Please check that you set network namespace and program");
   }
+  if ((hdr.flag & RUNNS_STDIO) && (hdr.flag & RUNNS_NPTMS)) {
+    ERR("--stdio and --create-ptms mutually exclusive");
+  }
 
   // Output parameters in the case of verbose option
-  if (netns && verbose) {
+  if (netns && verbose && hdr.op_mode != OP_MODE_TERMINATE) {
     if (hdr.flag & (RUNNS_STOP | RUNNS_LIST)) { // flags related to runns daemon
       char *str = NULL;
 
@@ -319,8 +835,16 @@ int main(int argc, char **argv) {
     }
   }
 
-  // Count number of environment variables
-  for (hdr.env_sz = 0; environ[hdr.env_sz] != 0; ++hdr.env_sz);
+  if (hdr.op_mode == OP_MODE_TERMINATE && (prog || resolv || hdr.flag)) {
+    ERR("--terminate doesn't take other options");
+  }
+  if (hdr.op_mode == OP_MODE_PROFILE && (resolv || netns)) {
+    ERR("--profile defines network namespace and resolv.conf");
+  }
+
+  // Count number of environment variables, a profile has its own environment
+  if (hdr.op_mode != OP_MODE_PROFILE && hdr.op_mode != OP_MODE_TERMINATE)
+    for (hdr.env_sz = 0; environ[hdr.env_sz] != 0; ++hdr.env_sz);
 
   // Up socket
   sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
@@ -332,41 +856,138 @@ int main(int argc, char **argv) {
   }
   // Calculate number of non-options
   hdr.args_sz = argc - optind;
+  hdr.fwd_sz = netns_size;
 
   // Get termios
-  tcgetattr(STDIN_FILENO, &hdr.tmode);
+  if (tcgetattr(STDIN_FILENO, &hdr.tmode))
+    memset(&hdr.tmode, 0, sizeof(hdr.tmode));
 
-  if (write(sockfd, (void *)&hdr, sizeof(hdr)) == -1)
+  if (send_fds(sockfd, (void *)&hdr, sizeof(hdr),
+               stdio_fds, (hdr.flag & RUNNS_STDIO) ? RUNNS_STDIO_FDS : 0) == -1)
     ERR("Can't send header to the daemon");
-  // Stop daemon
-  if (hdr.flag & RUNNS_STOP) {
+  // Stop or restart daemon
+  if (hdr.flag & (RUNNS_STOP | RUNNS_RESTART)) {
     cleanup();
     return EXIT_SUCCESS;
   }
   // Print list of children and exit
   if (hdr.flag & RUNNS_LIST) {
-    unsigned int childs_run;
-    struct runns_child child;
-    if (read(sockfd, (void *)&childs_run, sizeof(childs_run)) == -1)
-      ERR("Can't read number of childs from the daemon");
-    for (int i = 0; i < childs_run; i++) {
-      if (read(sockfd, (void *)&child, sizeof(child)) == -1)
-        ERR("Can't read child info from the daemon");
-      printf("%d\n", child.pid);
+    print_jobs();
+    cleanup();
+    return EXIT_SUCCESS;
+  }
+  // Print interface counters of the namespaces and exit
+  if (hdr.flag & RUNNS_NETNS_STATS) {
+    print_netns_stats();
+    cleanup();
+    return EXIT_SUCCESS;
+  }
+  // Print queue statistics of the shaped namespaces and exit
+  if (hdr.flag & RUNNS_QOS_STATS) {
+    print_qos_stats();
+    cleanup();
+    return EXIT_SUCCESS;
+  }
+  // Print statistics of the DNS stubs and exit
+  if (hdr.flag & RUNNS_DNS_STATS) {
+    unsigned int stubs;
+    struct runns_dns_record rec;
+    if (read(sockfd, (void *)&stubs, sizeof(stubs)) != sizeof(stubs))
+      ERR("Can't read number of DNS stubs from the daemon");
+    if (json)
+      printf("[");
+    for (unsigned int i = 0; i < stubs; i++) {
+      if (recv(sockfd, (void *)&rec, sizeof(rec), MSG_WAITALL) != sizeof(rec))
+        ERR("Can't read DNS statistics from the daemon");
+      rec.netns[sizeof(rec.netns) - 1] = '\0';
+      if (json) {
+        printf("%s{\"netns\":", i ? "," : "");
+        print_json_str(rec.netns);
+        printf(",\"queries\":%llu,\"hits\":%llu,\"negative_hits\":%llu,\"misses\":%llu,"
+               "\"failures\":%llu,\"entries\":%llu}",
+               rec.stats.queries, rec.stats.hits, rec.stats.negative_hits,
+               rec.stats.misses, rec.stats.failures, rec.stats.entries);
+        continue;
+      }
+      printf("%s: queries=%llu hits=%llu (%.1f%%) negative_hits=%llu misses=%llu failures=%llu entries=%llu\n",
+             rec.netns, rec.stats.queries, rec.stats.hits,
+             rec.stats.queries ? 100.0 * rec.stats.hits / rec.stats.queries : 0.0,
+             rec.stats.negative_hits, rec.stats.misses, rec.stats.failures, rec.stats.entries);
     }
     cleanup();
     return EXIT_SUCCESS;
   }
+  // Print forwarding rules and exit
+  if (hdr.flag & RUNNS_FWD_LIST) {
+    print_fwd_rules();
+    cleanup();
+    return EXIT_SUCCESS;
+  }
 
   switch (hdr.op_mode) {
+    case OP_MODE_FWD_PORT: {
+      struct runns_fwd_reply reply;
+      send_fwd(&reply);
+      if (verbose || reply.failed)
+        printf("%u added, %u removed, %u failed, %u rules in total\n",
+               reply.added, reply.removed, reply.failed, reply.total);
+      cleanup();
+      return reply.failed ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
     case OP_MODE_NETNS:
       send_netns(argc, argv);
       break;
+    case OP_MODE_PROFILE:
+      send_profile(argc, argv);
+      break;
+    case OP_MODE_TERMINATE: {
+      struct runns_terminate_reply reply;
+      if (netns && write(sockfd, (void *)netns, hdr.netns_sz) == -1)
+        ERR("Can't send network namespace to the daemon");
+      if (recv(sockfd, (void *)&reply, sizeof(reply), MSG_WAITALL) != sizeof(reply))
+        ERR("Can't read the result of termination from the daemon");
+      if (verbose || reply.remaining)
+        printf("%u jobs: %u terminated, %u killed, %u still running\n",
+               reply.matched, reply.terminated, reply.killed, reply.remaining);
+      cleanup();
+      return reply.remaining ? EXIT_FAILURE : EXIT_SUCCESS;
+    }
     default:
       ERR("Unknown OP_MODE: %d", hdr.op_mode);
   }
 
+  // Run the terminal relay on the pt master created by the daemon
+  int ptmfd = -1;
+  if (hdr.flag & RUNNS_NPTMS) {
+    char ack;
+    int nfds = 1;
+    if (recv_fds(sockfd, &ack, sizeof(ack), &ptmfd, &nfds) <= 0 || nfds != 1)
+      ERR("Can't receive pt master from the daemon");
+    relay_ptm(ptmfd);
+  }
+
+  // Wait for the program and return its exit status
+  int ret = EXIT_SUCCESS;
+  if (hdr.flag & RUNNS_WAIT) {
+    int status = RUNNS_WAIT_FAILED;
+    if (read(sockfd, (void *)&status, sizeof(status)) != sizeof(status))
+      WARN("Can't read exit status from the daemon");
+    if (status == RUNNS_WAIT_FAILED) {
+      WARN("The daemon didn't run the program");
+      ret = 127;
+    }
+    else if (WIFEXITED(status))
+      ret = WEXITSTATUS(status);
+    else if (WIFSIGNALED(status))
+      ret = 128 + WTERMSIG(status);
+    DEBUG("program exited with status 0x%x", status);
+  }
+  // Closed only now, the hangup would kill a program which has closed the
+  // terminal but is still exiting
+  if (ptmfd != -1)
+    close(ptmfd);
+
   cleanup();
-  return EXIT_SUCCESS;
+  return ret;
 }
 #endif
@@ -0,0 +1,353 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#include "runns.h"
+#include "daemon.h"
+#include "netns.h"
+#include "profile.h"
+#include "rtnl.h"
+#include "nat.h"
+#include "tc.h"
+
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+#include <linux/pkt_sched.h>
+#include <linux/gen_stats.h>
+
+#define TC_ROOT 0x10000       // 1:
+#define TC_RATE 0x10001       // 1:1
+#define TC_DEFAULT 0x10020    // 1:20
+#define TC_CLASSES 3
+
+static const struct {
+  uint32_t classid;
+  const char *name;
+  unsigned int share;  // Guaranteed tenths of the rate
+  uint32_t prio;
+} classes[TC_CLASSES] = {
+  {0x10010, "interactive", 5, 0},
+  {TC_DEFAULT, "default", 3, 1},
+  {0x10030, "bulk", 2, 2},
+};
+
+// u32 matches on the first word of the network header: TOS of IPv4, the
+// traffic class of IPv6 is shifted by 4 bits.
+static const struct {
+  uint16_t proto;
+  uint32_t mask;
+  uint32_t val;
+  uint32_t classid;
+} tos_filters[] = {
+  {ETH_P_IP, 0x001e0000, 0x00100000, 0x10010},   // lowdelay
+  {ETH_P_IP, 0x00fc0000, 0x00b80000, 0x10010},   // EF
+  {ETH_P_IP, 0x00fc0000, 0x00480000, 0x10010},   // AF21
+  {ETH_P_IP, 0x001e0000, 0x00080000, 0x10030},   // throughput
+  {ETH_P_IP, 0x00fc0000, 0x00200000, 0x10030},   // CS1
+  {ETH_P_IPV6, 0x0fc00000, 0x0b800000, 0x10010}, // EF
+  {ETH_P_IPV6, 0x0fc00000, 0x04800000, 0x10010}, // AF21
+  {ETH_P_IPV6, 0x0fc00000, 0x02000000, 0x10030}, // CS1
+};
+
+int tc_parse_rate(const char *s, unsigned long long *rate) {
+  static const struct {
+    const char *suffix;
+    unsigned long long mult; // Bits per unit
+  } units[] = {
+    {"bit", 1}, {"kbit", 1000}, {"mbit", 1000000}, {"gbit", 1000000000},
+    {"bps", 8}, {"kbps", 8000}, {"mbps", 8000000}, {"gbps", 8000000000ULL}
+  };
+  char *end;
+
+  errno = 0;
+  unsigned long long v = strtoull(s, &end, 10);
+  if (errno || end == s || !v)
+    return -1;
+  for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+    if (!strcmp(end, units[i].suffix)) {
+      if (v > ~0ULL / units[i].mult)
+        return -1;
+      *rate = v * units[i].mult / 8;
+      return *rate ? 0 : -1;
+    }
+  }
+  return -1;
+}
+
+int tc_parse_class(const char *s, uint32_t *mark) {
+  if (!strcmp(s, "interactive"))
+    *mark = TC_MARK_INTERACTIVE;
+  else if (!strcmp(s, "bulk"))
+    *mark = TC_MARK_BULK;
+  else if (!strcmp(s, "default"))
+    *mark = 0;
+  else
+    return -1;
+  return 0;
+}
+
+static void tc_msg(struct rtnl_batch *b, uint16_t type, uint16_t flags, int ifindex,
+                   uint32_t handle, uint32_t parent, uint32_t info, const char *kind) {
+  struct tcmsg tcm = {
+    .tcm_family = AF_UNSPEC,
+    .tcm_ifindex = ifindex,
+    .tcm_handle = handle,
+    .tcm_parent = parent,
+    .tcm_info = info
+  };
+  rtnl_msg(b, type, flags, &tcm, sizeof(tcm));
+  if (kind)
+    rtnl_attr_str(b, TCA_KIND, kind);
+}
+
+// Burst of a millisecond and a full frame at rate, in 64ns scheduler ticks.
+// A frame takes longer than the u32 of the ticks at a few bytes per second.
+static uint32_t htb_burst(unsigned long long rate) {
+  unsigned long long ticks = (1000000ULL + 1600 * 1000000000ULL / rate) >> 6;
+  return ticks > ~0U ? ~0U : ticks;
+}
+
+static void htb_class(struct rtnl_batch *b, int ifindex, uint32_t classid, uint32_t parent,
+                      unsigned long long rate, unsigned long long ceil, uint32_t prio) {
+  struct tc_htb_opt opt = {
+    .rate = {.linklayer = TC_LINKLAYER_ETHERNET, .rate = rate > ~0U ? ~0U : rate},
+    .ceil = {.linklayer = TC_LINKLAYER_ETHERNET, .rate = ceil > ~0U ? ~0U : ceil},
+    .buffer = htb_burst(rate),
+    .cbuffer = htb_burst(ceil),
+    .prio = prio
+  };
+
+  tc_msg(b, RTM_NEWTCLASS, NLM_F_CREATE | NLM_F_EXCL, ifindex, classid, parent, 0, "htb");
+  struct rtattr *nest = rtnl_nest(b, TCA_OPTIONS);
+  rtnl_attr(b, TCA_HTB_PARMS, &opt, sizeof(opt));
+  if (rate > ~0U)
+    rtnl_attr(b, TCA_HTB_RATE64, &rate, sizeof(rate));
+  if (ceil > ~0U)
+    rtnl_attr(b, TCA_HTB_CEIL64, &ceil, sizeof(ceil));
+  rtnl_nest_end(b, nest);
+}
+
+static void u32_filter(struct rtnl_batch *b, int ifindex, uint32_t prio, uint16_t proto,
+                       uint32_t mask, uint32_t val, uint32_t classid) {
+  struct {
+    struct tc_u32_sel sel;
+    struct tc_u32_key key;
+  } sel = {
+    .sel = {.flags = TC_U32_TERMINAL, .nkeys = 1},
+    .key = {.mask = htonl(mask), .val = htonl(val)}
+  };
+
+  tc_msg(b, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, ifindex, 0, TC_ROOT,
+         TC_H_MAKE(prio << 16, htons(proto)), "u32");
+  struct rtattr *nest = rtnl_nest(b, TCA_OPTIONS);
+  rtnl_attr_u32(b, TCA_U32_CLASSID, classid);
+  rtnl_attr(b, TCA_U32_SEL, &sel, sizeof(sel));
+  rtnl_nest_end(b, nest);
+}
+
+static void fw_filter(struct rtnl_batch *b, int ifindex, uint32_t mark, uint32_t classid) {
+  tc_msg(b, RTM_NEWTFILTER, NLM_F_CREATE | NLM_F_EXCL, ifindex, mark, TC_ROOT,
+         TC_H_MAKE(3 << 16, htons(ETH_P_ALL)), "fw");
+  rtnl_allow(b, ENOENT); // No cls_fw in the kernel
+  struct rtattr *nest = rtnl_nest(b, TCA_OPTIONS);
+  rtnl_attr_u32(b, TCA_FW_CLASSID, classid);
+  rtnl_nest_end(b, nest);
+}
+
+int tc_setup(int fd, int ifindex, unsigned long long rate, int marks) {
+  struct rtnl_batch b;
+  struct tc_htb_glob glob = {.version = 3, .rate2quantum = 10, .defcls = TC_H_MIN(TC_DEFAULT)};
+
+  rtnl_batch_init(&b);
+  // A veth has no root qdisc to delete unless it is shaped already
+  tc_msg(&b, RTM_DELQDISC, 0, ifindex, 0, TC_H_ROOT, 0, NULL);
+  rtnl_allow(&b, ENOENT);
+  if (rate) {
+    tc_msg(&b, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, ifindex, TC_ROOT, TC_H_ROOT, 0, "htb");
+    struct rtattr *nest = rtnl_nest(&b, TCA_OPTIONS);
+    rtnl_attr(&b, TCA_HTB_INIT, &glob, sizeof(glob));
+    rtnl_nest_end(&b, nest);
+    htb_class(&b, ifindex, TC_RATE, TC_ROOT, rate, rate, 0);
+    for (int i = 0; i < TC_CLASSES; i++) {
+      unsigned long long share = rate * classes[i].share / 10;
+      htb_class(&b, ifindex, classes[i].classid, TC_RATE, share ? share : 1, rate, classes[i].prio);
+      // Without fq_codel the class keeps the default pfifo
+      tc_msg(&b, RTM_NEWQDISC, NLM_F_CREATE | NLM_F_EXCL, ifindex,
+             TC_H_MIN(classes[i].classid) << 16, classes[i].classid, 0, "fq_codel");
+      rtnl_allow(&b, ENOENT);
+    }
+    for (size_t i = 0; i < sizeof(tos_filters) / sizeof(tos_filters[0]); i++) {
+      u32_filter(&b, ifindex, tos_filters[i].proto == ETH_P_IP ? 1 : 2, tos_filters[i].proto,
+                 tos_filters[i].mask, tos_filters[i].val, tos_filters[i].classid);
+    }
+    if (marks) {
+      fw_filter(&b, ifindex, TC_MARK_INTERACTIVE, classes[0].classid);
+      fw_filter(&b, ifindex, TC_MARK_BULK, classes[TC_CLASSES - 1].classid);
+    }
+  }
+  return rtnl_batch_send(fd, &b);
+}
+
+// Shape one side of the veth, fd is the socket in the namespace of the link
+static void shape(int fd, const char *dev, unsigned long long rate, int marks, const char *ns_path) {
+  int idx = rtnl_link_index(fd, dev);
+  int err = idx == -1 ? errno : tc_setup(fd, idx, rate, marks);
+  if (err)
+    WARN("Can't set up shaping of %s for %s, errno=%d", dev, ns_path, err);
+}
+
+// Whether ns is of a profile with a class in p before index n
+static int marked(const struct runns_profiles *p, size_t n, const struct runns_netns *ns) {
+  for (size_t i = 0; p && i < n && i < p->sz; i++) {
+    if (p->v[i].netns == ns && p->v[i].tc_mark)
+      return 1;
+  }
+  return 0;
+}
+
+// Set up the marks in the namespaces with a class in the profiles or in old,
+// each of them once
+static void marks_sync(const struct runns_profiles *old) {
+  const struct runns_profiles *all[2] = {&profiles, old};
+
+  for (int k = 0; k < 2; k++) {
+    for (size_t i = 0; all[k] && i < all[k]->sz; i++) {
+      const struct runns_profile *p = &all[k]->v[i];
+      if (!p->tc_mark || marked(all[k], i, p->netns) || (k && marked(&profiles, profiles.sz, p->netns)))
+        continue;
+      int err = nat_marks(p->netns, &profiles);
+      if (err)
+        WARN("Can't set up the classes in %s, errno=%d", p->netns->path, err);
+    }
+  }
+}
+
+void tc_sync(const struct runns_profiles *old) {
+  for (size_t i = 0; i < profiles.sz; i++) {
+    const struct runns_profile *p = &profiles.v[i];
+    if (!*p->veth.host)
+      continue;
+    const struct runns_profile *o = old ? profile_find_in((struct runns_profiles *)old, p->name) : NULL;
+    int same = o && o->netns == p->netns &&
+               !strcmp(o->veth.host, p->veth.host) && !strcmp(o->veth.peer, p->veth.peer);
+    int egress = !same || o->veth.egress_rate != p->veth.egress_rate;
+    int ingress = !same || o->veth.ingress_rate != p->veth.ingress_rate;
+    if (!egress && !ingress)
+      continue;
+
+    int host_fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    int ns_fd = netns_socket(p->netns, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (host_fd == -1 || ns_fd == -1) {
+      WARN("Can't open netlink to shape %s, errno=%d", p->netns->path, errno);
+    }
+    else {
+      // Egress of the namespace leaves through the peer, ingress through the
+      // host side. The mark of a job's socket doesn't get to the host side.
+      if (egress)
+        shape(ns_fd, p->veth.peer, p->veth.egress_rate, 1, p->netns->path);
+      if (ingress)
+        shape(host_fd, p->veth.host, p->veth.ingress_rate, 0, p->netns->path);
+    }
+    if (host_fd != -1)
+      close(host_fd);
+    if (ns_fd != -1)
+      close(ns_fd);
+  }
+  marks_sync(old);
+}
+
+struct stats_ctx {
+  FILE *f;
+  struct runns_qos_record rec;
+  unsigned int n;
+};
+
+static void class_stats(const struct nlmsghdr *h, void *arg) {
+  struct stats_ctx *ctx = (struct stats_ctx *)arg;
+  const struct tcmsg *tcm = (const struct tcmsg *)NLMSG_DATA(h);
+  struct runns_qos_record rec = ctx->rec;
+
+  if (h->nlmsg_type != RTM_NEWTCLASS)
+    return;
+  if (tcm->tcm_handle == TC_RATE)
+    strcpy(rec.cls, "total");
+  for (int i = 0; i < TC_CLASSES; i++) {
+    if (tcm->tcm_handle == classes[i].classid)
+      strcpy(rec.cls, classes[i].name);
+  }
+  if (!*rec.cls)
+    return; // Flows of fq_codel
+
+  int len = h->nlmsg_len - NLMSG_LENGTH(sizeof(*tcm));
+  for (struct rtattr *a = (struct rtattr *)((char *)tcm + NLMSG_ALIGN(sizeof(*tcm)));
+       RTA_OK(a, len); a = RTA_NEXT(a, len)) {
+    if (a->rta_type != TCA_STATS2)
+      continue;
+    int slen = RTA_PAYLOAD(a);
+    for (struct rtattr *s = (struct rtattr *)RTA_DATA(a); RTA_OK(s, slen); s = RTA_NEXT(s, slen)) {
+      if (s->rta_type == TCA_STATS_BASIC && RTA_PAYLOAD(s) >= 12) {
+        uint32_t packets;
+        memcpy(&rec.bytes, RTA_DATA(s), sizeof(uint64_t));
+        memcpy(&packets, (char *)RTA_DATA(s) + 8, sizeof(packets));
+        rec.packets = packets;
+      }
+      else if (s->rta_type == TCA_STATS_QUEUE && RTA_PAYLOAD(s) >= sizeof(struct gnet_stats_queue)) {
+        struct gnet_stats_queue q;
+        memcpy(&q, RTA_DATA(s), sizeof(q));
+        rec.qlen = q.qlen;
+        rec.backlog = q.backlog;
+        rec.drops = q.drops;
+        rec.overlimits = q.overlimits;
+      }
+    }
+  }
+  if (fwrite((void *)&rec, sizeof(rec), 1, ctx->f) == 1)
+    ++ctx->n;
+}
+
+static unsigned int dump_classes(int fd, const char *dev, struct stats_ctx *ctx) {
+  struct rtnl_batch b;
+
+  int idx = rtnl_link_index(fd, dev);
+  if (idx == -1)
+    return 0;
+  ctx->n = 0;
+  snprintf(ctx->rec.dev, sizeof(ctx->rec.dev), "%s", dev);
+  rtnl_batch_init(&b);
+  tc_msg(&b, RTM_GETTCLASS, NLM_F_DUMP, idx, 0, 0, 0, NULL);
+  rtnl_replies(&b, class_stats, ctx);
+  int err = rtnl_batch_send(fd, &b);
+  if (err)
+    WARN("Can't get classes of %s, errno=%d", dev, err);
+  return ctx->n;
+}
+
+unsigned int tc_stats(const struct runns_netns *ns, const struct rtnl_veth *v, FILE *f) {
+  struct stats_ctx ctx = {.f = f};
+  unsigned int n = 0;
+
+  snprintf(ctx.rec.netns, sizeof(ctx.rec.netns), "%s", ns->path);
+  if (v->egress_rate) {
+    int fd = netns_socket(ns, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd != -1) {
+      ctx.rec.egress = 1;
+      ctx.rec.rate = v->egress_rate;
+      n += dump_classes(fd, v->peer, &ctx);
+      close(fd);
+    }
+  }
+  if (v->ingress_rate) {
+    int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if (fd != -1) {
+      ctx.rec.egress = 0;
+      ctx.rec.rate = v->ingress_rate;
+      n += dump_classes(fd, v->host, &ctx);
+      close(fd);
+    }
+  }
+  return n;
+}
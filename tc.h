@@ -0,0 +1,53 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+
+#ifndef TC_H
+#define TC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+struct runns_netns;
+struct runns_profiles;
+struct rtnl_veth;
+
+// Shaping of a veth side, all of it is replaced on every sync:
+//   1:    htb, unclassified traffic goes to 1:20
+//   1:1   rate = ceil = the profile rate
+//   1:10  interactive, 1/2 of the rate guaranteed, the first to borrow
+//   1:20  default, 3/10 of the rate
+//   1:30  bulk, 1/5 of the rate, the last to borrow
+// Each of the classes borrows up to the full rate and has fq_codel (if the
+// kernel has it) as the queue. The class is picked by DSCP/TOS of the packet
+// (IP_TOS, IPV6_TCLASS) or, on egress only, by the socket mark (SO_MARK,
+// nftables), the mark is cleared when a packet crosses the veth:
+//   interactive: lowdelay TOS, EF, AF21 or mark TC_MARK_INTERACTIVE
+//   bulk: throughput TOS, CS1 or mark TC_MARK_BULK
+// The class of a profile is set as the mark of its jobs' packets by
+// nat_marks() in their namespace.
+#define TC_MARK_INTERACTIVE 1
+#define TC_MARK_BULK 2
+
+// Parse a rate in tc units (bit, kbit, mbit, gbit, bps, kbps, mbps, gbps)
+// into bytes per second. Returns 0 on success.
+int tc_parse_rate(const char *s, unsigned long long *rate);
+// Parse a class name (interactive, default, bulk) into its mark, 0 for the
+// default class. Returns 0 on success.
+int tc_parse_class(const char *s, uint32_t *mark);
+// Shape the interface ifindex on the rtnetlink socket fd, a zero rate removes
+// the shaping. The marks are matched if marks is set. Returns 0 or errno.
+int tc_setup(int fd, int ifindex, unsigned long long rate, int marks);
+// Shape the veth pairs of the loaded profiles. Only the sides which are new
+// or have another rate than in old are touched, all of them if old is NULL.
+// The marks of the classes are set up again in the namespaces of the
+// profiles with a class in either.
+void tc_sync(const struct runns_profiles *old);
+// Write the class statistics of the veth v into ns to f as runns_qos_record.
+// Returns the number of the records.
+unsigned int tc_stats(const struct runns_netns *ns, const struct rtnl_veth *v, FILE *f);
+
+#endif
@@ -0,0 +1,62 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "acct.h"
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(acct_proc, parse_stat) {
+  unsigned long long ticks, rss;
+  // comm with a space and a parenthesis
+  const char *stat = "1234 (sleep (1) x) S 1 1234 1234 0 -1 4194304 100 0 0 0 "
+                     "25 17 0 0 20 0 1 0 5000 8564736 330 18446744073709551615";
+
+  REQUIRE(acct_parse_stat(stat, &ticks, &rss) == 0);
+  CHECK(ticks == 42);
+  CHECK(rss == 330);
+  CHECK(acct_parse_stat("1234 (sleep S 1", &ticks, &rss) != 0);
+}
+
+TEST(acct_proc, parse_io) {
+  unsigned long long rd, wr;
+  const char *io = "rchar: 100\nwchar: 200\nsyscr: 3\nsyscw: 4\n"
+                   "read_bytes: 4096\nwrite_bytes: 8192\ncancelled_write_bytes: 0\n";
+
+  REQUIRE(acct_parse_io(io, &rd, &wr) == 0);
+  CHECK(rd == 4096);
+  CHECK(wr == 8192);
+  CHECK(acct_parse_io("rchar: 100\n", &rd, &wr) != 0);
+}
+
+TEST(acct_proc, parse_netdev) {
+  char dev[] =
+    "Inter-|   Receive                                                |  Transmit\n"
+    " face |bytes    packets errs drop fifo frame compressed multicast|bytes    packets errs drop fifo colls carrier compressed\n"
+    "    lo:    1556      24    0    0    0     0          0         0     1556      24    0    0    0     0       0          0\n"
+    "  veth0: 9000000 7000 1 2 0 0 0 5 3000000 4000 3 4 0 0 0 0\n";
+  struct runns_if_stats *ifs = NULL;
+  size_t sz = 0;
+
+  FILE *f = fmemopen(dev, strlen(dev), "r");
+  REQUIRE(f != NULL);
+  REQUIRE(acct_parse_netdev(f, &ifs, &sz) == 0);
+  fclose(f);
+  REQUIRE(sz == 2);
+  CHECK(!strcmp(ifs[0].name, "lo"));
+  CHECK(ifs[0].rx_bytes == 1556 && ifs[0].tx_packets == 24);
+  CHECK(!strcmp(ifs[1].name, "veth0"));
+  CHECK(ifs[1].rx_bytes == 9000000 && ifs[1].rx_packets == 7000);
+  CHECK(ifs[1].rx_errs == 1 && ifs[1].rx_drop == 2);
+  CHECK(ifs[1].tx_bytes == 3000000 && ifs[1].tx_packets == 4000);
+  CHECK(ifs[1].tx_errs == 3 && ifs[1].tx_drop == 4);
+  free(ifs);
+}
@@ -0,0 +1,53 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "creds.h"
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(creds_cache, state) {
+  struct creds_entry e = {0};
+
+  CHECK(creds_state(&e, 1000) == CREDS_MISS);
+  e.valid = 1;
+  e.c.found = 1;
+  e.resolved = 1000;
+  CHECK(creds_state(&e, 1000) == CREDS_FRESH);
+  CHECK(creds_state(&e, 1000 + CREDS_TTL - 1) == CREDS_FRESH);
+  CHECK(creds_state(&e, 1000 + CREDS_TTL) == CREDS_STALE);
+  CHECK(creds_state(&e, 1000 + CREDS_MAX_STALE) == CREDS_MISS);
+
+  // An unknown user is never used stale
+  e.c.found = 0;
+  CHECK(creds_state(&e, 1000 + CREDS_NEG_TTL - 1) == CREDS_FRESH);
+  CHECK(creds_state(&e, 1000 + CREDS_NEG_TTL) == CREDS_MISS);
+}
+
+TEST(creds_cache, resolve) {
+  static struct creds c;
+
+  REQUIRE(creds_resolve(0, &c) == 0);
+  CHECK(c.found);
+  CHECK(c.uid == 0);
+  CHECK(c.gid == 0);
+  CHECK(!strcmp(c.name, "root"));
+  CHECK(*c.home == '/');
+  REQUIRE(c.ngroups > 0);
+  int primary = 0;
+  for (int i = 0; i < c.ngroups; i++)
+    primary |= c.groups[i] == c.gid;
+  CHECK(primary);
+
+  REQUIRE(creds_resolve(3999999999u, &c) == 0);
+  CHECK(!c.found);
+  CHECK(c.uid == 3999999999u);
+}
@@ -0,0 +1,94 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "netns.h"
+#include "dns.h"
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+// Query for Example.COM IN A
+static const uint8_t query[] = {
+  0x12, 0x34, 0x01, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  7, 'E', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'C', 'O', 'M', 0,
+  0x00, 0x01, 0x00, 0x01
+};
+
+// Response with two A records (TTL 300 and 60), the name is compressed
+static const uint8_t answer[] = {
+  0x12, 0x34, 0x81, 0x80, 0x00, 0x01, 0x00, 0x02, 0x00, 0x00, 0x00, 0x00,
+  7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+  0x00, 0x01, 0x00, 0x01,
+  0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c, 0x00, 0x04, 1, 2, 3, 4,
+  0xc0, 0x0c, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x00, 0x3c, 0x00, 0x04, 1, 2, 3, 5
+};
+
+// NXDOMAIN with SOA in the authority section (TTL 900, MINIMUM 120)
+static const uint8_t nxdomain[] = {
+  0x12, 0x34, 0x81, 0x83, 0x00, 0x01, 0x00, 0x00, 0x00, 0x01, 0x00, 0x00,
+  7, 'e', 'x', 'a', 'm', 'p', 'l', 'e', 3, 'c', 'o', 'm', 0,
+  0x00, 0x01, 0x00, 0x01,
+  0xc0, 0x14, 0x00, 0x06, 0x00, 0x01, 0x00, 0x00, 0x03, 0x84, 0x00, 0x16,
+  0, 0,                                     // mname, rname
+  0, 0, 0, 1, 0, 0, 0, 2, 0, 0, 0, 3, 0, 0, 0, 4, 0, 0, 0, 120
+};
+
+TEST(dns_wire, parse_question) {
+  uint8_t key[DNS_KEY_MAX];
+  size_t key_len, end;
+
+  REQUIRE(dns_parse_question(query, sizeof(query), key, &key_len, &end) == 0);
+  CHECK(end == sizeof(query));
+  CHECK(key_len == 13 + 4 + 1);
+  CHECK(!memcmp(key, "\7example\3com", 13));
+
+  // Same key for the response in lower case
+  uint8_t key2[DNS_KEY_MAX];
+  size_t key2_len;
+  REQUIRE(dns_parse_question(answer, sizeof(answer), key2, &key2_len, NULL) == 0);
+  CHECK(key_len == key2_len && !memcmp(key, key2, key_len));
+
+  // Truncated question
+  CHECK(dns_parse_question(query, sizeof(query) - 2, key, &key_len, NULL) != 0);
+}
+
+TEST(dns_wire, cache_ttl) {
+  uint32_t ttl;
+  int negative;
+
+  REQUIRE(dns_cache_ttl(answer, sizeof(answer), &ttl, &negative) == 0);
+  CHECK(ttl == 60);
+  CHECK(!negative);
+
+  REQUIRE(dns_cache_ttl(nxdomain, sizeof(nxdomain), &ttl, &negative) == 0);
+  CHECK(ttl == 120);
+  CHECK(negative);
+
+  // Queries and truncated responses are not cached
+  CHECK(dns_cache_ttl(query, sizeof(query), &ttl, &negative) != 0);
+  uint8_t tc[sizeof(answer)];
+  memcpy(tc, answer, sizeof(answer));
+  tc[2] |= 0x02;
+  CHECK(dns_cache_ttl(tc, sizeof(tc), &ttl, &negative) != 0);
+}
+
+TEST(dns_wire, age_ttls) {
+  uint8_t msg[sizeof(answer)];
+  uint32_t ttl;
+  int negative;
+
+  memcpy(msg, answer, sizeof(answer));
+  REQUIRE(dns_age_ttls(msg, sizeof(msg), 100) == 0);
+  REQUIRE(dns_cache_ttl(msg, sizeof(msg), &ttl, &negative) == 0);
+  // 60 is expired and clamped to 0
+  CHECK(ttl == 0);
+  CHECK(msg[37] == 0x00 && msg[38] == 0xc8);
+}
@@ -0,0 +1,72 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "netns.h"
+#include "fwd.h"
+#include <arpa/inet.h>
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+static struct runns_fwd_rule rule(const char *ip, in_port_t port, L4_PROTOCOLS proto) {
+  struct runns_fwd_rule r = {.port = port, .proto = proto};
+  r.family = strchr(ip, ':') ? AF_INET6 : AF_INET;
+  inet_pton(r.family, ip, r.ip);
+  return r;
+}
+
+TEST(fwd, add_lookup_del) {
+  struct fwd_table t = {0};
+  char ip[INET_ADDRSTRLEN];
+
+  // Enough rules to grow the table a few times
+  for (int i = 0; i < 5000; i++) {
+    snprintf(ip, sizeof(ip), "10.0.%d.%d", i / 256, i % 256);
+    struct runns_fwd_rule r = rule(ip, 80, L4_PROTOCOL_TCP);
+    REQUIRE(fwd_add(&t, &r, "/proc/self/ns/net", 0) == 0);
+  }
+  CHECK(t.sz == 5000);
+  CHECK(t.nbuckets >= t.sz);
+  // All rules share one namespace
+  CHECK(netns_head && !netns_head->pnext && netns_head->refs == 5000);
+
+  struct runns_fwd_rule r = rule("10.0.19.135", 80, L4_PROTOCOL_TCP);
+  CHECK(fwd_lookup(&t, &r) != NULL);
+  r.proto = L4_PROTOCOL_UDP;
+  CHECK(fwd_lookup(&t, &r) == NULL);
+
+  // Only the owner or root removes a rule
+  r = rule("192.168.0.1", 80, L4_PROTOCOL_TCP);
+  REQUIRE(fwd_add(&t, &r, "/proc/self/ns/net", 1000) == 0);
+  CHECK(fwd_del(&t, &r, 1001) != 0);
+  CHECK(fwd_del(&t, &r, 1000) == 0);
+  CHECK(fwd_lookup(&t, &r) == NULL);
+  CHECK(t.sz == 5000);
+
+  fwd_free(&t);
+  CHECK(netns_head == NULL);
+}
+
+TEST(fwd, wildcard) {
+  struct fwd_table t = {0};
+  struct runns_fwd_rule any = rule("::", 443, L4_PROTOCOL_TCP);
+  struct runns_fwd_rule r = rule("2001:db8::1", 443, L4_PROTOCOL_TCP);
+
+  REQUIRE(fwd_add(&t, &any, "/proc/self/ns/net", 0) == 0);
+  struct fwd_rule *e = fwd_lookup(&t, &r);
+  REQUIRE(e != NULL);
+  CHECK(e->family == AF_INET6);
+
+  int fd = fwd_socket(e);
+  CHECK(fd != -1);
+  close(fd);
+  fwd_free(&t);
+}
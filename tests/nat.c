@@ -0,0 +1,105 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "nat.h"
+
+#include <arpa/inet.h>
+#include <linux/netfilter/nf_tables.h>
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(nat_net, subnet4) {
+  struct rtnl_addr a;
+  struct nat_subnet s;
+  unsigned char start[4] = {10, 200, 1, 0}, end[4] = {10, 200, 2, 0};
+
+  REQUIRE(rtnl_parse_addr("10.200.1.130/24", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s) == 0);
+  CHECK(s.family == AF_INET);
+  CHECK(!memcmp(s.start, start, 4));
+  CHECK(!memcmp(s.end, end, 4));
+  CHECK(!s.end_wraps);
+
+  // Not on a byte boundary
+  unsigned char start30[4] = {10, 200, 1, 128}, end30[4] = {10, 200, 1, 132};
+  REQUIRE(rtnl_parse_addr("10.200.1.130/30", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s) == 0);
+  CHECK(!memcmp(s.start, start30, 4));
+  CHECK(!memcmp(s.end, end30, 4));
+
+  REQUIRE(rtnl_parse_addr("255.255.255.254/31", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s) == 0);
+  CHECK(s.end_wraps);
+
+  REQUIRE(rtnl_parse_addr("10.0.0.1/0", &a) == 0);
+  CHECK(nat_subnet(&a, &s) != 0);
+}
+
+TEST(nat_net, subnet6) {
+  struct rtnl_addr a;
+  struct nat_subnet s, e;
+
+  REQUIRE(rtnl_parse_addr("fd00:1:2:3::2/64", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s) == 0);
+  CHECK(s.family == AF_INET6);
+  inet_pton(AF_INET6, "fd00:1:2:3::", e.start);
+  inet_pton(AF_INET6, "fd00:1:2:4::", e.end);
+  CHECK(!memcmp(s.start, e.start, 16));
+  CHECK(!memcmp(s.end, e.end, 16));
+}
+
+TEST(nat_net, covers) {
+  struct rtnl_addr a;
+  struct nat_subnet s24, s30, other, top, s6;
+
+  REQUIRE(rtnl_parse_addr("10.200.1.1/24", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s24) == 0);
+  REQUIRE(rtnl_parse_addr("10.200.1.130/30", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s30) == 0);
+  REQUIRE(rtnl_parse_addr("10.200.2.1/30", &a) == 0);
+  REQUIRE(nat_subnet(&a, &other) == 0);
+  REQUIRE(rtnl_parse_addr("255.255.255.254/31", &a) == 0);
+  REQUIRE(nat_subnet(&a, &top) == 0);
+  REQUIRE(rtnl_parse_addr("::ffff:10.200.1.1/120", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s6) == 0);
+
+  CHECK(nat_covers(&s24, &s30));
+  CHECK(nat_covers(&s24, &s24));
+  CHECK(!nat_covers(&s30, &s24));
+  CHECK(!nat_covers(&s24, &other));
+  CHECK(!nat_covers(&s24, &top));
+  CHECK(nat_covers(&top, &top));
+  CHECK(!nat_covers(&s24, &s6));
+}
+
+TEST(nat_net, elements) {
+  struct rtnl_addr a;
+  struct nat_subnet s;
+  struct rtnl_batch b;
+
+  REQUIRE(rtnl_parse_addr("10.200.1.2/30", &a) == 0);
+  REQUIRE(nat_subnet(&a, &s) == 0);
+  rtnl_batch_init(&b);
+  REQUIRE(rtnl_msg(&b, NFT_MSG_NEWSETELEM, 0, NULL, 0) != NULL);
+  nat_elem(&b, &s);
+
+  // Start: elem(key(value)), end: elem(key(value), flags)
+  struct rtattr *start = (struct rtattr *)(b.buf + NLMSG_HDRLEN);
+  CHECK((start->rta_type & ~NLA_F_NESTED) == NFTA_LIST_ELEM);
+  CHECK(start->rta_len == RTA_LENGTH(RTA_LENGTH(RTA_LENGTH(4))));
+  struct rtattr *end = (struct rtattr *)((char *)start + RTA_ALIGN(start->rta_len));
+  CHECK(end->rta_len == RTA_LENGTH(RTA_LENGTH(RTA_LENGTH(4)) + RTA_LENGTH(4)));
+  struct rtattr *flags = (struct rtattr *)((char *)end + RTA_LENGTH(RTA_LENGTH(RTA_LENGTH(4))));
+  CHECK(flags->rta_type == NFTA_SET_ELEM_FLAGS);
+  CHECK(*(uint32_t *)RTA_DATA(flags) == htonl(NFT_SET_ELEM_INTERVAL_END));
+  CHECK(b.len == NLMSG_HDRLEN + start->rta_len + end->rta_len);
+}
@@ -0,0 +1,70 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "placement.h"
+#include <linux/mempolicy.h>
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(placement, parse_cpulist) {
+  cpu_set_t set;
+  REQUIRE(parse_cpulist("0-3,8", &set) == 0);
+  CHECK(CPU_COUNT(&set) == 5);
+  CHECK(CPU_ISSET(8, &set));
+  // As read from sysfs
+  REQUIRE(parse_cpulist("0-1,4\n", &set) == 0);
+  CHECK(CPU_COUNT(&set) == 3);
+  CHECK(parse_cpulist("3-1", &set) != 0);
+  CHECK(parse_cpulist("foo", &set) != 0);
+}
+
+TEST(placement, mempolicy) {
+  struct placement p = {0};
+
+  REQUIRE(placement_set_mempolicy(&p, "interleave:0,2") == 0);
+  CHECK(p.has_mpol && p.mpol_mode == MPOL_INTERLEAVE);
+  CHECK(p.nodes[0] == 5);
+  CHECK(placement_finish(&p) == 0);
+
+  CHECK(placement_set_mempolicy(&p, "local:1") != 0);
+  CHECK(placement_set_mempolicy(&p, "nearest") != 0);
+
+  // Nodes come from auto only
+  memset(&p, 0, sizeof(p));
+  REQUIRE(placement_set_mempolicy(&p, "bind") == 0);
+  CHECK(placement_finish(&p) != 0);
+  p.has_node = 1;
+  p.node = 1;
+  CHECK(placement_finish(&p) == 0);
+  CHECK(p.nodes[0] == 2);
+}
+
+TEST(placement, cpus) {
+  struct placement p = {0};
+
+  REQUIRE(placement_set_cpus(&p, "0") == 0);
+  CHECK(p.has_cpus && CPU_ISSET(0, &p.cpus));
+  // The loopback has no device
+  CHECK(placement_set_cpus(&p, "auto:lo") != 0);
+  CHECK(placement_set_cpus(&p, "auto:") != 0);
+  CHECK(placement_apply(&p) == 0);
+
+  // "auto" alone waits for the uplink
+  memset(&p, 0, sizeof(p));
+  REQUIRE(placement_set_cpus(&p, "auto") == 0);
+  CHECK(p.cpus_auto && !p.has_cpus);
+  strcpy(p.uplink, "lo");
+  CHECK(placement_finish(&p) != 0);
+  REQUIRE(placement_set_cpus(&p, "1") == 0);
+  CHECK(!p.cpus_auto);
+  CHECK(placement_finish(&p) == 0);
+}
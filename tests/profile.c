@@ -0,0 +1,59 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "netns.h"
+#include "profile.h"
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+static void write_config(const char *path, const char *str) {
+  FILE *f = fopen(path, "w");
+  fputs(str, f);
+  fclose(f);
+}
+
+TEST(profile, load) {
+  char path[] = "/tmp/runns_profileXXXXXX";
+  close(mkstemp(path));
+  write_config(path,
+    "# comment\n"
+    "[vpn]\n"
+    "netns = /proc/self/ns/net\n"
+    "env = PATH=/bin\n"
+    "program = /bin/sh\n"
+    "program = /bin/true\n"
+    "uids = 1000, 1001\n"
+    "\n"
+    "[other]\n"
+    "netns = /proc/self/ns/net\n"
+    "program = /bin/true\n");
+
+  struct runns_profiles p;
+  REQUIRE(profiles_load(path, &p) == 0);
+  CHECK(p.sz == 2);
+  struct runns_profile *vpn = profile_find_in(&p, "vpn");
+  REQUIRE(vpn != NULL);
+  CHECK(vpn->netns == profile_find_in(&p, "other")->netns, "netns is not deduplicated");
+  CHECK(strcmp(vpn->envs[0], "PATH=/bin") == 0 && vpn->envs[1] == NULL);
+  CHECK(profile_program(vpn, NULL) == &vpn->progs[0]);
+  CHECK(profile_program(vpn, "/bin/true") == &vpn->progs[1]);
+  CHECK(profile_program(vpn, "/bin/ls") == NULL);
+  CHECK(profile_allowed(vpn, 1001, NULL, 0));
+  CHECK(!profile_allowed(vpn, 1002, NULL, 0));
+  profiles_free(&p);
+  CHECK(netns_head == NULL, "netns is not released");
+
+  // Profile without a program
+  write_config(path, "[broken]\nnetns = /proc/self/ns/net\n");
+  CHECK(profiles_load(path, &p) != 0);
+  unlink(path);
+}
@@ -0,0 +1,111 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "netns.h"
+#include "profile.h"
+#include "proxy.h"
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(proxy_parse, socks) {
+  struct proxy_dest d;
+  int noauth, rep;
+
+  const uint8_t hello[] = {5, 2, 2, 0};
+  CHECK(proxy_socks_hello(hello, 3, &noauth) == 0);
+  CHECK(proxy_socks_hello(hello, sizeof(hello), &noauth) == 4);
+  CHECK(noauth);
+  const uint8_t hello_auth[] = {5, 1, 2};
+  CHECK(proxy_socks_hello(hello_auth, sizeof(hello_auth), &noauth) == 3);
+  CHECK(!noauth);
+  const uint8_t socks4[] = {4, 1, 0, 80};
+  CHECK(proxy_socks_hello(socks4, sizeof(socks4), &noauth) == -1);
+
+  const uint8_t v4[] = {5, 1, 0, 1, 10, 0, 0, 1, 0x01, 0xbb};
+  CHECK(proxy_socks_request(v4, sizeof(v4) - 1, &d, &rep) == 0);
+  REQUIRE(proxy_socks_request(v4, sizeof(v4), &d, &rep) == sizeof(v4));
+  CHECK(!strcmp(d.host, "10.0.0.1"));
+  CHECK(d.port == 443);
+
+  const uint8_t name[] = {5, 1, 0, 3, 11, 'e', 'x', 'a', 'm', 'p', 'l', 'e', '.', 'o', 'r', 'g', 0, 80};
+  REQUIRE(proxy_socks_request(name, sizeof(name), &d, &rep) == sizeof(name));
+  CHECK(!strcmp(d.host, "example.org"));
+  CHECK(d.port == 80);
+
+  uint8_t v6[22] = {5, 1, 0, 4};
+  v6[19] = 1;
+  v6[21] = 22;
+  REQUIRE(proxy_socks_request(v6, sizeof(v6), &d, &rep) == sizeof(v6));
+  CHECK(!strcmp(d.host, "::1"));
+  CHECK(d.port == 22);
+
+  // BIND and UDP ASSOCIATE are not supported
+  const uint8_t bind[] = {5, 2, 0, 1, 10, 0, 0, 1, 0, 80};
+  CHECK(proxy_socks_request(bind, sizeof(bind), &d, &rep) == -1);
+  CHECK(rep == PROXY_SOCKS_BAD_COMMAND);
+  const uint8_t atyp[] = {5, 1, 0, 9, 0, 0};
+  CHECK(proxy_socks_request(atyp, sizeof(atyp), &d, &rep) == -1);
+  CHECK(rep == PROXY_SOCKS_BAD_ATYP);
+}
+
+TEST(proxy_parse, http) {
+  struct proxy_dest d;
+  int status;
+
+  const char *req = "CONNECT example.org:443 HTTP/1.1\r\nHost: example.org:443\r\n\r\nearly";
+  CHECK(proxy_http_request(req, strlen(req) - 7, &d, &status) == 0);
+  REQUIRE(proxy_http_request(req, strlen(req), &d, &status) == (int)strlen(req) - 5);
+  CHECK(!strcmp(d.host, "example.org"));
+  CHECK(d.port == 443);
+
+  req = "CONNECT [2001:db8::1]:8443 HTTP/1.0\r\n\r\n";
+  REQUIRE(proxy_http_request(req, strlen(req), &d, &status) == (int)strlen(req));
+  CHECK(!strcmp(d.host, "2001:db8::1"));
+  CHECK(d.port == 8443);
+
+  req = "GET http://example.org/ HTTP/1.1\r\n\r\n";
+  CHECK(proxy_http_request(req, strlen(req), &d, &status) == -1);
+  CHECK(status == 405);
+  req = "CONNECT example.org HTTP/1.1\r\n\r\n";
+  CHECK(proxy_http_request(req, strlen(req), &d, &status) == -1);
+  CHECK(status == 400);
+  req = "CONNECT example.org:65536 HTTP/1.1\r\n\r\n";
+  CHECK(proxy_http_request(req, strlen(req), &d, &status) == -1);
+}
+
+TEST(proxy_parse, profile) {
+  char path[] = "/tmp/runns_proxyXXXXXX";
+  int fd = mkstemp(path);
+  const char *conf =
+    "[v4]\nnetns = /proc/self/ns/net\nprogram = /bin/true\nproxy = 127.0.0.1:1080\n"
+    "[v6]\nnetns = /proc/self/ns/net\nprogram = /bin/true\nproxy = [::1]:3128\n";
+  REQUIRE(write(fd, conf, strlen(conf)) == (ssize_t)strlen(conf));
+  close(fd);
+
+  struct runns_profiles p;
+  REQUIRE(profiles_load(path, &p) == 0);
+  const struct sockaddr_in *in = (const struct sockaddr_in *)&profile_find_in(&p, "v4")->proxy;
+  CHECK(in->sin_family == AF_INET);
+  CHECK(ntohs(in->sin_port) == 1080);
+  CHECK(in->sin_addr.s_addr == htonl(INADDR_LOOPBACK));
+  const struct sockaddr_in6 *in6 = (const struct sockaddr_in6 *)&profile_find_in(&p, "v6")->proxy;
+  CHECK(in6->sin6_family == AF_INET6);
+  CHECK(ntohs(in6->sin6_port) == 3128);
+  profiles_free(&p);
+
+  fd = open(path, O_WRONLY | O_TRUNC);
+  conf = "[bad]\nnetns = /proc/self/ns/net\nprogram = /bin/true\nproxy = localhost:1080\n";
+  REQUIRE(write(fd, conf, strlen(conf)) == (ssize_t)strlen(conf));
+  close(fd);
+  CHECK(profiles_load(path, &p) != 0);
+  unlink(path);
+}
@@ -0,0 +1,91 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "registry.h"
+#include <sys/wait.h>
+#include <stddef.h>
+#include <sys/stat.h>
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+static char dir[] = "/tmp/runns_registry_XXXXXX";
+
+// Write a field of the registry file behind its back
+static int patch(off_t off, const void *buf, size_t sz) {
+  char path[64];
+  snprintf(path, sizeof(path), "%s/" REGISTRY_FILE, dir);
+  int fd = open(path, O_WRONLY);
+  if (fd == -1)
+    return -1;
+  ssize_t ret = pwrite(fd, buf, sz, off);
+  close(fd);
+  return ret == (ssize_t)sz ? 0 : -1;
+}
+
+TEST(job_registry, recover) {
+  struct runns_child childs[MAX_CHILDS];
+  struct runns_child self = {.uid = 1000, .pid = getpid(), .req_id = 7, .ns_ino = 42};
+
+  REQUIRE(mkdtemp(dir) != NULL);
+  REQUIRE(registry_open(dir) == 0);
+  int slot = registry_add(&self);
+  REQUIRE(slot == 0);
+
+  // An exited process is dropped
+  pid_t pid = fork();
+  if (!pid)
+    pause();
+  struct runns_child gone = {.pid = pid};
+  REQUIRE(registry_add(&gone) == 1);
+  kill(pid, SIGKILL);
+  waitpid(pid, NULL, 0);
+
+  registry_close(0);
+  REQUIRE(registry_open(dir) == 0);
+  REQUIRE(registry_recover(childs, MAX_CHILDS) == 1);
+  CHECK(childs[0].pid == getpid());
+  CHECK(childs[0].uid == 1000 && childs[0].req_id == 7 && childs[0].ns_ino == 42);
+  CHECK(childs[0].slot == 0 && childs[0].adopted && childs[0].wait_fd == -1);
+  if (childs[0].pidfd != -1)
+    close(childs[0].pidfd);
+  registry_close(0);
+
+  // A torn record is ignored
+  uint32_t seq = 3;
+  REQUIRE(patch(sizeof(struct registry_header), &seq, sizeof(seq)) == 0);
+  REQUIRE(registry_open(dir) == 0);
+  CHECK(registry_recover(childs, MAX_CHILDS) == 0);
+
+  // A registry of another version is reset
+  CHECK(registry_add(&self) == 0);
+  registry_close(0);
+  uint32_t version = REGISTRY_VERSION + 1;
+  REQUIRE(patch(offsetof(struct registry_header, version), &version, sizeof(version)) == 0);
+  REQUIRE(registry_open(dir) == 0);
+  CHECK(registry_recover(childs, MAX_CHILDS) == 0);
+
+  registry_close(1);
+
+  // A directory or a file others could write to is refused
+  REQUIRE(chmod(dir, 0770) == 0);
+  CHECK(registry_open(dir) == -1);
+  REQUIRE(chmod(dir, 0700) == 0);
+  REQUIRE(registry_open(dir) == 0);
+  registry_close(0);
+  char path[64];
+  snprintf(path, sizeof(path), "%s/" REGISTRY_FILE, dir);
+  REQUIRE(chmod(path, 0622) == 0);
+  CHECK(registry_open(dir) == -1);
+  CHECK(unlink(path) == 0);
+
+  CHECK(rmdir(dir) == 0);
+}
@@ -0,0 +1,87 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "rtnl.h"
+
+#include <arpa/inet.h>
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(rtnl_addr, parse) {
+  struct rtnl_addr a;
+  struct in_addr in;
+
+  REQUIRE(rtnl_parse_addr("10.200.1.1/30", &a) == 0);
+  inet_pton(AF_INET, "10.200.1.1", &in);
+  CHECK(a.family == AF_INET);
+  CHECK(a.prefix == 30);
+  CHECK(!memcmp(a.addr, &in, sizeof(in)));
+
+  REQUIRE(rtnl_parse_addr("fd00::2", &a) == 0);
+  CHECK(a.family == AF_INET6);
+  CHECK(a.prefix == 128);
+  REQUIRE(rtnl_parse_addr("10.0.0.1", &a) == 0);
+  CHECK(a.prefix == 32);
+
+  CHECK(rtnl_parse_addr("10.0.0.1/33", &a) != 0);
+  CHECK(rtnl_parse_addr("10.0.0.1/", &a) != 0);
+  CHECK(rtnl_parse_addr("10.0.0.1/24x", &a) != 0);
+  CHECK(rtnl_parse_addr("vpn0", &a) != 0);
+}
+
+TEST(rtnl_msgs, batch) {
+  struct rtnl_batch b;
+  struct ifinfomsg ifi = {.ifi_family = AF_UNSPEC};
+  int idx;
+
+  rtnl_batch_init(&b);
+  struct nlmsghdr *h1 = rtnl_msg(&b, RTM_NEWLINK, NLM_F_CREATE, &ifi, sizeof(ifi));
+  REQUIRE(h1 != NULL);
+  rtnl_allow(&b, EEXIST);
+  rtnl_attr_str(&b, IFLA_IFNAME, "vpn0");
+  struct rtattr *nest = rtnl_nest(&b, IFLA_LINKINFO);
+  rtnl_attr_str(&b, 1, "veth");
+  rtnl_nest_end(&b, nest);
+  struct nlmsghdr *h2 = rtnl_msg(&b, RTM_GETLINK, 0, &ifi, sizeof(ifi));
+  REQUIRE(h2 != NULL);
+  rtnl_ifindex(&b, &idx);
+
+  // header + ifinfomsg + "vpn0\0" (8) + nest of "veth\0" (4 + 12)
+  CHECK(h1->nlmsg_len == NLMSG_HDRLEN + sizeof(ifi) + 12 + 16);
+  CHECK(nest->rta_len == 16);
+  CHECK(h1->nlmsg_flags == (NLM_F_REQUEST | NLM_F_ACK | NLM_F_CREATE));
+  CHECK((char *)h2 == (char *)h1 + h1->nlmsg_len);
+  CHECK(b.len == h1->nlmsg_len + h2->nlmsg_len);
+  REQUIRE(b.n == 2);
+  CHECK(b.msgs[1].seq == h1->nlmsg_seq + 1);
+  CHECK(b.msgs[0].ok_errno == EEXIST && b.msgs[0].ifindex == NULL);
+  CHECK(b.msgs[1].ok_errno == 0 && b.msgs[1].ifindex == &idx);
+}
+
+TEST(rtnl_msgs, overflow) {
+  struct rtnl_batch b;
+  char big[RTNL_BATCH_SZ / 2];
+
+  rtnl_batch_init(&b);
+  for (int i = 0; i <= RTNL_BATCH_MAX; i++)
+    rtnl_msg(&b, RTM_GETLINK, 0, NULL, 0);
+  CHECK(b.overflow);
+  CHECK(rtnl_batch_send(-1, &b) == ENOBUFS);
+
+  memset(big, 0, sizeof(big));
+  rtnl_batch_init(&b);
+  rtnl_msg(&b, RTM_GETLINK, 0, NULL, 0);
+  rtnl_attr(&b, IFLA_IFNAME, big, sizeof(big));
+  CHECK(!b.overflow);
+  rtnl_attr(&b, IFLA_IFNAME, big, sizeof(big));
+  CHECK(b.overflow);
+}
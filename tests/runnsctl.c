@@ -12,10 +12,35 @@ TAU_MAIN();
 
 TEST(runnsctl, add_netns) {
     extern int netns_size;
-    extern struct netns *ns_head;
-    void add_netns(char *ip);
+    void add_netns(char *str, RUNNS_FWD_ACTIONS action);
 
-    const char ip[] = "127.0.0.1:1234:/foo/bar:TCP4";
-    add_netns(ip);
+    char ip[] = "127.0.0.1:1234:/foo/bar:TCP4";
+    add_netns(ip, RUNNS_FWD_ADD);
     REQUIRE(netns_size == 1);
 }
+
+TEST(runnsctl, parse_fwd_rule) {
+    int parse_fwd_rule(char *str, struct runns_fwd_rule *r, char **path);
+    struct runns_fwd_rule r;
+    char *path;
+
+    char v4[] = "10.0.0.1:53:/var/run/netns/a:udp4";
+    REQUIRE(parse_fwd_rule(v4, &r, &path) == 0);
+    CHECK(r.family == AF_INET && r.proto == L4_PROTOCOL_UDP && r.port == 53);
+    CHECK(strcmp(path, "/var/run/netns/a") == 0);
+
+    char v6[] = "[::1]:8080:/run/ns:b";
+    REQUIRE(parse_fwd_rule(v6, &r, &path) == 0);
+    CHECK(r.family == AF_INET6 && r.proto == L4_PROTOCOL_TCP && r.port == 8080);
+    CHECK(strcmp(path, "/run/ns:b") == 0);
+
+    // No netns to remove a rule
+    char del[] = "10.0.0.1:80:tcp4";
+    REQUIRE(parse_fwd_rule(del, &r, &path) == 0);
+    CHECK(*path == '\0');
+
+    char mismatch[] = "10.0.0.1:80:/ns:tcp6";
+    CHECK(parse_fwd_rule(mismatch, &r, &path) != 0);
+    char bad_port[] = "10.0.0.1:99999:/ns";
+    CHECK(parse_fwd_rule(bad_port, &r, &path) != 0);
+}
@@ -0,0 +1,50 @@
+/*
+ * vim:et:sw=2:
+ *
+ * Copyright (c) 2025 Nikita Ermakov <sh1r4s3@pm.me>
+ * SPDX-License-Identifier: MIT
+ */
+#include "runns.h"
+#include "tau/tau.h"
+#include "tc.h"
+
+TAU_MAIN();
+
+void stop_daemon(int flag) {
+  exit(EXIT_FAILURE);
+}
+
+TEST(tc_units, parse_rate) {
+  unsigned long long rate;
+
+  REQUIRE(tc_parse_rate("100mbit", &rate) == 0);
+  CHECK(rate == 12500000);
+  REQUIRE(tc_parse_rate("10gbit", &rate) == 0);
+  CHECK(rate == 1250000000);
+  REQUIRE(tc_parse_rate("40gbit", &rate) == 0);
+  CHECK(rate == 5000000000ULL);
+  REQUIRE(tc_parse_rate("512kbps", &rate) == 0);
+  CHECK(rate == 512000);
+  REQUIRE(tc_parse_rate("8bit", &rate) == 0);
+  CHECK(rate == 1);
+
+  CHECK(tc_parse_rate("4bit", &rate) != 0);
+  CHECK(tc_parse_rate("0mbit", &rate) != 0);
+  CHECK(tc_parse_rate("100", &rate) != 0);
+  CHECK(tc_parse_rate("100 mbit", &rate) != 0);
+  CHECK(tc_parse_rate("mbit", &rate) != 0);
+  CHECK(tc_parse_rate("99999999999999999999gbit", &rate) != 0);
+}
+
+TEST(tc_units, parse_class) {
+  uint32_t mark = 7;
+
+  REQUIRE(tc_parse_class("interactive", &mark) == 0);
+  CHECK(mark == TC_MARK_INTERACTIVE);
+  REQUIRE(tc_parse_class("bulk", &mark) == 0);
+  CHECK(mark == TC_MARK_BULK);
+  REQUIRE(tc_parse_class("default", &mark) == 0);
+  CHECK(mark == 0);
+  CHECK(tc_parse_class("Bulk", &mark) != 0);
+  CHECK(tc_parse_class("", &mark) != 0);
+}